@@ -3,33 +3,36 @@
 
 #include "utility.h"
 
-class aabb {
+// Axis-aligned box with corners of scalar type T, used as the aabb alias with the real
+// scalar type of the build
+template <typename T>
+class basic_aabb {
     public:
-        point3 minimum, maximum;
+        basic_vec3<T> minimum, maximum;
 
     public:
-        aabb() {}
-        aabb(const point3 &a, const point3 &b) {
+        basic_aabb() {}
+        basic_aabb(const basic_vec3<T> &a, const basic_vec3<T> &b) {
             minimum = a;
             maximum = b;
         }
 
-        point3 min() const {
+        basic_vec3<T> min() const {
             return minimum;
         }
 
-        point3 max() const {
+        basic_vec3<T> max() const {
             return maximum;
         }
 
-        bool hit(const ray &r, double t_min, double t_max) const {
+        bool hit(const basic_ray<T> &r, T t_min, T t_max) const {
             for (int a = 0; a < 3; a++) {
-                auto invD = 1.0f / r.direction()[a];
+                auto invD = 1 / r.direction()[a];
 
                 auto t0 = (minimum[a] - r.origin()[a]) * invD;
                 auto t1 = (maximum[a] - r.origin()[a]) * invD;
 
-                if (invD < 0.0f)
+                if (invD < 0)
                     std::swap(t0, t1);
 
                 t_min = t0 > t_min ? t0 : t_min;
@@ -39,23 +42,62 @@ class aabb {
                     return false;
             }
             return true;
-        }    
+        }
+
+        // Slab test with the reciprocal ray direction precomputed by the caller, used by
+        // the hierarchies that test many boxes against the same ray
+        bool hit(const basic_vec3<T> &origin, const basic_vec3<T> &inv_dir, T t_min, T t_max) const {
+            for (int a = 0; a < 3; a++) {
+                auto t0 = (minimum[a] - origin[a]) * inv_dir[a];
+                auto t1 = (maximum[a] - origin[a]) * inv_dir[a];
+                auto t_near = t0 < t1 ? t0 : t1;
+                auto t_far  = t0 < t1 ? t1 : t0;
+
+                t_min = t_near > t_min ? t_near : t_min;
+                t_max = t_far < t_max ? t_far : t_max;
+            }
+
+            return t_min <= t_max;
+        }
+
+        T surface_area() const {
+            auto d = maximum - minimum;
+
+            return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        }
+
+        // Index of the axis with the largest extent
+        int longest_axis() const {
+            auto d = maximum - minimum;
+
+            if (d.x() > d.y() and d.x() > d.z())
+                return 0;
+
+            return (d.y() > d.z()) ? 1 : 2;
+        }
+
+        basic_vec3<T> centroid() const {
+            return T(0.5) * (minimum + maximum);
+        }
 };
 
-aabb surrounding_box(aabb box_0, aabb box_1) {
-    point3 small(
+using aabb = basic_aabb<real>;
+
+template <typename T>
+inline basic_aabb<T> surrounding_box(const basic_aabb<T> &box_0, const basic_aabb<T> &box_1) {
+    basic_vec3<T> small(
         fmin(box_0.min().x(), box_1.min().x()),
         fmin(box_0.min().y(), box_1.min().y()),
         fmin(box_0.min().z(), box_1.min().z())
     );
 
-    point3 big(
-        fmin(box_0.max().x(), box_1.max().x()),
-        fmin(box_0.max().y(), box_1.max().y()),
-        fmin(box_0.max().z(), box_1.max().z())
+    basic_vec3<T> big(
+        fmax(box_0.max().x(), box_1.max().x()),
+        fmax(box_0.max().y(), box_1.max().y()),
+        fmax(box_0.max().z(), box_1.max().z())
     );
 
-    return aabb(small, big);
+    return basic_aabb<T>(small, big);
 }
 
 #endif // AABB_H
\ No newline at end of file
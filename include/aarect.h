@@ -4,20 +4,25 @@
 #include "utility.h"
 #include "hittable.h"
 
-class xy_rect : public hittable {
+class xy_rect final : public hittable {
     public:
         shared_ptr<material> mp;
-        double x0, x1, y0, y1, k;
+        real x0, x1, y0, y1, k;
 
     public:
-        xy_rect() {}
+        xy_rect() {
+            kind = xy_rect_kind;
+        }
+
         xy_rect(
-            double _x0, double _x1,
-            double _y0, double _y1,
-            double _k, shared_ptr<material> mat
-        ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {}
+            real _x0, real _x1,
+            real _y0, real _y1,
+            real _k, shared_ptr<material> mat
+        ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {
+            kind = xy_rect_kind;
+        }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             auto t = (k - r.origin().z()) / r.direction().z();
             
             if (t < t_min or t > t_max)
@@ -31,19 +36,22 @@ class xy_rect : public hittable {
             
             rec.u = (x - x0) / (x1 - x0);
             rec.v = (y - y0) / (y1 - y0);
+            rec.footprint = r.spread * t / (x1 - x0);
             rec.t = t;
             
             auto outward_normal = vec3(0.0, 0.0, 1.0);
             rec.set_face_normal(r, outward_normal);
             
-            rec.mat_ptr = mp;
+            rec.mat_ptr = mp.get();
             
-            rec.p = r.at(t);
+            // The plane coordinate is exact instead of carrying the error of the ray
+            rec.p = point3(x, y, k);
+            rec.error_magnitude = 0;
             
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
             // dimension a small amount.
             output_box = aabb(
@@ -55,21 +63,25 @@ class xy_rect : public hittable {
         }
 };
 
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
     public:
         shared_ptr<material> mp;
-        double x0, x1, z0, z1, k;
+        real x0, x1, z0, z1, k;
 
     public:
-        xz_rect() {}
+        xz_rect() {
+            kind = xz_rect_kind;
+        }
 
         xz_rect(
-            double _x0, double _x1, 
-            double _z0, double _z1, 
-            double _k, shared_ptr<material> mat
-        ) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
+            real _x0, real _x1, 
+            real _z0, real _z1, 
+            real _k, shared_ptr<material> mat
+        ) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {
+            kind = xz_rect_kind;
+        }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
             auto t = (k - r.origin().y()) / r.direction().y();
             
             if (t < t_min or t > t_max)
@@ -83,19 +95,22 @@ class xz_rect : public hittable {
             
             rec.u = (x-x0)/(x1-x0);
             rec.v = (z-z0)/(z1-z0);
+            rec.footprint = r.spread * t / (x1 - x0);
             rec.t = t;
             
             auto outward_normal = vec3(0, 1, 0);
             rec.set_face_normal(r, outward_normal);
             
-            rec.mat_ptr = mp;
+            rec.mat_ptr = mp.get();
             
-            rec.p = r.at(t);
+            // The plane coordinate is exact instead of carrying the error of the ray
+            rec.p = point3(x, k, z);
+            rec.error_magnitude = 0;
             
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
             // dimension a small amount.
             output_box = aabb(
@@ -106,10 +121,10 @@ class xz_rect : public hittable {
             return true;
         }
 
-        virtual double pdf_value(const point3& origin, const vec3& v) const override {
+        virtual real pdf_value(const point3& origin, const vec3& v) const override {
             hit_record rec;
 
-            if (!this->hit(ray(origin, v, 0), 0.001, infinity, rec))
+            if (!xz_rect::hit(ray(origin, v, 0), 0.001, infinity, rec))
                 return 0;
             
             auto area = (x1 - x0) * (z1 - z0);
@@ -130,21 +145,25 @@ class xz_rect : public hittable {
         }
 };
 
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
     public:
         shared_ptr<material> mp;
-        double y0, y1, z0, z1, k;
+        real y0, y1, z0, z1, k;
 
     public:
-        yz_rect() {}
+        yz_rect() {
+            kind = yz_rect_kind;
+        }
 
         yz_rect(
-            double _y0, double _y1, 
-            double _z0, double _z1, 
-            double _k, shared_ptr<material> mat
-        ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
+            real _y0, real _y1, 
+            real _z0, real _z1, 
+            real _k, shared_ptr<material> mat
+        ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {
+            kind = yz_rect_kind;
+        }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             auto t = (k - r.origin().x()) / r.direction().x();
             
             if (t < t_min or t > t_max)
@@ -158,19 +177,22 @@ class yz_rect : public hittable {
             
             rec.u = (y-y0)/(y1-y0);
             rec.v = (z-z0)/(z1-z0);
+            rec.footprint = r.spread * t / (y1 - y0);
             rec.t = t;
             
             auto outward_normal = vec3(1, 0, 0);
             rec.set_face_normal(r, outward_normal);
             
-            rec.mat_ptr = mp;
+            rec.mat_ptr = mp.get();
             
-            rec.p = r.at(t);
+            // The plane coordinate is exact instead of carrying the error of the ray
+            rec.p = point3(k, y, z);
+            rec.error_magnitude = 0;
             
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
             // dimension a small amount.
             output_box = aabb(
@@ -0,0 +1,222 @@
+#ifndef ACCUMULATION_BUFFER_H
+#define ACCUMULATION_BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "utility.h"
+#include "vec3.h"
+#include "framebuffer.h"
+
+// Header of a checkpoint file, followed by the sums (3 doubles per pixel), the sums of
+// squared luminances (one double per pixel) and the sample counts (one uint32 per pixel)
+struct checkpoint_header {
+    char magic[4];
+    uint32_t width, height;
+    uint32_t reserved;
+    uint64_t settings;
+};
+
+inline double luminance(const color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Estimated error of a pixel after gamma correction, from the sums of its samples and of
+// their squared luminances. The standard error of the mean luminance is scaled by the
+// slope of the square root the image is displayed with, so the threshold reads in
+// display units. That slope is steepest for dark pixels, whose noise the gamma curve
+// makes most visible, so they take more samples than bright ones of the same variance.
+inline double sample_error(const color &sum, double square_sum, uint32_t count) {
+    if (count < 2)
+        return infinity;
+
+    auto mean = luminance(sum) / count;
+    auto variance = (square_sum / count - mean * mean) * count / (count - 1);
+
+    if (!(variance > 0))
+        return 0;
+
+    return sqrt(variance / count) / (2 * sqrt(mean));
+}
+
+// Running sums of the samples of every pixel, indexed like the render loop: rows bottom
+// to top, as the camera's v grows. Sample k of a pixel always draws from
+// random_stream(pixel, k), so the sample counts are the whole random number state, and a
+// render resumed from a checkpoint produces exactly the image of an uninterrupted one.
+class accumulation_buffer {
+    public:
+        int width, height;
+        std::vector<double> sums;
+        std::vector<double> squares;
+        std::vector<uint32_t> samples;
+
+    public:
+        accumulation_buffer(int _width, int _height)
+            : width(_width), height(_height),
+              sums(3 * static_cast<size_t>(_width) * _height, 0.0),
+              squares(static_cast<size_t>(_width) * _height, 0.0),
+              samples(static_cast<size_t>(_width) * _height, 0) {}
+
+        color sum(size_t pixel) const {
+            return color(sums[3 * pixel], sums[3 * pixel + 1], sums[3 * pixel + 2]);
+        }
+
+        void set(size_t pixel, const color &sum, double square_sum, uint32_t sample_count) {
+            sums[3 * pixel] = sum.x();
+            sums[3 * pixel + 1] = sum.y();
+            sums[3 * pixel + 2] = sum.z();
+            squares[pixel] = square_sum;
+            samples[pixel] = sample_count;
+        }
+
+        double error(size_t pixel) const {
+            return sample_error(sum(pixel), squares[pixel], samples[pixel]);
+        }
+
+        uint32_t min_samples() const {
+            return samples.empty() ? 0 : *std::min_element(samples.begin(), samples.end());
+        }
+
+        // Flags the pixels that need more samples and returns how many there are. Pixels
+        // are sampled up to max_samples, but with a positive threshold they stop once they
+        // have min_samples and the error of every pixel around them is below threshold.
+        // Looking at the neighbours keeps a pixel whose first samples missed a rare bright
+        // path, such as a caustic, from stopping early.
+        size_t update_active(
+            uint32_t min_samples, uint32_t max_samples, double threshold, std::vector<uint8_t> &active
+        ) const {
+            std::vector<double> errors(samples.size());
+            for (size_t p = 0; p < samples.size(); p++)
+                errors[p] = error(p);
+
+            active.assign(samples.size(), 0);
+            size_t active_count = 0;
+
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto pixel = static_cast<size_t>(j) * width + i;
+                    bool needed = samples[pixel] < min_samples or threshold <= 0;
+
+                    for (int y = std::max(j - 1, 0); y <= std::min(j + 1, height - 1) and !needed; y++) {
+                        for (int x = std::max(i - 1, 0); x <= std::min(i + 1, width - 1); x++)
+                            needed = needed or errors[static_cast<size_t>(y) * width + x] > threshold;
+                    }
+
+                    active[pixel] = needed and samples[pixel] < max_samples;
+                    active_count += active[pixel];
+                }
+            }
+
+            return active_count;
+        }
+
+        // Debug view of the sample counts: black for none, then red, yellow and white
+        // at max_samples. The values are squared so they survive the gamma correction.
+        void sample_heatmap(framebuffer &image, uint32_t max_samples) const {
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto t = static_cast<double>(samples[static_cast<size_t>(j) * width + i]) / max_samples;
+                    auto r = clamp(3 * t, 0.0, 1.0);
+                    auto g = clamp(3 * t - 1, 0.0, 1.0);
+                    auto b = clamp(3 * t - 2, 0.0, 1.0);
+
+                    image.set(i, height - (j + 1), color(r * r, g * g, b * b));
+                }
+            }
+        }
+
+        // Averages every pixel into the image, which stores its rows top to bottom
+        void resolve(framebuffer &image) const {
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto pixel = static_cast<size_t>(j) * width + i;
+                    auto count = std::max<uint32_t>(samples[pixel], 1);
+
+                    image.set(i, height - (j + 1), sum(pixel) / count);
+                }
+            }
+        }
+
+        // Writes a checkpoint. settings identifies whatever else the samples depend on
+        // (scene, depth...), so a checkpoint can't be resumed with different ones. The
+        // data goes to a temporary file that replaces the old checkpoint only once
+        // complete, a render killed while saving still has the previous one.
+        bool save(const std::string &file_name, uint64_t settings) const {
+            auto temporary = file_name + ".tmp";
+            FILE *file = fopen(temporary.c_str(), "wb");
+
+            if (!file) {
+                std::cerr << "ERROR: Could not write checkpoint '" << file_name << "'.\n";
+                return false;
+            }
+
+            checkpoint_header header;
+            memcpy(header.magic, "RTP2", 4);
+            header.width = width;
+            header.height = height;
+            header.reserved = 0;
+            header.settings = settings;
+
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            ok = ok and fwrite(sums.data(), sizeof(double), sums.size(), file) == sums.size();
+            ok = ok and fwrite(squares.data(), sizeof(double), squares.size(), file) == squares.size();
+            ok = ok and fwrite(samples.data(), sizeof(uint32_t), samples.size(), file) == samples.size();
+            ok = (fclose(file) == 0) and ok;
+            ok = ok and rename(temporary.c_str(), file_name.c_str()) == 0;
+
+            if (!ok)
+                std::cerr << "ERROR: Could not write checkpoint '" << file_name << "'.\n";
+
+            return ok;
+        }
+
+        // Restores a checkpoint written by save for an image of the same size and the
+        // same settings. Returns false, leaving the buffer untouched, otherwise.
+        bool load(const std::string &file_name, uint64_t settings) {
+            FILE *file = fopen(file_name.c_str(), "rb");
+
+            if (!file) {
+                std::cerr << "ERROR: Could not load checkpoint '" << file_name << "'.\n";
+                return false;
+            }
+
+            checkpoint_header header;
+            std::vector<double> loaded_sums(sums.size());
+            std::vector<double> loaded_squares(squares.size());
+            std::vector<uint32_t> loaded_samples(samples.size());
+
+            bool ok = fread(&header, sizeof(header), 1, file) == 1
+                and memcmp(header.magic, "RTP2", 4) == 0;
+
+            if (ok and (header.width != static_cast<uint32_t>(width)
+                or header.height != static_cast<uint32_t>(height) or header.settings != settings)) {
+                std::cerr << "ERROR: Checkpoint '" << file_name << "' was written for other render settings.\n";
+                fclose(file);
+                return false;
+            }
+
+            ok = ok and fread(loaded_sums.data(), sizeof(double), loaded_sums.size(), file) == loaded_sums.size();
+            ok = ok and fread(loaded_squares.data(), sizeof(double), loaded_squares.size(), file) == loaded_squares.size();
+            ok = ok and fread(loaded_samples.data(), sizeof(uint32_t), loaded_samples.size(), file) == loaded_samples.size();
+            ok = ok and fgetc(file) == EOF;
+            fclose(file);
+
+            if (!ok) {
+                std::cerr << "ERROR: Invalid checkpoint '" << file_name << "'.\n";
+                return false;
+            }
+
+            sums.swap(loaded_sums);
+            squares.swap(loaded_squares);
+            samples.swap(loaded_samples);
+
+            return true;
+        }
+};
+
+#endif // ACCUMULATION_BUFFER_H
@@ -1,66 +1,101 @@
 #ifndef BOX_H
 #define BOX_H
 
+#include <utility>
+
 #include "utility.h"
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 
-class box : public hittable {
+// Axis-aligned box, intersected with a single slab test instead of as six rects. Each face
+// is textured like the rect it replaces, with u and v running along the two other axes in
+// x, y, z order.
+class box final : public hittable {
     public:
         point3 box_min, box_max;
-        hittable_list sides;
+        shared_ptr<material> mat_ptr;
 
     public:
-        box() {}
-        box(const point3 &p0, const point3 &p1, shared_ptr<material> mat_ptr) {
-            box_min = p0;
-            box_max = p1;
-
-            sides.add(make_shared<xy_rect>(
-                p0.x(), p1.x(), 
-                p0.y(), p1.y(), 
-                p1.z(), mat_ptr
-            ));
-            sides.add(make_shared<xy_rect>(
-                p0.x(), p1.x(), 
-                p0.y(), p1.y(), 
-                p0.z(), mat_ptr
-            ));
-
-            sides.add(make_shared<xz_rect>(
-                p0.x(), p1.x(), 
-                p0.z(), p1.z(), 
-                p1.y(), mat_ptr
-            ));
-            sides.add(make_shared<xz_rect>(
-                p0.x(), p1.x(), 
-                p0.z(), p1.z(), 
-                p0.y(), mat_ptr
-            ));
-
-            sides.add(make_shared<yz_rect>(
-                p0.y(), p1.y(), 
-                p0.z(), p1.z(), 
-                p1.x(), mat_ptr
-            ));
-            sides.add(make_shared<yz_rect>(
-                p0.y(), p1.y(), 
-                p0.z(), p1.z(), 
-                p0.x(), mat_ptr
-            ));
+        box() {
+            kind = box_kind;
+        }
 
+        box(const point3 &p0, const point3 &p1, shared_ptr<material> m)
+            : box_min(p0), box_max(p1), mat_ptr(m) {
+            kind = box_kind;
         }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
-            return sides.hit(r, t_min, t_max, rec);
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            auto t_enter = -infinity, t_exit = infinity;
+            int enter_axis = 0, exit_axis = 0;
+
+            // A ray parallel to a slab gets infinite distances, or NaN when it starts on one
+            // of its planes, which the comparisons skip
+            for (int a = 0; a < 3; a++) {
+                auto inv_d = 1 / r.direction()[a];
+                auto t0 = (box_min[a] - r.origin()[a]) * inv_d;
+                auto t1 = (box_max[a] - r.origin()[a]) * inv_d;
+
+                if (inv_d < 0)
+                    std::swap(t0, t1);
+
+                if (t0 > t_enter) {
+                    t_enter = t0;
+                    enter_axis = a;
+                }
+
+                if (t1 < t_exit) {
+                    t_exit = t1;
+                    exit_axis = a;
+                }
+            }
+
+            if (t_enter > t_exit)
+                return false;
+
+            // The face the ray enters through, or the one it leaves through when it starts
+            // inside the box or enters before t_min
+            int axis;
+            bool max_face;
+
+            if (t_min <= t_enter and t_enter <= t_max) {
+                rec.t = t_enter;
+                axis = enter_axis;
+                max_face = r.direction()[axis] < 0;
+            } else if (t_min <= t_exit and t_exit <= t_max) {
+                rec.t = t_exit;
+                axis = exit_axis;
+                max_face = r.direction()[axis] > 0;
+            } else {
+                return false;
+            }
+
+            // The plane coordinate is exact instead of carrying the error of the ray
+            rec.p = r.at(rec.t);
+            rec.p[axis] = max_face ? box_max[axis] : box_min[axis];
+            rec.error_magnitude = 0;
+
+            int u_axis = axis == 0 ? 1 : 0;
+            int v_axis = axis == 2 ? 1 : 2;
+
+            rec.u = (rec.p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+            rec.v = (rec.p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+            rec.footprint = r.spread * rec.t / (box_max[u_axis] - box_min[u_axis]);
+
+            vec3 outward_normal;
+            outward_normal[axis] = max_face ? 1 : -1;
+            rec.set_face_normal(r, outward_normal);
+
+            rec.mat_ptr = mat_ptr.get();
+
+            return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             output_box = aabb(box_min, box_max);
 
             return true;
         }
-    
+
 };
 
-#endif // BOX_H
\ No newline at end of file
+#endif // BOX_H
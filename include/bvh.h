@@ -2,10 +2,14 @@
 #define BVH_H
 
 #include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
 
 #include "utility.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "primitives.h"
 
 inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
     aabb box_a, box_b;
@@ -29,6 +33,226 @@ bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b)
     return box_compare(a, b, 2);
 }
 
+// Build quality levels for bvh_node. Higher levels evaluate more split candidates
+// with the surface area heuristic (SAH), trading build time for cheaper traversal.
+enum class bvh_quality {
+    fast,   // Median split along the longest centroid axis
+    medium, // Binned SAH with 12 bins along the longest centroid axis
+    high    // Binned SAH with 32 bins along all three axes
+};
+
+// Relative cost of visiting an interior node, with one primitive intersection costing 1
+const real bvh_traversal_cost = 0.125;
+
+// Subtrees with more primitives than this are built in a separate OpenMP task
+const size_t bvh_task_threshold = 1024;
+
+// Depth past which the flattened hierarchies split subtrees at the object median instead
+// of with the SAH. A median split halves the primitives, so for up to 2^32 of them no tree
+// gets deeper than twice this, which their fixed traversal stacks have room for.
+const int bvh_max_sah_depth = 32;
+
+// Summary of a hierarchy build, filled in by the builders when requested
+struct bvh_build_stats {
+    double build_time_ms = 0;
+    size_t node_count = 0;
+    size_t primitive_count = 0;
+};
+
+inline std::ostream& operator << (std::ostream &out, const bvh_build_stats &stats) {
+    return out << stats.node_count << " nodes over " << stats.primitive_count
+        << " primitives built in " << stats.build_time_ms << " ms";
+}
+
+// Per-primitive data gathered once before splitting, so the builder does not have to
+// call bounding_box() again for every comparison.
+struct bvh_build_entry {
+    aabb box;
+    point3 centroid;
+    size_t index;
+};
+
+inline aabb empty_box() {
+    return aabb(
+        point3( infinity,  infinity,  infinity),
+        point3(-infinity, -infinity, -infinity)
+    );
+}
+
+inline aabb surrounding_box(const aabb &box, const point3 &p) {
+    return surrounding_box(box, aabb(p, p));
+}
+
+std::vector<bvh_build_entry> make_build_entries(
+    const std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t end, real time0, real time1
+) {
+    std::vector<bvh_build_entry> entries(end - start);
+
+    #pragma omp parallel for
+    for (size_t i = start; i < end; i++) {
+        auto &entry = entries[i - start];
+
+        if (!objects[i]->bounding_box(time0, time1, entry.box))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+
+        entry.centroid = entry.box.centroid();
+        entry.index = i;
+    }
+
+    return entries;
+}
+
+// SAH cost of splitting a node with the given bounds into two children
+inline real sah_split_cost(
+    const aabb &bounds,
+    const aabb &box_left, size_t count_left,
+    const aabb &box_right, size_t count_right
+) {
+    return bvh_traversal_cost
+        + (box_left.surface_area() * count_left + box_right.surface_area() * count_right)
+        / bounds.surface_area();
+}
+
+// Partitions entries[start, end) in place and returns the split position. Builders with
+// leaves of several primitives pass split_cost to get the estimated SAH cost of the chosen
+// split, which they compare against the cost of making a leaf.
+size_t bvh_split(
+    std::vector<bvh_build_entry>& entries,
+    size_t start, size_t end,
+    bvh_quality quality,
+    real *split_cost = nullptr
+) {
+    auto first = entries.begin() + start;
+    auto last = entries.begin() + end;
+    size_t span = end - start;
+
+    aabb bounds = empty_box();
+    aabb centroid_bounds = empty_box();
+
+    for (auto it = first; it != last; ++it) {
+        bounds = surrounding_box(bounds, it->box);
+        centroid_bounds = surrounding_box(centroid_bounds, it->centroid);
+    }
+
+    int axis = centroid_bounds.longest_axis();
+    auto extent = centroid_bounds.max() - centroid_bounds.min();
+    size_t mid = start + span / 2;
+
+    // All centroids coincide: any partition is as good as another
+    if (extent[axis] <= 0) {
+        if (split_cost)
+            *split_cost = infinity;
+
+        return mid;
+    }
+
+    if (quality != bvh_quality::fast and span > 2) {
+        const int max_bins = 32;
+        int bin_count = (quality == bvh_quality::high) ? 32 : 12;
+        int first_axis = (quality == bvh_quality::high) ? 0 : axis;
+        int last_axis = (quality == bvh_quality::high) ? 2 : axis;
+
+        int best_axis = -1;
+        int best_bin = 0;
+        real best_cost = infinity;
+
+        for (int a = first_axis; a <= last_axis; a++) {
+            if (extent[a] <= 0)
+                continue;
+
+            aabb bin_boxes[max_bins];
+            size_t bin_counts[max_bins] = {};
+            std::fill(bin_boxes, bin_boxes + bin_count, empty_box());
+
+            auto scale = bin_count / extent[a];
+
+            for (auto it = first; it != last; ++it) {
+                int b = static_cast<int>((it->centroid[a] - centroid_bounds.min()[a]) * scale);
+                b = std::min(b, bin_count - 1);
+
+                bin_boxes[b] = surrounding_box(bin_boxes[b], it->box);
+                bin_counts[b]++;
+            }
+
+            // Sweep from the right to get the bounds of every suffix of bins
+            aabb right_boxes[max_bins];
+            size_t right_counts[max_bins];
+            aabb right_box = empty_box();
+            size_t right_count = 0;
+
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_box = surrounding_box(right_box, bin_boxes[b]);
+                right_count += bin_counts[b];
+                right_boxes[b] = right_box;
+                right_counts[b] = right_count;
+            }
+
+            // Sweep from the left evaluating the split after each bin
+            aabb left_box = empty_box();
+            size_t left_count = 0;
+
+            for (int b = 0; b < bin_count - 1; b++) {
+                left_box = surrounding_box(left_box, bin_boxes[b]);
+                left_count += bin_counts[b];
+
+                if (left_count == 0 or right_counts[b + 1] == 0)
+                    continue;
+
+                auto cost = sah_split_cost(
+                    bounds, left_box, left_count, right_boxes[b + 1], right_counts[b + 1]
+                );
+
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin = b;
+                }
+            }
+        }
+
+        if (best_axis >= 0) {
+            auto min = centroid_bounds.min()[best_axis];
+            auto scale = bin_count / extent[best_axis];
+
+            auto split = std::partition(first, last, [=](const bvh_build_entry &e) {
+                int b = static_cast<int>((e.centroid[best_axis] - min) * scale);
+                return std::min(b, bin_count - 1) <= best_bin;
+            });
+
+            mid = static_cast<size_t>(split - entries.begin());
+
+            if (mid != start and mid != end) {
+                if (split_cost)
+                    *split_cost = best_cost;
+
+                return mid;
+            }
+
+            mid = start + span / 2;
+        }
+    }
+
+    // Object median along the longest centroid axis
+    std::nth_element(first, entries.begin() + mid, last,
+        [axis](const bvh_build_entry &a, const bvh_build_entry &b) {
+            return a.centroid[axis] < b.centroid[axis];
+        }
+    );
+
+    if (split_cost) {
+        aabb box_left = empty_box(), box_right = empty_box();
+        for (size_t i = start; i < mid; i++)
+            box_left = surrounding_box(box_left, entries[i].box);
+        for (size_t i = mid; i < end; i++)
+            box_right = surrounding_box(box_right, entries[i].box);
+
+        *split_cost = sah_split_cost(bounds, box_left, mid - start, box_right, end - mid);
+    }
+
+    return mid;
+}
+
 class bvh_node : public hittable {
     public:
         shared_ptr<hittable> left, right;
@@ -38,69 +262,113 @@ class bvh_node : public hittable {
     public:
         bvh_node() {}
         
-        bvh_node(const hittable_list &list, double time_0, double time_1) {
-            bvh_node(list.objects, 0, list.objects.size(), time_0, time_1);
-        }
+        bvh_node(
+            const hittable_list &list, real time_0, real time_1,
+            bvh_quality quality = bvh_quality::medium, bvh_build_stats *stats = nullptr
+        ) : bvh_node(list.objects, 0, list.objects.size(), time_0, time_1, quality, stats) {}
 
         bvh_node(
             const std::vector<shared_ptr<hittable>>& src_objects,
-            size_t start, size_t end, double time0, double time1
+            size_t start, size_t end, real time0, real time1,
+            bvh_quality quality = bvh_quality::medium, bvh_build_stats *stats = nullptr
         ) {
-            // Create a modifiable array of the source scene objects
-            auto objects = src_objects;
-            int axis = random_int(0, 2);
-            auto comparator = (axis == 0) ? box_x_compare
-                            : (axis == 1) ? box_y_compare
-                                        : box_z_compare;
+            auto build_start = std::chrono::high_resolution_clock::now();
 
-            size_t object_span = end - start;
-
-            if (object_span == 1) {
-                left = right = objects[start];
-            } else if (object_span == 2) {
-                if (comparator(objects[start], objects[start+1])) {
-                    left = objects[start];
-                    right = objects[start+1];
-                } else {
-                    left = objects[start+1];
-                    right = objects[start];
-                }
-            } else {
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-                auto mid = start + object_span / 2;
-                left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-                right = make_shared<bvh_node>(objects, mid, end, time0, time1);
-            }
+            // The entries are partitioned in place by every level of the recursion, the
+            // source objects are only read through the entry indices
+            auto entries = make_build_entries(src_objects, start, end, time0, time1);
+            size_t node_count = 0;
 
-            aabb box_left, box_right;
-
-            if (  !left->bounding_box (time0, time1, box_left)
-                or !right->bounding_box(time0, time1, box_right)
-            )
-                std::cerr << "No bounding box in bvh_node constructor.\n";
+            #pragma omp parallel
+            #pragma omp single
+            node_count = build(entries, 0, entries.size(), src_objects, quality);
 
-            box = surrounding_box(box_left, box_right);
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
 
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = node_count;
+                stats->primitive_count = entries.size();
+            }
         }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             if (!box.hit(r, t_min, t_max))
                 return false;
 
-            bool hit_left = left->hit(r, t_min, t_max, rec);
-            bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+            bool hit_left = primitive_hit(*left, r, t_min, t_max, rec);
+            bool hit_right = primitive_hit(*right, r, t_min, hit_left ? rec.t : t_max, rec);
 
             return hit_left or hit_right;
         }
            
-        virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
+        virtual bool bounding_box(real time0, real time1, aabb &output_box) const override {
             output_box = box;
 
             return true;
         }
-};
 
+    protected:
+        // Turns this node into the root of the subtree over entries[start, end) and
+        // returns the number of nodes in it. Large subtrees are built as OpenMP tasks.
+        size_t build(
+            std::vector<bvh_build_entry> &entries, size_t start, size_t end,
+            const std::vector<shared_ptr<hittable>> &objects, bvh_quality quality
+        ) {
+            size_t object_span = end - start;
+
+            if (object_span == 1) {
+                left = right = objects[entries[start].index];
+                box = entries[start].box;
+
+                return 1;
+            }
+
+            if (object_span == 2) {
+                left = objects[entries[start].index];
+                right = objects[entries[start + 1].index];
+                box = surrounding_box(entries[start].box, entries[start + 1].box);
+
+                return 1;
+            }
+
+            // Every leaf holds a single primitive, so the node is split whatever it costs
+            auto mid = bvh_split(entries, start, end, quality);
+
+            size_t left_count = 0, right_count = 0;
+            aabb box_left, box_right;
+
+            #pragma omp task default(shared) if (mid - start > bvh_task_threshold)
+            left = build_child(entries, start, mid, objects, quality, box_left, left_count);
+
+            right = build_child(entries, mid, end, objects, quality, box_right, right_count);
 
+            #pragma omp taskwait
+
+            box = surrounding_box(box_left, box_right);
+
+            return 1 + left_count + right_count;
+        }
+
+        static shared_ptr<hittable> build_child(
+            std::vector<bvh_build_entry> &entries, size_t start, size_t end,
+            const std::vector<shared_ptr<hittable>> &objects, bvh_quality quality,
+            aabb &child_box, size_t &node_count
+        ) {
+            if (end - start == 1) {
+                child_box = entries[start].box;
+                node_count = 0;
+
+                return objects[entries[start].index];
+            }
+
+            auto node = make_shared<bvh_node>();
+            node_count = node->build(entries, start, end, objects, quality);
+            child_box = node->box;
+
+            return node;
+        }
+};
 
 #endif // BVH_H
\ No newline at end of file
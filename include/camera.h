@@ -12,22 +12,25 @@ class camera {
 
         vec3 u, v, w;
 
-        double lens_radius;
+        real lens_radius;
+
+        // Width of a pixel on the focus plane, which the rays reach at t = 1
+        real pixel_spread = 0;
 
         // Shutter open/close times
-        double time_0, time_1;
+        real time_0, time_1;
 
     public:
         camera(
             point3 lookfrom,
             point3 lookat,
             vec3   vup,
-            double vfov, // Vertical field-of-view in degrees
-            double aspect_ratio,
-            double aperture,
-            double focus_dist,
-            double _time_0 = 0,
-            double _time_1 = 1
+            real vfov, // Vertical field-of-view in degrees
+            real aspect_ratio,
+            real aperture,
+            real focus_dist,
+            real _time_0 = 0,
+            real _time_1 = 1
         ) {
             auto theta = degrees_to_radians(vfov);
             auto h = tan(theta / 2);
@@ -49,17 +52,24 @@ class camera {
             time_1 = _time_1;
         }
 
-        ray get_ray(double s, double t) const {
+        // Gives the rays the spread of a pixel of an image image_height pixels high
+        void set_image_height(int image_height) {
+            pixel_spread = vertical.length() / image_height;
+        }
+
+        ray get_ray(real s, real t) const {
             vec3 rd = lens_radius * random_in_unit_disk();
             vec3 offset = u * rd.x() + v * rd.y();
 
-            return ray(
+            ray r(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
                 random_double(time_0, time_1)
             );
+            r.spread = pixel_spread;
+
+            return r;
         }
-    
 };
 
 #endif // CAMERA_H
\ No newline at end of file
@@ -2,7 +2,6 @@
 #define COLOR_H
 
 #include <iostream>
-#include <sstream>
 
 #include "utility.h"
 #include "vec3.h"
@@ -30,28 +29,4 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
         << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 }
 
-std::string get_color(color pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    // Replace NaN components with zero
-    if (r != r) r = 0.0;
-    if (g != g) g = 0.0;
-    if (b != b) b = 0.0;
-
-    // Divide the color by the number of samples and gamma-correct for gamma = 2
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(r * scale);
-    g = sqrt(g * scale);
-    b = sqrt(b * scale);
-
-    std::stringstream ss;
-    ss << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999));
-
-    return ss.str();
-}
-
 #endif  // COLOR_H
\ No newline at end of file
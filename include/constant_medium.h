@@ -4,38 +4,39 @@
 #include "utility.h"
 #include "hittable.h"
 #include "material.h"
+#include "primitives.h"
 #include "texture.h"
 
 class constant_medium : public hittable {
     public:
         shared_ptr<hittable> boundary;
         shared_ptr<material> phase_function;
-        double neg_inv_density;
+        real neg_inv_density;
 
     public:
-        constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a) {
+        constant_medium(shared_ptr<hittable> b, real d, shared_ptr<texture> a) {
             boundary = b;
             neg_inv_density = -1 / d; 
             phase_function = make_shared<isotropic>(a);
         } 
 
-        constant_medium(shared_ptr<hittable> b, double d, color c) {
+        constant_medium(shared_ptr<hittable> b, real d, color c) {
             boundary = b;
             neg_inv_density = -1 / d;
             phase_function = make_shared<isotropic>(c);
         }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
             // Print occasional samples when debugging. To enable, set enableDebug true.
             const bool enableDebug = false;
             const bool debugging = enableDebug && random_double() < 0.00001;
 
             hit_record rec1, rec2;
 
-            if (!boundary->hit(r, -infinity, infinity, rec1))
+            if (!primitive_hit(*boundary, r, -infinity, infinity, rec1))
                 return false;
 
-            if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+            if (!primitive_hit(*boundary, r, rec1.t+0.0001, infinity, rec2))
                 return false;
 
             if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
@@ -58,6 +59,8 @@ class constant_medium : public hittable {
 
             rec.t = rec1.t + hit_distance / ray_length;
             rec.p = r.at(rec.t);
+            rec.error_magnitude = 0;
+            rec.footprint = 0;
 
             if (debugging) {
                 std::cerr << "hit_distance = " <<  hit_distance << '\n'
@@ -67,12 +70,12 @@ class constant_medium : public hittable {
 
             rec.normal = vec3(1, 0, 0);  // arbitrary
             rec.front_face = true;     // also arbitrary
-            rec.mat_ptr = phase_function;
+            rec.mat_ptr = phase_function.get();
 
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb& output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb& output_box) const override {
             return boundary->bounding_box(time_0, time_1, output_box);
         }
     
@@ -0,0 +1,492 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "accumulation_buffer.h"
+#include "render_scheduler.h"
+
+// Distributed rendering. A coordinator process deals the tiles of every pass to worker
+// processes over TCP. A tile is sent with the sums its pixels have so far, and the worker
+// sends it back with the samples of the pass added. The sample k of a pixel always draws
+// from random_stream(pixel, k), so a tile gives the same sums whichever worker renders
+// it, and the image is the one a single process would render. The coordinator keeps the
+// only copy of the image: tiles in flight on a worker that disconnects or stops answering
+// are simply dealt again.
+//
+// Workers run the same build with the same arguments as the coordinator, they are refused
+// when their image size or settings differ. The messages are sent in the native byte order.
+
+// Sent by a worker when it connects, the coordinator answers with a uint32, 1 if accepted
+struct worker_hello {
+    char magic[4];
+    uint32_t width, height;
+    uint32_t threads;
+    uint64_t settings;
+};
+
+// A tile to render, or a rendered one, followed by the state of its pixels row by row
+struct tile_message {
+    uint32_t index;
+    render_tile tile;
+};
+
+// Sums of a pixel before the pass when sent to a worker, after it when sent back
+struct pixel_state {
+    double sum[3];
+    double square_sum;
+    uint32_t samples;
+    uint32_t active;
+};
+
+inline bool send_all(int socket, const void *data, size_t size) {
+    auto bytes = static_cast<const char *>(data);
+
+    while (size > 0) {
+        auto sent = send(socket, bytes, size, MSG_NOSIGNAL);
+
+        if (sent < 0 and errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+inline bool receive_all(int socket, void *data, size_t size) {
+    auto bytes = static_cast<char *>(data);
+
+    while (size > 0) {
+        auto received = recv(socket, bytes, size, 0);
+
+        if (received < 0 and errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+
+        bytes += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+inline size_t tile_pixels(const render_tile &tile) {
+    return static_cast<size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+}
+
+inline bool send_tile(int socket, uint32_t index, const render_tile &tile, const accumulation_buffer &buffer, const std::vector<uint8_t> &active) {
+    std::vector<pixel_state> states;
+    states.reserve(tile_pixels(tile));
+
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            auto pixel = static_cast<size_t>(j) * buffer.width + i;
+            pixel_state state;
+
+            for (int a = 0; a < 3; a++)
+                state.sum[a] = buffer.sums[3 * pixel + a];
+
+            state.square_sum = buffer.squares[pixel];
+            state.samples = buffer.samples[pixel];
+            state.active = active[pixel];
+            states.push_back(state);
+        }
+    }
+
+    tile_message message = {index, tile};
+
+    return send_all(socket, &message, sizeof(message))
+        and send_all(socket, states.data(), states.size() * sizeof(pixel_state));
+}
+
+// Receives a tile sent by send_tile, its pixels into states. Returns false when the
+// connection fails or the tile isn't inside a width x height image.
+inline bool receive_tile(int socket, int width, int height, uint32_t &index, render_tile &tile, std::vector<pixel_state> &states) {
+    tile_message message;
+
+    if (!receive_all(socket, &message, sizeof(message)))
+        return false;
+
+    index = message.index;
+    tile = message.tile;
+
+    if (tile.x0 < 0 or tile.y0 < 0 or tile.x1 > width or tile.y1 > height
+        or tile.x0 >= tile.x1 or tile.y0 >= tile.y1)
+        return false;
+
+    states.resize(tile_pixels(tile));
+
+    return receive_all(socket, states.data(), states.size() * sizeof(pixel_state));
+}
+
+// Writes the pixels of a received tile into buffer, and into active when given
+inline void merge_tile(const render_tile &tile, const std::vector<pixel_state> &states, accumulation_buffer &buffer, std::vector<uint8_t> *active) {
+    size_t k = 0;
+
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            auto pixel = static_cast<size_t>(j) * buffer.width + i;
+            auto &state = states[k++];
+
+            buffer.set(pixel, color(state.sum[0], state.sum[1], state.sum[2]), state.square_sum, state.samples);
+
+            if (active)
+                (*active)[pixel] = state.active != 0;
+        }
+    }
+}
+
+// Listens for workers and deals them the tiles of each pass. Workers may connect or
+// leave at any time, they stay connected from one pass to the next.
+class render_coordinator {
+    public:
+        struct worker {
+            int socket;
+            uint32_t threads;
+
+            // Tiles sent and not received back yet
+            std::vector<uint32_t> jobs;
+            std::chrono::steady_clock::time_point last_message;
+        };
+
+        int width, height;
+        uint64_t settings;
+
+        // Seconds a worker with tiles in flight may stay silent before it is dropped
+        double timeout;
+
+        int listener;
+        uint16_t port;
+        std::vector<worker> workers;
+
+    public:
+        render_coordinator(int _width, int _height, uint64_t _settings, double _timeout = 300.0)
+            : width(_width), height(_height), settings(_settings), timeout(_timeout), listener(-1), port(0) {}
+
+        ~render_coordinator() {
+            for (auto &w : workers)
+                close(w.socket);
+
+            if (listener >= 0)
+                close(listener);
+        }
+
+        bool listening() const {
+            return listener >= 0;
+        }
+
+        // Listens on every interface, a port of 0 picks a free one and stores it in port
+        bool listen(uint16_t _port) {
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+
+            int yes = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(_port);
+            socklen_t length = sizeof(address);
+
+            if (listener < 0 or bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+                or ::listen(listener, 16) != 0
+                or getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+                std::cerr << "ERROR: Could not listen on port " << _port << ": " << strerror(errno) << ".\n";
+
+                if (listener >= 0)
+                    close(listener);
+                listener = -1;
+
+                return false;
+            }
+
+            port = ntohs(address.sin_port);
+
+            return true;
+        }
+
+        // Renders the tiles with at least one active pixel on the workers, merging them
+        // into buffer. Waits for workers when none is connected. progress is called with
+        // the number of tiles done.
+        void run(
+            const std::vector<render_tile> &tiles, accumulation_buffer &buffer, const std::vector<uint8_t> &active,
+            const std::function<void(size_t done, size_t total)> &progress = nullptr
+        ) {
+            std::deque<uint32_t> pending;
+            size_t done = 0;
+
+            // Scratch for the pixels of a received tile until it is validated
+            std::vector<pixel_state> states;
+
+            for (size_t t = 0; t < tiles.size(); t++) {
+                bool any_active = false;
+
+                for (int j = tiles[t].y0; j < tiles[t].y1 and !any_active; j++) {
+                    for (int i = tiles[t].x0; i < tiles[t].x1; i++)
+                        any_active = any_active or active[static_cast<size_t>(j) * width + i];
+                }
+
+                if (any_active)
+                    pending.push_back(static_cast<uint32_t>(t));
+                else
+                    done++;
+            }
+
+            std::vector<pollfd> polled;
+
+            while (done < tiles.size()) {
+                deal(tiles, pending, buffer, active);
+
+                polled.assign(1, pollfd{listener, POLLIN, 0});
+                for (auto &w : workers)
+                    polled.push_back(pollfd{w.socket, POLLIN, 0});
+
+                if (poll(polled.data(), polled.size(), 1000) < 0 and errno != EINTR) {
+                    std::cerr << "ERROR: poll failed: " << strerror(errno) << ".\n";
+                    return;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                std::vector<bool> lost(workers.size(), false);
+
+                for (size_t k = 0; k < workers.size(); k++) {
+                    auto &w = workers[k];
+
+                    if (polled[k + 1].revents) {
+                        uint32_t index;
+                        render_tile tile;
+
+                        // Only a tile this worker was dealt, with the bounds it was dealt
+                        // with, is merged. Anything else drops the worker and leaves the
+                        // buffer untouched.
+                        auto job = w.jobs.end();
+                        lost[k] = !receive_tile(w.socket, buffer.width, buffer.height, index, tile, states)
+                            or (job = std::find(w.jobs.begin(), w.jobs.end(), index)) == w.jobs.end()
+                            or tile.x0 != tiles[index].x0 or tile.y0 != tiles[index].y0
+                            or tile.x1 != tiles[index].x1 or tile.y1 != tiles[index].y1;
+
+                        if (lost[k])
+                            continue;
+
+                        merge_tile(tile, states, buffer, nullptr);
+                        w.jobs.erase(job);
+                        w.last_message = now;
+                        done++;
+                    } else if (!w.jobs.empty() and std::chrono::duration<double>(now - w.last_message).count() > timeout) {
+                        lost[k] = true;
+                    }
+                }
+
+                // Tiles in flight on lost workers go back to the front of the queue
+                for (size_t k = workers.size(); k-- > 0; ) {
+                    if (!lost[k])
+                        continue;
+
+                    std::cerr << "\nWorker lost, dealing its " << workers[k].jobs.size() << " tiles again\n";
+
+                    pending.insert(pending.begin(), workers[k].jobs.begin(), workers[k].jobs.end());
+                    close(workers[k].socket);
+                    workers.erase(workers.begin() + k);
+                }
+
+                if (polled[0].revents)
+                    accept_worker();
+
+                if (progress)
+                    progress(done, tiles.size());
+            }
+        }
+
+    protected:
+        void accept_worker() {
+            int connection = accept(listener, nullptr, nullptr);
+
+            if (connection < 0)
+                return;
+
+            // A worker stuck in the middle of a message must not hang the render
+            timeval limit;
+            limit.tv_sec = static_cast<time_t>(timeout);
+            limit.tv_usec = 0;
+            setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+            setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+
+            int yes = 1;
+            setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+            worker_hello hello;
+            bool ok = receive_all(connection, &hello, sizeof(hello))
+                and memcmp(hello.magic, "RTW1", 4) == 0
+                and hello.width == static_cast<uint32_t>(width) and hello.height == static_cast<uint32_t>(height)
+                and hello.settings == settings;
+
+            uint32_t accepted = ok;
+            send_all(connection, &accepted, sizeof(accepted));
+
+            if (!ok) {
+                std::cerr << "\nRefused a worker rendering other settings\n";
+                close(connection);
+                return;
+            }
+
+            std::cerr << "\nWorker connected with " << hello.threads << " threads\n";
+
+            worker w;
+            w.socket = connection;
+            w.threads = std::max(hello.threads, 1u);
+            w.last_message = std::chrono::steady_clock::now();
+            workers.push_back(w);
+        }
+
+        // Keeps two tiles per thread in flight on every worker, so they never wait for
+        // the next tile
+        void deal(
+            const std::vector<render_tile> &tiles, std::deque<uint32_t> &pending,
+            const accumulation_buffer &buffer, const std::vector<uint8_t> &active
+        ) {
+            for (auto &w : workers) {
+                if (w.jobs.empty())
+                    w.last_message = std::chrono::steady_clock::now();
+
+                while (!pending.empty() and w.jobs.size() < 2 * w.threads) {
+                    auto index = pending.front();
+
+                    // A failed send shows up as a lost connection when polled
+                    if (!send_tile(w.socket, index, tiles[index], buffer, active))
+                        break;
+
+                    pending.pop_front();
+                    w.jobs.push_back(index);
+                }
+            }
+        }
+};
+
+// Opens a connection to host:port, returns the socket or -1
+inline int connect_to(const std::string &host, uint16_t port) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *addresses = nullptr;
+    int connection = -1;
+
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return -1;
+
+    for (auto a = addresses; a and connection < 0; a = a->ai_next) {
+        connection = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+        if (connection >= 0 and connect(connection, a->ai_addr, a->ai_addrlen) != 0) {
+            close(connection);
+            connection = -1;
+        }
+    }
+
+    freeaddrinfo(addresses);
+
+    return connection;
+}
+
+// Connects to the coordinator at host:port and renders the tiles it sends, up to
+// thread_count at a time, until it closes the connection. buffer and active are images of
+// the render's size, render renders a tile of them. Returns false when the connection
+// fails or the coordinator refuses the worker.
+inline bool serve_render(
+    const std::string &host, uint16_t port, uint64_t settings, int thread_count,
+    accumulation_buffer &buffer, std::vector<uint8_t> &active,
+    const std::function<void(const render_tile &)> &render
+) {
+    int connection = connect_to(host, port);
+
+    if (connection < 0) {
+        std::cerr << "ERROR: Could not connect to " << host << ':' << port << ".\n";
+        return false;
+    }
+
+    int yes = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    worker_hello hello;
+    memcpy(hello.magic, "RTW1", 4);
+    hello.width = buffer.width;
+    hello.height = buffer.height;
+    hello.threads = thread_count;
+    hello.settings = settings;
+
+    uint32_t accepted = 0;
+
+    if (!send_all(connection, &hello, sizeof(hello)) or !receive_all(connection, &accepted, sizeof(accepted)) or !accepted) {
+        std::cerr << "ERROR: The coordinator at " << host << ':' << port << " refused this worker.\n";
+        close(connection);
+        return false;
+    }
+
+    active.assign(static_cast<size_t>(buffer.width) * buffer.height, 0);
+
+    std::vector<uint32_t> indices;
+    std::vector<render_tile> tiles;
+    std::vector<pixel_state> states;
+    bool connected = true;
+
+    while (connected) {
+        indices.clear();
+        tiles.clear();
+
+        // Waits for a tile, then takes the ones already arrived, up to one per thread
+        do {
+            uint32_t index;
+            render_tile tile;
+
+            if (!receive_tile(connection, buffer.width, buffer.height, index, tile, states)) {
+                connected = false;
+                break;
+            }
+
+            merge_tile(tile, states, buffer, &active);
+
+            indices.push_back(index);
+            tiles.push_back(tile);
+
+            pollfd waiting = {connection, POLLIN, 0};
+            if (poll(&waiting, 1, 0) <= 0)
+                break;
+        } while (tiles.size() < static_cast<size_t>(thread_count));
+
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(thread_count)
+        for (size_t k = 0; k < tiles.size(); k++)
+            render(tiles[k]);
+
+        for (size_t k = 0; k < tiles.size() and connected; k++)
+            connected = send_tile(connection, indices[k], tiles[k], buffer, active);
+    }
+
+    close(connection);
+
+    return true;
+}
+
+#endif // DISTRIBUTED_H
@@ -0,0 +1,140 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "./external/stb_image_write.h"
+
+#include "utility.h"
+#include "vec3.h"
+
+// Linear RGB image stored as one contiguous float array, top row first. Pixels hold the
+// average of their samples, and are only tonemapped when the image is written.
+class framebuffer {
+    public:
+        int width, height;
+        std::vector<float> pixels;
+
+    public:
+        framebuffer(int _width, int _height)
+            : width(_width), height(_height), pixels(3 * static_cast<size_t>(_width) * _height, 0.0f) {}
+
+        void set(int x, int y, const color &c) {
+            auto *p = &pixels[3 * (static_cast<size_t>(y) * width + x)];
+            p[0] = static_cast<float>(c.x());
+            p[1] = static_cast<float>(c.y());
+            p[2] = static_cast<float>(c.z());
+        }
+
+        // Gamma 2 corrected 8 bit values: NaN becomes zero, then sqrt, clamp to [0, 0.999]
+        // and scale by 256, the same mapping write_color applies to a single pixel
+        std::vector<uint8_t> to_rgb8() const {
+            std::vector<uint8_t> out(pixels.size());
+            size_t i = 0;
+
+#if defined(__AVX__)
+            auto zero = _mm256_setzero_ps();
+            auto upper = _mm256_set1_ps(0.999f);
+            auto scale = _mm256_set1_ps(256.0f);
+
+            for (; i + 8 <= pixels.size(); i += 8) {
+                auto v = _mm256_loadu_ps(&pixels[i]);
+
+                // max with zero as the second operand also turns NaN into zero
+                v = _mm256_max_ps(v, zero);
+                v = _mm256_min_ps(_mm256_sqrt_ps(v), upper);
+
+                alignas(32) int32_t q[8];
+                _mm256_store_si256(reinterpret_cast<__m256i *>(q), _mm256_cvttps_epi32(_mm256_mul_ps(v, scale)));
+
+                for (int k = 0; k < 8; k++)
+                    out[i + k] = static_cast<uint8_t>(q[k]);
+            }
+#endif
+
+            for (; i < pixels.size(); i++) {
+                auto v = pixels[i];
+                v = (v > 0.0f) ? v : 0.0f;
+                v = std::sqrt(v);
+                v = (v < 0.999f) ? v : 0.999f;
+
+                out[i] = static_cast<uint8_t>(256.0f * v);
+            }
+
+            return out;
+        }
+
+        // Binary PPM
+        void write_ppm(std::ostream &out) const {
+            auto rgb = to_rgb8();
+
+            out << "P6\n" << width << ' ' << height << "\n255\n";
+            out.write(reinterpret_cast<const char *>(rgb.data()), rgb.size());
+        }
+
+        bool write_png(const char *file_name) const {
+            auto rgb = to_rgb8();
+
+            return stbi_write_png(file_name, width, height, 3, rgb.data(), 3 * width) != 0;
+        }
+
+        // Portable float map with the untouched linear values, for HDR tools. PFM stores
+        // rows bottom to top, and the negative scale marks little-endian floats.
+        bool write_pfm(const char *file_name) const {
+            FILE *file = fopen(file_name, "wb");
+            if (!file)
+                return false;
+
+            fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+            bool ok = true;
+            for (int y = height - 1; y >= 0; y--) {
+                const auto *row = &pixels[3 * static_cast<size_t>(y) * width];
+                ok = ok and fwrite(row, sizeof(float), 3 * width, file) == static_cast<size_t>(3 * width);
+            }
+
+            return (fclose(file) == 0) and ok;
+        }
+
+        // Picks the format from the file extension: .png, .pfm, anything else is PPM.
+        // An empty name writes PPM to stdout.
+        bool write(const std::string &file_name) const {
+            auto ends_with = [&](const char *extension) {
+                std::string e(extension);
+                return file_name.size() >= e.size()
+                    and file_name.compare(file_name.size() - e.size(), e.size(), e) == 0;
+            };
+
+            bool ok;
+
+            if (file_name.empty()) {
+                write_ppm(std::cout);
+                ok = bool(std::cout);
+            } else if (ends_with(".png")) {
+                ok = write_png(file_name.c_str());
+            } else if (ends_with(".pfm")) {
+                ok = write_pfm(file_name.c_str());
+            } else {
+                std::ofstream file(file_name, std::ios::binary);
+                write_ppm(file);
+                ok = bool(file);
+            }
+
+            if (!ok)
+                std::cerr << "ERROR: Could not write image '" << file_name << "'.\n";
+
+            return ok;
+        }
+};
+
+#endif // FRAMEBUFFER_H
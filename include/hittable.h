@@ -2,31 +2,70 @@
 #define HITTABLE_H
 
 #include "aabb.h"
+#include "ray_packet.h"
 
 class material;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    double t;
-    double u;
-    double v;
+    real t;
+    real u;
+    real v;
     bool front_face;
 
-    shared_ptr<material> mat_ptr;
+    // Magnitude of the coordinates p was computed from, which its rounding error is
+    // relative to, when larger than p itself (a point of a large sphere next to the world
+    // origin). Primitives set it with p, so spawn_ray offsets rays past the error.
+    real error_magnitude = 0;
+
+    // Width of the cone of the ray at p, as a fraction of the range of u across the
+    // primitive, which image textures pick their level of detail from. Zero when the ray
+    // carries no cone or the primitive has no such range, for the finest level.
+    real footprint = 0;
+
+    // Not owned: the primitives keep their materials alive for as long as the scene
+    // exists, so copying a record doesn't touch any reference count
+    const material *mat_ptr = nullptr;
 
     inline void set_face_normal(const ray &r, const vec3 &outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Ray leaving the hit point in direction. It starts just off the surface on the side
+    // it leaves by, so it can be traced from t = 0 without hitting the surface again.
+    inline ray spawn_ray(const vec3 &direction, real time) const {
+        auto side = dot(direction, normal) < 0 ? -normal : normal;
+
+        return ray(offset_ray_origin(p, side, std::max(max_magnitude(p), error_magnitude)), direction, time);
+    }
 };
 
 class hittable {
     public:
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const = 0;
+        // The built-in primitive this is, which the dispatch functions of primitives.h call
+        // without going through the virtual functions. Anything else is other_kind. The
+        // built-in primitives are final, so an overridden hit() can't be skipped by a kind
+        // inherited from one of them.
+        enum hittable_kind { other_kind, sphere_kind, moving_sphere_kind, xy_rect_kind, xz_rect_kind, yz_rect_kind, box_kind };
+
+        hittable_kind kind = other_kind;
+
+    public:
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const = 0;
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const = 0;
+
+        // Traces every ray of the packet, storing the result of each one in hits and recs
+        // like hit() does. Hierarchies override it to traverse with the whole packet.
+        virtual void hit_packet(
+            const ray_packet &packet, real t_min, real t_max, hit_record *recs, bool *hits
+        ) const {
+            for (int i = 0; i < packet.size; i++)
+                hits[i] = hit(packet.rays[i], t_min, t_max, recs[i]);
+        }
 
-        virtual double pdf_value(const point3& o, const vec3& v) const {
+        virtual real pdf_value(const point3& o, const vec3& v) const {
             return 0.0;
         }
 
@@ -44,19 +83,20 @@ class translate : public hittable {
         translate(shared_ptr<hittable> p, const vec3 &displacement) 
             : obj_ptr(p), offset(displacement) {}
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             ray moved_ray(r.origin() - offset, r.direction(), r.time());
 
             if (!obj_ptr->hit(moved_ray, t_min, t_max, rec))
                 return false;
             
+            rec.error_magnitude = std::max(rec.error_magnitude, std::max(max_magnitude(rec.p), max_magnitude(offset)));
             rec.p += offset;
             rec.set_face_normal(moved_ray, rec.normal);
 
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             if (!obj_ptr->bounding_box(time_0, time_1, output_box)) 
                 return false;
 
@@ -72,12 +112,12 @@ class translate : public hittable {
 class rotate_y : public hittable {
     public:
         shared_ptr<hittable> obj_ptr;
-        double sin_theta, cos_theta;
+        real sin_theta, cos_theta;
         bool has_box;
         aabb bbox;
 
     public:
-        rotate_y(shared_ptr<hittable> p, double angle) : obj_ptr(p) {
+        rotate_y(shared_ptr<hittable> p, real angle) : obj_ptr(p) {
             auto radians = degrees_to_radians(angle);
             sin_theta = sin(radians);
             cos_theta = cos(radians);
@@ -111,7 +151,7 @@ class rotate_y : public hittable {
             bbox = aabb(min, max);
         }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             auto origin = r.origin();
             auto direction = r.direction();
 
@@ -135,13 +175,14 @@ class rotate_y : public hittable {
             normal[0] =  cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
             normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
+            rec.error_magnitude = std::max(rec.error_magnitude, max_magnitude(rec.p));
             rec.p = p;
             rec.set_face_normal(rotated_r, normal);
 
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             output_box = bbox;
 
             return has_box;
@@ -156,7 +197,7 @@ class flip_face : public hittable {
     public:
         flip_face(shared_ptr<hittable> p) : ptr(p) {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
 
             if (!ptr->hit(r, t_min, t_max, rec))
                 return false;
@@ -165,7 +206,7 @@ class flip_face : public hittable {
             return true;
         }
 
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
             return ptr->bounding_box(time0, time1, output_box);
         }       
 };  
@@ -2,6 +2,7 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "primitives.h"
 
 #include <memory>
 #include <vector>
@@ -27,14 +28,14 @@ class hittable_list : public hittable {
             objects.push_back(object);
         }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             hit_record temp_rec;
 
             bool hit_anything = false;
             auto closest_so_far = t_max;
 
             for (const auto &object : objects) {
-                if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+                if (primitive_hit(*object, r, t_min, closest_so_far, temp_rec)) {
                     hit_anything = true;
                     closest_so_far = temp_rec.t;
                     rec = temp_rec;
@@ -44,7 +45,7 @@ class hittable_list : public hittable {
             return hit_anything;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             if (objects.empty())
                 return false;
             
@@ -62,12 +63,12 @@ class hittable_list : public hittable {
             return true;
         }
 
-        double pdf_value(const point3& o, const vec3& v) const {
+        real pdf_value(const point3& o, const vec3& v) const {
             auto weight = 1.0/objects.size();
             auto sum = 0.0;
 
             for (const auto& object : objects)
-                sum += weight * object->pdf_value(o, v);
+                sum += weight * primitive_pdf_value(*object, o, v);
 
             return sum;
         }
@@ -75,7 +76,7 @@ class hittable_list : public hittable {
         vec3 random(const vec3& o) const {
             auto int_size = static_cast<int>(objects.size());
 
-            return objects[random_int(0, int_size - 1)]->random(o);
+            return primitive_random(*objects[random_int(0, int_size - 1)], o);
         }
 };
 
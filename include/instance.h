@@ -0,0 +1,69 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utility.h"
+#include "hittable.h"
+#include "transform.h"
+#include "primitives.h"
+
+// Placement of a shared bottom-level hierarchy in the world. Any number of instances can
+// point at the same object (typically a bvh8 or linear_bvh built once), so its geometry
+// is stored once no matter how many copies are placed. A top-level hierarchy built over a
+// hittable_list of instances makes tracing thousands of copies logarithmic.
+class instance : public hittable {
+    public:
+        shared_ptr<hittable> object;
+        transform object_to_world;
+        transform world_to_object;
+
+        // Average scale of world_to_object, which turns the width of a ray cone into
+        // object space, exactly for a uniform scaling
+        real spread_scale;
+
+    public:
+        instance(shared_ptr<hittable> obj, const transform &_object_to_world)
+            : object(obj), object_to_world(_object_to_world) {
+            world_to_object = object_to_world.inverse();
+            spread_scale = (
+                world_to_object.vector(vec3(1, 0, 0)).length()
+                + world_to_object.vector(vec3(0, 1, 0)).length()
+                + world_to_object.vector(vec3(0, 0, 1)).length()
+            ) / 3;
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            // The direction is not renormalized, so t is the same in both spaces
+            ray object_ray(
+                world_to_object.point(r.origin()),
+                world_to_object.vector(r.direction()),
+                r.time()
+            );
+            object_ray.spread = r.spread * spread_scale;
+
+            if (!primitive_hit(*object, object_ray, t_min, t_max, rec))
+                return false;
+
+            // The object already oriented the normal against the ray, which an affine
+            // transform preserves, so front_face stays valid. The point is transformed
+            // rather than recomputed from the world ray, keeping the object's precision.
+            rec.error_magnitude = object_to_world.magnitude(std::max(max_magnitude(rec.p), rec.error_magnitude));
+            rec.p = object_to_world.point(rec.p);
+            rec.normal = unit_vector(world_to_object.normal(rec.normal));
+
+            return true;
+        }
+
+        // The box of the object over the same interval, a moving object's box depending on it
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
+            aabb object_box;
+
+            if (!object->bounding_box(time_0, time_1, object_box))
+                return false;
+
+            output_box = object_to_world.box(object_box);
+
+            return true;
+        }
+};
+
+#endif // INSTANCE_H
@@ -0,0 +1,58 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "utility.h"
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+
+// Bounces after which paths take part in Russian roulette
+const int roulette_bounces = 3;
+
+// One bounce of a path at the hit rec of the ray current: adds the light emitted there to
+// radiance, and turns current into the next ray, with throughput multiplied by the weight
+// of the bounce. Diffuse bounces sample half of the time towards the lights. Returns false
+// when the material absorbs the path.
+inline bool scatter_path(
+    ray &current, const hit_record &rec, const shared_ptr<hittable> &lights, color &throughput, color &radiance
+) {
+    scatter_record srec;
+    radiance += throughput * material_emitted(*rec.mat_ptr, current, rec, rec.u, rec.v, rec.p);
+
+    if (!material_scatter(*rec.mat_ptr, current, rec, srec))
+        return false;
+
+    if (srec.is_specular) {
+        throughput = throughput * srec.attenuation;
+        current = srec.specular_ray;
+
+        return true;
+    }
+
+    mixture_pdf p(hittable_pdf(*lights, rec.p), srec.direction_pdf);
+
+    ray scattered = rec.spawn_ray(p.generate(), current.time());
+    auto pdf_val = p.value(scattered.direction());
+
+    throughput = throughput * srec.attenuation
+        * material_scattering_pdf(*rec.mat_ptr, current, rec, scattered) / pdf_val;
+    current = scattered;
+
+    return true;
+}
+
+// Russian roulette: the path survives with a probability equal to its largest throughput
+// component, and survivors are divided by it, so the estimate stays unbiased while dim
+// paths stop early. Returns false when the path is ended.
+inline bool survive_roulette(color &throughput) {
+    auto survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 1.0);
+
+    if (!(random_double() < survival))
+        return false;
+
+    throughput /= survival;
+
+    return true;
+}
+
+#endif // INTEGRATOR_H
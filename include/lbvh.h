@@ -0,0 +1,480 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "utility.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+
+// Number of bits of the Morton codes used to sort the primitives. 30 bit codes quantize
+// each axis to 1024 cells, 63 bit codes to about two million.
+enum class morton_precision {
+    bits_30,
+    bits_63
+};
+
+// Spreads the lower 10 bits of v so there are two zero bits between each of them
+inline uint64_t expand_bits_10(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+
+    return v;
+}
+
+// Spreads the lower 21 bits of v so there are two zero bits between each of them
+inline uint64_t expand_bits_21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffULL;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+    v = (v | (v <<  8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v <<  4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v <<  2)) & 0x1249249249249249ULL;
+
+    return v;
+}
+
+// Morton code of a point with coordinates in [0, 1]
+inline uint64_t morton_code(const point3 &p, morton_precision precision) {
+    auto scale = (precision == morton_precision::bits_30) ? 1024.0 : 2097152.0;
+    uint64_t cell[3];
+
+    for (int a = 0; a < 3; a++)
+        cell[a] = static_cast<uint64_t>(clamp(p[a] * scale, 0.0, scale - 1));
+
+    if (precision == morton_precision::bits_30)
+        return (expand_bits_10(cell[0]) << 2) | (expand_bits_10(cell[1]) << 1) | expand_bits_10(cell[2]);
+
+    return (expand_bits_21(cell[0]) << 2) | (expand_bits_21(cell[1]) << 1) | expand_bits_21(cell[2]);
+}
+
+// Least significant digit radix sort of keys, carrying values along. Each pass splits the
+// array into one chunk per thread: the chunks are histogrammed in parallel, a prefix sum
+// over (digit, chunk) gives every chunk its output offsets, and the chunks are scattered
+// in parallel.
+inline void radix_sort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int key_bits) {
+    const int radix_bits = 8;
+    const int buckets = 1 << radix_bits;
+
+    auto n = keys.size();
+    std::vector<uint64_t> keys_tmp(n);
+    std::vector<uint32_t> values_tmp(n);
+
+    #ifdef _OPENMP
+    int chunk_count = omp_get_max_threads();
+    #else
+    int chunk_count = 1;
+    #endif
+    auto chunk_size = (n + chunk_count - 1) / chunk_count;
+
+    std::vector<size_t> offsets(static_cast<size_t>(chunk_count) * buckets);
+
+    for (int shift = 0; shift < key_bits; shift += radix_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        #pragma omp parallel for schedule(static)
+        for (int c = 0; c < chunk_count; c++) {
+            auto begin = std::min(n, c * chunk_size);
+            auto end = std::min(n, begin + chunk_size);
+            auto counts = &offsets[static_cast<size_t>(c) * buckets];
+
+            for (auto i = begin; i < end; i++)
+                counts[(keys[i] >> shift) & (buckets - 1)]++;
+        }
+
+        size_t sum = 0;
+        for (int d = 0; d < buckets; d++) {
+            for (int c = 0; c < chunk_count; c++) {
+                auto &offset = offsets[static_cast<size_t>(c) * buckets + d];
+                auto count = offset;
+
+                offset = sum;
+                sum += count;
+            }
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int c = 0; c < chunk_count; c++) {
+            auto begin = std::min(n, c * chunk_size);
+            auto end = std::min(n, begin + chunk_size);
+            auto next = &offsets[static_cast<size_t>(c) * buckets];
+
+            for (auto i = begin; i < end; i++) {
+                auto dst = next[(keys[i] >> shift) & (buckets - 1)]++;
+
+                keys_tmp[dst] = keys[i];
+                values_tmp[dst] = values[i];
+            }
+        }
+
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+// Linear BVH built from primitives sorted along a Morton curve (Karras 2012). Every
+// interior node is emitted independently from the sorted codes, so the build is linear in
+// the number of primitives and parallel. The tree is traversed exactly like linear_bvh.
+// Tree quality is lower than the SAH builders, which an optional treelet restructuring
+// pass (Karras and Aila 2013) recovers for a fraction of the SAH build time.
+class lbvh : public linear_bvh {
+    public:
+        morton_precision precision;
+        int treelet_passes;
+
+    public:
+        lbvh() {}
+
+        lbvh(
+            const hittable_list &list, real time0, real time1,
+            morton_precision _precision = morton_precision::bits_30, int _treelet_passes = 0,
+            bvh_build_stats *stats = nullptr
+        ) : precision(_precision), treelet_passes(_treelet_passes) {
+            rebuild(list, time0, time1, stats);
+        }
+
+        // Rebuilds the hierarchy from scratch, meant to be called once per frame for
+        // content that moves
+        void rebuild(
+            const hittable_list &list, real time0, real time1,
+            bvh_build_stats *stats = nullptr
+        ) {
+            nodes.clear();
+            primitives.clear();
+
+            if (list.objects.empty())
+                return;
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            auto entries = make_build_entries(list.objects, 0, list.objects.size(), time0, time1);
+            auto n = entries.size();
+
+            aabb centroid_bounds = empty_box();
+            for (const auto &entry : entries)
+                centroid_bounds = surrounding_box(centroid_bounds, entry.centroid);
+
+            auto extent = centroid_bounds.max() - centroid_bounds.min();
+            for (int a = 0; a < 3; a++)
+                if (extent[a] <= 0) extent[a] = 1;
+
+            std::vector<uint64_t> keys(n);
+            std::vector<uint32_t> order(n);
+
+            #pragma omp parallel for
+            for (size_t i = 0; i < n; i++) {
+                auto p = entries[i].centroid - centroid_bounds.min();
+                keys[i] = morton_code(point3(p.x() / extent.x(), p.y() / extent.y(), p.z() / extent.z()), precision);
+                order[i] = static_cast<uint32_t>(i);
+            }
+
+            radix_sort(keys, order, (precision == morton_precision::bits_30) ? 30 : 63);
+
+            std::vector<bvh_build_entry> sorted(n);
+            for (size_t i = 0; i < n; i++)
+                sorted[i] = entries[order[i]];
+
+            std::vector<bvh_build_node> build_nodes;
+            std::vector<uint32_t> parents;
+            emit_hierarchy(keys, sorted, build_nodes, parents);
+
+            refit_and_optimize(build_nodes, parents, treelet_passes > 0);
+            for (int pass = 1; pass < treelet_passes; pass++)
+                refit_and_optimize(build_nodes, parents, true);
+
+            // The tree of the codes is at most as deep as their bits plus the 32 bits of
+            // the indices breaking ties, which the traversal stack has room for. Treelets
+            // can deepen it, and are dropped when they take it past that.
+            if (treelet_passes > 0 and tree_depth(build_nodes, 0) > max_depth) {
+                emit_hierarchy(keys, sorted, build_nodes, parents);
+                refit_and_optimize(build_nodes, parents, false);
+            }
+
+            #pragma omp parallel for
+            for (size_t i = 0; i < n - 1; i++)
+                order_children(build_nodes, static_cast<uint32_t>(i));
+
+            primitives.resize(n);
+            for (size_t i = 0; i < n; i++)
+                primitives[i] = list.objects[sorted[i].index];
+
+            nodes.reserve(build_nodes.size());
+            flatten(build_nodes, 0);
+            build_sah_cost = sah_cost();
+            refit_order.clear();
+            refit_levels.clear();
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = nodes.size();
+                stats->primitive_count = primitives.size();
+            }
+        }
+
+    protected:
+        enum : uint32_t { no_parent = 0xffffffff };
+        enum { treelet_size = 7 };
+
+        static int count_leading_zeros(uint64_t v) {
+            return v == 0 ? 64 : __builtin_clzll(v);
+        }
+
+        // Length of the common prefix of the keys at i and j, with the indices breaking
+        // ties between duplicate codes
+        static int common_prefix(const std::vector<uint64_t> &keys, int64_t i, int64_t j) {
+            if (j < 0 or j >= static_cast<int64_t>(keys.size()))
+                return -1;
+
+            if (keys[i] == keys[j])
+                return 64 + count_leading_zeros(static_cast<uint64_t>(i ^ j));
+
+            return count_leading_zeros(keys[i] ^ keys[j]);
+        }
+
+        // Emits the n - 1 interior nodes at [0, n - 1) followed by the n leaves. Each
+        // interior node finds its primitive range and split position from the sorted
+        // codes alone, so all of them are emitted in parallel.
+        static void emit_hierarchy(
+            const std::vector<uint64_t> &keys, const std::vector<bvh_build_entry> &sorted,
+            std::vector<bvh_build_node> &build_nodes, std::vector<uint32_t> &parents
+        ) {
+            auto n = static_cast<int64_t>(keys.size());
+            auto leaf_base = static_cast<uint32_t>(n - 1);
+
+            build_nodes.resize(2 * n - 1);
+            parents.assign(2 * n - 1, no_parent);
+
+            #pragma omp parallel for
+            for (int64_t i = 0; i < n; i++) {
+                auto &leaf = build_nodes[leaf_base + i];
+                leaf.box = sorted[i].box;
+                leaf.first = static_cast<uint32_t>(i);
+                leaf.count = 1;
+                leaf.axis = 0;
+            }
+
+            #pragma omp parallel for
+            for (int64_t i = 0; i < n - 1; i++) {
+                // Direction of the range that starts at i
+                int d = (common_prefix(keys, i, i + 1) - common_prefix(keys, i, i - 1)) > 0 ? 1 : -1;
+                int min_prefix = common_prefix(keys, i, i - d);
+
+                // Upper bound for the length of the range, then its exact length
+                int64_t max_length = 2;
+                while (common_prefix(keys, i, i + max_length * d) > min_prefix)
+                    max_length *= 2;
+
+                int64_t length = 0;
+                for (auto t = max_length / 2; t >= 1; t /= 2)
+                    if (common_prefix(keys, i, i + (length + t) * d) > min_prefix)
+                        length += t;
+
+                auto j = i + length * d;
+                int node_prefix = common_prefix(keys, i, j);
+
+                // Position of the highest differing bit inside the range
+                int64_t split = 0;
+                int64_t t = length;
+                do {
+                    t = (t + 1) / 2;
+                    if (common_prefix(keys, i, i + (split + t) * d) > node_prefix)
+                        split += t;
+                } while (t > 1);
+
+                auto gamma = i + split * d + std::min(d, 0);
+
+                auto left = (std::min(i, j) == gamma) ? leaf_base + gamma : gamma;
+                auto right = (std::max(i, j) == gamma + 1) ? leaf_base + gamma + 1 : gamma + 1;
+
+                auto &node = build_nodes[i];
+                node.child[0] = static_cast<uint32_t>(left);
+                node.child[1] = static_cast<uint32_t>(right);
+                node.count = 0;
+                node.axis = 0;
+
+                parents[left] = static_cast<uint32_t>(i);
+                parents[right] = static_cast<uint32_t>(i);
+            }
+        }
+
+        // Recomputes the interior boxes bottom-up. Every leaf walks towards the root and
+        // the second thread to reach a node processes it, so both subtrees are complete.
+        // With optimize set, the treelet rooted at every node is restructured as well.
+        static void refit_and_optimize(
+            std::vector<bvh_build_node> &build_nodes, std::vector<uint32_t> &parents, bool optimize
+        ) {
+            auto n = (build_nodes.size() + 1) / 2;
+            auto leaf_base = n - 1;
+
+            std::vector<real> costs(build_nodes.size());
+            std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n]);
+
+            for (size_t i = 0; i + 1 < n; i++)
+                visits[i] = 0;
+
+            #pragma omp parallel for
+            for (size_t i = 0; i < n; i++) {
+                auto leaf = leaf_base + i;
+                costs[leaf] = build_nodes[leaf].box.surface_area();
+
+                auto current = parents[leaf];
+
+                while (current != no_parent and visits[current].fetch_add(1) == 1) {
+                    auto &node = build_nodes[current];
+                    const auto &left = build_nodes[node.child[0]];
+                    const auto &right = build_nodes[node.child[1]];
+
+                    node.box = surrounding_box(left.box, right.box);
+                    costs[current] = bvh_traversal_cost * node.box.surface_area()
+                                   + costs[node.child[0]] + costs[node.child[1]];
+
+                    if (optimize)
+                        optimize_treelet(build_nodes, parents, costs, current);
+
+                    current = parents[current];
+                }
+            }
+        }
+
+        // Replaces the treelet rooted at `root` by the topology with the lowest SAH cost,
+        // found by dynamic programming over every subset of its leaves
+        static void optimize_treelet(
+            std::vector<bvh_build_node> &build_nodes, std::vector<uint32_t> &parents,
+            std::vector<real> &costs, uint32_t root
+        ) {
+            // Grow the treelet by opening the leaf with the largest surface area
+            uint32_t leaves[treelet_size];
+            uint32_t interiors[treelet_size - 1];
+            int leaf_count = 2, interior_count = 1;
+
+            leaves[0] = build_nodes[root].child[0];
+            leaves[1] = build_nodes[root].child[1];
+            interiors[0] = root;
+
+            while (leaf_count < treelet_size) {
+                int best = -1;
+                real best_area = -1;
+
+                for (int i = 0; i < leaf_count; i++) {
+                    const auto &node = build_nodes[leaves[i]];
+                    auto area = node.box.surface_area();
+
+                    if (node.count == 0 and area > best_area) {
+                        best = i;
+                        best_area = area;
+                    }
+                }
+
+                if (best < 0)
+                    break;
+
+                auto opened = leaves[best];
+                interiors[interior_count++] = opened;
+                leaves[best] = build_nodes[opened].child[0];
+                leaves[leaf_count++] = build_nodes[opened].child[1];
+            }
+
+            if (leaf_count < 3)
+                return;
+
+            const int subsets = 1 << leaf_count;
+            aabb boxes[1 << treelet_size];
+            real best_costs[1 << treelet_size];
+            int best_partitions[1 << treelet_size];
+
+            for (int s = 1; s < subsets; s++) {
+                int low = s & -s;
+
+                if (s == low) {
+                    int i = __builtin_ctz(static_cast<unsigned>(low));
+                    boxes[s] = build_nodes[leaves[i]].box;
+                    best_costs[s] = costs[leaves[i]];
+                    continue;
+                }
+
+                boxes[s] = surrounding_box(boxes[low], boxes[s ^ low]);
+
+                // Every split of s into two non-empty parts, each pair visited once by
+                // keeping the lowest leaf on the left
+                real best = infinity;
+                int best_partition = 0;
+
+                for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+                    if (!(p & low))
+                        continue;
+
+                    auto cost = best_costs[p] + best_costs[s ^ p];
+                    if (cost < best) {
+                        best = cost;
+                        best_partition = p;
+                    }
+                }
+
+                best_costs[s] = bvh_traversal_cost * boxes[s].surface_area() + best;
+                best_partitions[s] = best_partition;
+            }
+
+            if (best_costs[subsets - 1] >= costs[root] * (1 - 1e-9))
+                return;
+
+            // Rebuild the treelet reusing its interior nodes, the root keeps its index
+            int next_interior = 0;
+            rebuild_treelet(
+                build_nodes, parents, costs, leaves, interiors, next_interior,
+                boxes, best_costs, best_partitions, subsets - 1
+            );
+        }
+
+        static uint32_t rebuild_treelet(
+            std::vector<bvh_build_node> &build_nodes, std::vector<uint32_t> &parents,
+            std::vector<real> &costs, const uint32_t *leaves, const uint32_t *interiors,
+            int &next_interior, const aabb *boxes, const real *best_costs,
+            const int *best_partitions, int s
+        ) {
+            if ((s & (s - 1)) == 0) {
+                int i = __builtin_ctz(static_cast<unsigned>(s));
+                return leaves[i];
+            }
+
+            auto index = interiors[next_interior++];
+            auto p = best_partitions[s];
+
+            auto left = rebuild_treelet(
+                build_nodes, parents, costs, leaves, interiors, next_interior,
+                boxes, best_costs, best_partitions, p
+            );
+            auto right = rebuild_treelet(
+                build_nodes, parents, costs, leaves, interiors, next_interior,
+                boxes, best_costs, best_partitions, s ^ p
+            );
+
+            auto &node = build_nodes[index];
+            node.child[0] = left;
+            node.child[1] = right;
+            node.box = boxes[s];
+            costs[index] = best_costs[s];
+
+            parents[left] = index;
+            parents[right] = index;
+
+            return index;
+        }
+};
+
+#endif // LBVH_H
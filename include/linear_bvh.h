@@ -0,0 +1,470 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "primitives.h"
+
+// Node of the binary tree produced by the builders, before it is flattened
+struct bvh_build_node {
+    aabb box;
+    uint32_t child[2];
+    uint32_t first, count;  // Primitive range of leaves, count is zero for interior nodes
+    int axis;
+};
+
+// Node of a linear_bvh, stored in depth-first order. The first child of an interior node
+// is the next node in the array and the second child is at `offset`. Leaves store
+// `count` primitives starting at `offset`.
+struct linear_bvh_node {
+    aabb box;
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis;
+};
+
+class linear_bvh : public hittable {
+    public:
+        // Depth the traversal stacks have room for, one entry per level
+        enum { max_depth = 128 };
+
+        std::vector<linear_bvh_node> nodes;
+        std::vector<shared_ptr<hittable>> primitives;
+
+        // SAH cost right after the last build, the reference for refit degradation
+        real build_sah_cost = 0;
+
+    public:
+        linear_bvh() {}
+
+        linear_bvh(
+            const hittable_list &list, real time0, real time1,
+            bvh_quality quality = bvh_quality::medium, int max_leaf_size = 4,
+            bvh_build_stats *stats = nullptr
+        ) {
+            if (list.objects.empty())
+                return;
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            auto entries = make_build_entries(list.objects, 0, list.objects.size(), time0, time1);
+
+            std::vector<bvh_build_node> build_nodes;
+            auto root = build(entries, quality, max_leaf_size, build_nodes);
+
+            primitives.resize(entries.size());
+            for (size_t i = 0; i < entries.size(); i++)
+                primitives[i] = list.objects[entries[i].index];
+
+            nodes.reserve(build_nodes.size());
+            flatten(build_nodes, root);
+            build_sah_cost = sah_cost();
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = nodes.size();
+                stats->primitive_count = primitives.size();
+            }
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            return traverse(r, t_min, t_max, rec, [this](uint32_t index) -> const aabb& {
+                return nodes[index].box;
+            });
+        }
+
+        // Traverses the hierarchy with the whole packet, each node is tested against every
+        // ray at once and is skipped when its box lies outside the packet frustum. Once few
+        // rays are left in a subtree they finish it on the single ray path.
+        virtual void hit_packet(
+            const ray_packet &packet, real t_min, real t_max, hit_record *recs, bool *hits
+        ) const override {
+            for (int i = 0; i < packet.size; i++)
+                hits[i] = false;
+
+            if (nodes.empty())
+                return;
+
+            packet_rays rays(packet, t_max);
+            auto node_box = [this](uint32_t index) -> const aabb& {
+                return nodes[index].box;
+            };
+
+            uint32_t stack[max_depth];
+            int stack_size = 0;
+            uint32_t current = 0;
+
+            while (true) {
+                const auto &node = nodes[current];
+                const auto &box = node_box(current);
+
+                // The packet tests run in double precision whatever the scalar type
+                double lower[3], upper[3];
+                for (int a = 0; a < 3; a++) {
+                    lower[a] = box.minimum[a];
+                    upper[a] = box.maximum[a];
+                }
+
+                double t_near;
+                uint32_t mask = rays.frustum_misses(lower, upper, t_min, rays.max_closest()) ? 0
+                              : rays.box_test(lower, upper, t_min, t_near);
+
+                if (mask and packet_diverged(mask, rays.size)) {
+                    for (; mask; mask &= mask - 1) {
+                        int i = lowest_ray(mask);
+
+                        if (traverse(packet.rays[i], t_min, rays.closest[i], recs[i], node_box, current)) {
+                            hits[i] = true;
+                            rays.closest[i] = recs[i].t;
+                        }
+                    }
+                } else if (mask and node.count > 0) {
+                    for (; mask; mask &= mask - 1) {
+                        int i = lowest_ray(mask);
+
+                        for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+                            if (primitive_hit(*primitives[p], packet.rays[i], t_min, rays.closest[i], recs[i])) {
+                                hits[i] = true;
+                                rays.closest[i] = recs[i].t;
+                            }
+                        }
+                    }
+                } else if (mask) {
+                    if (rays.dir_is_neg[node.axis]) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+
+                    continue;
+                }
+
+                if (stack_size == 0)
+                    break;
+
+                current = stack[--stack_size];
+            }
+        }
+
+        virtual bool bounding_box(real time0, real time1, aabb &output_box) const override {
+            if (nodes.empty())
+                return false;
+
+            output_box = nodes[0].box;
+
+            return true;
+        }
+
+        // Expected cost of tracing a ray through the hierarchy relative to one primitive
+        // intersection, used to compare builders and to decide when to rebuild
+        real sah_cost() const {
+            if (nodes.empty())
+                return 0;
+
+            auto root_area = nodes[0].box.surface_area();
+            auto cost = 0.0;
+
+            for (const auto &node : nodes) {
+                auto weight = (node.count > 0) ? node.count : bvh_traversal_cost;
+                cost += weight * node.box.surface_area();
+            }
+
+            return cost / root_area;
+        }
+
+        // Recomputes every node box bottom-up from the current primitive bounding boxes,
+        // keeping the topology. Much cheaper than a rebuild when primitives move but the
+        // scene stays the same. Returns the SAH cost relative to the last build, which
+        // grows as the tree degrades, so callers can rebuild once it gets too large.
+        real refit(real time0, real time1) {
+            if (nodes.empty())
+                return 1.0;
+
+            if (refit_levels.empty())
+                compute_refit_levels();
+
+            // Nodes of one depth only depend on deeper nodes, so each level is refit in
+            // parallel starting from the deepest one
+            for (size_t level = refit_levels.size() - 1; level > 0; level--) {
+                auto begin = static_cast<int64_t>(refit_levels[level - 1]);
+                auto end = static_cast<int64_t>(refit_levels[level]);
+
+                #pragma omp parallel for schedule(dynamic, 256)
+                for (int64_t i = begin; i < end; i++)
+                    refit_node(refit_order[i], time0, time1);
+            }
+
+            return sah_cost() / build_sah_cost;
+        }
+
+        // Builds the binary tree over all entries and returns the index of its root. Shared
+        // with the other hierarchies that are collapsed from a binary tree.
+        static uint32_t build(
+            std::vector<bvh_build_entry> &entries, bvh_quality quality, int max_leaf_size,
+            std::vector<bvh_build_node> &build_nodes
+        ) {
+            // A binary tree with at least one primitive per leaf never needs more nodes
+            build_nodes.resize(2 * entries.size() - 1);
+
+            std::atomic<uint32_t> next_node(0);
+            uint32_t root = 0;
+
+            #pragma omp parallel
+            #pragma omp single
+            root = build_subtree(entries, 0, entries.size(), quality, max_leaf_size, build_nodes, next_node, 0);
+
+            build_nodes.resize(next_node);
+
+            return root;
+        }
+
+        // Range of entries below a build node, which the builder keeps contiguous
+        static void subtree_range(
+            const std::vector<bvh_build_node> &build_nodes, uint32_t index, uint32_t &first, uint32_t &count
+        ) {
+            const auto &build_node = build_nodes[index];
+
+            if (build_node.count > 0) {
+                first = build_node.first;
+                count = build_node.count;
+                return;
+            }
+
+            uint32_t first_right, count_right;
+            subtree_range(build_nodes, build_node.child[0], first, count);
+            subtree_range(build_nodes, build_node.child[1], first_right, count_right);
+
+            first = std::min(first, first_right);
+            count += count_right;
+        }
+
+        // Number of levels of the binary tree below build_nodes[root], the root included
+        static uint32_t tree_depth(const std::vector<bvh_build_node> &build_nodes, uint32_t root) {
+            std::vector<std::pair<uint32_t, uint32_t>> pending(1, std::make_pair(root, 1u));
+            uint32_t depth = 0;
+
+            while (!pending.empty()) {
+                auto entry = pending.back();
+                pending.pop_back();
+                depth = std::max(depth, entry.second);
+
+                const auto &build_node = build_nodes[entry.first];
+
+                if (build_node.count == 0) {
+                    pending.push_back(std::make_pair(build_node.child[0], entry.second + 1));
+                    pending.push_back(std::make_pair(build_node.child[1], entry.second + 1));
+                }
+            }
+
+            return depth;
+        }
+
+        // Builds the subtree over entries[start, end), depth levels below the root, and
+        // returns the index of its root. Nodes are claimed from next_node, so subtrees can
+        // be built by concurrent tasks.
+        static uint32_t build_subtree(
+            std::vector<bvh_build_entry> &entries, size_t start, size_t end,
+            bvh_quality quality, int max_leaf_size,
+            std::vector<bvh_build_node> &build_nodes, std::atomic<uint32_t> &next_node, int depth
+        ) {
+            auto index = next_node++;
+            auto &node = build_nodes[index];
+            node.axis = 0;
+
+            // Deep subtrees are split at the median, bounding the depth of the tree
+            if (depth >= bvh_max_sah_depth)
+                quality = bvh_quality::fast;
+
+            size_t span = end - start;
+            real split_cost = infinity;
+            size_t mid = (span > 1) ? bvh_split(entries, start, end, quality, &split_cost) : end;
+
+            // A leaf costs one intersection per primitive
+            if (span == 1 or (span <= static_cast<size_t>(max_leaf_size) and span <= split_cost)) {
+                node.box = empty_box();
+                for (size_t i = start; i < end; i++)
+                    node.box = surrounding_box(node.box, entries[i].box);
+
+                node.first = static_cast<uint32_t>(start);
+                node.count = static_cast<uint32_t>(span);
+
+                return index;
+            }
+
+            uint32_t left, right;
+
+            #pragma omp task default(shared) if (mid - start > bvh_task_threshold)
+            left = build_subtree(entries, start, mid, quality, max_leaf_size, build_nodes, next_node, depth + 1);
+
+            right = build_subtree(entries, mid, end, quality, max_leaf_size, build_nodes, next_node, depth + 1);
+
+            #pragma omp taskwait
+
+            node.box = surrounding_box(build_nodes[left].box, build_nodes[right].box);
+            node.child[0] = left;
+            node.child[1] = right;
+            node.count = 0;
+            order_children(build_nodes, index);
+
+            return index;
+        }
+
+        // Orders the children of an interior node along the axis that separates them the
+        // most, so the traversal can pick the nearest one from the sign of the ray direction
+        static void order_children(std::vector<bvh_build_node> &build_nodes, uint32_t index) {
+            auto &node = build_nodes[index];
+
+            auto d = build_nodes[node.child[1]].box.centroid()
+                   - build_nodes[node.child[0]].box.centroid();
+            int axis = (fabs(d.x()) > fabs(d.y()) and fabs(d.x()) > fabs(d.z())) ? 0
+                     : (fabs(d.y()) > fabs(d.z())) ? 1 : 2;
+
+            if (d[axis] < 0)
+                std::swap(node.child[0], node.child[1]);
+
+            node.axis = axis;
+        }
+
+    protected:
+        // Stack based traversal of the subtree at root shared with the derived hierarchies,
+        // node_box returns the box of a node, so hierarchies that store their bounds
+        // elsewhere reuse the loop
+        template <typename box_function>
+        bool traverse(
+            const ray &r, real t_min, real t_max, hit_record &rec, box_function node_box,
+            uint32_t root = 0
+        ) const {
+            if (nodes.empty())
+                return false;
+
+            auto origin = r.origin();
+            auto dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+            bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+            uint32_t stack[max_depth];
+            int stack_size = 0;
+            uint32_t current = root;
+
+            bool hit_anything = false;
+            auto closest_so_far = t_max;
+
+            while (true) {
+                const auto &node = nodes[current];
+
+                if (node_box(current).hit(origin, inv_dir, t_min, closest_so_far)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = 0; i < node.count; i++) {
+                            if (primitive_hit(*primitives[node.offset + i], r, t_min, closest_so_far, rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                            }
+                        }
+                    } else {
+                        // Visit the child nearest to the ray origin first, so the far one
+                        // can be culled by the closest hit found so far
+                        if (dir_is_neg[node.axis]) {
+                            stack[stack_size++] = current + 1;
+                            current = node.offset;
+                        } else {
+                            stack[stack_size++] = node.offset;
+                            current = current + 1;
+                        }
+
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0)
+                    break;
+
+                current = stack[--stack_size];
+            }
+
+            return hit_anything;
+        }
+
+        // Node indices grouped by depth, deepest last, and the offset where each depth
+        // ends, computed on the first refit
+        std::vector<uint32_t> refit_order;
+        std::vector<size_t> refit_levels;
+
+        void compute_refit_levels() {
+            // Parents always precede their children in depth-first order
+            std::vector<uint32_t> depths(nodes.size(), 0);
+            uint32_t max_depth = 0;
+
+            for (size_t i = 0; i < nodes.size(); i++) {
+                max_depth = std::max(max_depth, depths[i]);
+
+                if (nodes[i].count == 0) {
+                    depths[i + 1] = depths[i] + 1;
+                    depths[nodes[i].offset] = depths[i] + 1;
+                }
+            }
+
+            refit_levels.assign(max_depth + 2, 0);
+            for (auto depth : depths)
+                refit_levels[depth + 1]++;
+            for (size_t level = 1; level < refit_levels.size(); level++)
+                refit_levels[level] += refit_levels[level - 1];
+
+            std::vector<size_t> next(refit_levels.begin(), refit_levels.end() - 1);
+            refit_order.resize(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++)
+                refit_order[next[depths[i]]++] = static_cast<uint32_t>(i);
+        }
+
+        void refit_node(uint32_t index, real time0, real time1) {
+            auto &node = nodes[index];
+
+            if (node.count == 0) {
+                node.box = surrounding_box(nodes[index + 1].box, nodes[node.offset].box);
+                return;
+            }
+
+            aabb box = empty_box(), primitive_box;
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                if (primitives[i]->bounding_box(time0, time1, primitive_box))
+                    box = surrounding_box(box, primitive_box);
+            }
+
+            node.box = box;
+        }
+
+        // Appends the subtree rooted at build_nodes[index] in depth-first order
+        uint32_t flatten(const std::vector<bvh_build_node> &build_nodes, uint32_t index) {
+            const auto &build_node = build_nodes[index];
+            auto offset = static_cast<uint32_t>(nodes.size());
+
+            linear_bvh_node node;
+            node.box = build_node.box;
+            node.axis = static_cast<uint8_t>(build_node.axis);
+            node.count = static_cast<uint16_t>(build_node.count);
+            node.offset = build_node.first;
+            nodes.push_back(node);
+
+            if (build_node.count == 0) {
+                flatten(build_nodes, build_node.child[0]);
+
+                auto second_child = flatten(build_nodes, build_node.child[1]);
+                nodes[offset].offset = second_child;
+            }
+
+            return offset;
+        }
+};
+
+#endif // LINEAR_BVH_H
@@ -12,10 +12,20 @@ struct scatter_record {
     
     color attenuation;
 
-    shared_ptr<pdf> pdf_ptr; 
+    // Distribution of the scattered directions when not specular
+    pdf direction_pdf;
 };
 
 class material {    
+    public:
+        // The built-in material this is, which the dispatch functions at the end of this
+        // file call without going through the virtual functions. Anything else is
+        // other_kind. The built-in materials are final, so an overridden scatter() can't
+        // be skipped by a kind inherited from one of them.
+        enum material_kind { other_kind, lambertian_kind, metal_kind, dielectric_kind, isotropic_kind, diffuse_light_kind };
+
+        material_kind kind = other_kind;
+
     public:
         virtual bool scatter(
             const ray& r_in, 
@@ -25,7 +35,7 @@ class material {
             return false;
         }
 
-        virtual double scattering_pdf(
+        virtual real scattering_pdf(
             const ray& r_in, 
             const hit_record& rec, 
             const ray& scattered
@@ -35,19 +45,24 @@ class material {
 
         virtual color emitted(
             const ray& r_in, const hit_record& rec, 
-            double u, double v, const point3& p
+            real u, real v, const point3& p
         ) const {
             return color(0.0, 0.0, 0.0);
         }
 };
 
-class lambertian : public material {
+class lambertian final : public material {
     public:
         shared_ptr<texture> albedo;
 
     public:
-        lambertian(const color &a) : albedo(make_shared<solid_color>(a)) {}
-        lambertian(shared_ptr<texture> a) : albedo(a) {}
+        lambertian(const color &a) : albedo(make_shared<solid_color>(a)) {
+            kind = lambertian_kind;
+        }
+
+        lambertian(shared_ptr<texture> a) : albedo(a) {
+            kind = lambertian_kind;
+        }
 
         virtual bool scatter(
             const ray& r_in, 
@@ -55,13 +70,13 @@ class lambertian : public material {
             scatter_record& srec
         ) const override {
             srec.is_specular = false;
-            srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+            srec.attenuation = texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint);
+            srec.direction_pdf = cosine_pdf(rec.normal);
 
             return true;
         }
 
-        virtual double scattering_pdf(
+        virtual real scattering_pdf(
             const ray& r_in, 
             const hit_record& rec, 
             const ray& scattered
@@ -72,13 +87,15 @@ class lambertian : public material {
         }
 };
 
-class metal : public material {
+class metal final : public material {
     public:
         color albedo;
-        double fuzz;
+        real fuzz;
     
     public:
-        metal(const color &a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const color &a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {
+            kind = metal_kind;
+        }
 
         virtual bool scatter(
             const ray &r_in, 
@@ -90,28 +107,26 @@ class metal : public material {
                 rec.normal
             );
 
-            srec.specular_ray = ray(
-                rec.p, 
+            srec.specular_ray = rec.spawn_ray(
                 reflected + fuzz * random_in_unit_sphere(),
                 0
             );
 
             srec.attenuation = albedo;
             srec.is_specular = true;
-            srec.pdf_ptr = 0;
 
             return true;
         }
 };
 
-class dielectric : public material {
+class dielectric final : public material {
     public:
         // Index of refraction
-        double ir;
+        real ir;
     
     private:
         // Use Schlick's approximation for reflectance
-        static double reflectance(double cosine, double ref_idx) {
+        static real reflectance(real cosine, real ref_idx) {
             auto r0 = (1 - ref_idx) / (1 + ref_idx);
             r0 = r0 * r0;
 
@@ -119,7 +134,9 @@ class dielectric : public material {
         }
 
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        dielectric(real index_of_refraction) : ir(index_of_refraction) {
+            kind = dielectric_kind;
+        }
 
         virtual bool scatter(
             const ray &r_in, 
@@ -127,15 +144,14 @@ class dielectric : public material {
             scatter_record& srec
         ) const override {
             srec.is_specular = true;
-            srec.pdf_ptr = nullptr;
             srec.attenuation = color(1.0, 1.0, 1.0);
 
-            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+            real refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
             vec3 unit_direction = unit_vector(r_in.direction());
             
-            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+            real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            real sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 
@@ -145,19 +161,24 @@ class dielectric : public material {
             else 
                 direction = refract(unit_direction, rec.normal, refraction_ratio);            
                     
-            srec.specular_ray = ray(rec.p, direction, r_in.time());
+            srec.specular_ray = rec.spawn_ray(direction, r_in.time());
 
             return true;
         }
 };
 
-class isotropic : public material {
+class isotropic final : public material {
     public:
         shared_ptr<texture> albedo;
 
     public:
-        isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-        isotropic(shared_ptr<texture> a) : albedo(a) {}
+        isotropic(color c) : albedo(make_shared<solid_color>(c)) {
+            kind = isotropic_kind;
+        }
+
+        isotropic(shared_ptr<texture> a) : albedo(a) {
+            kind = isotropic_kind;
+        }
 
         virtual bool scatter(
             const ray& r_in, 
@@ -166,7 +187,7 @@ class isotropic : public material {
         ) const override {
             srec.is_specular = true;
             srec.specular_ray = ray(rec.p, random_in_unit_sphere(), r_in.time());
-            srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+            srec.attenuation = texture_value(*albedo, rec.u, rec.v, rec.p);
 
             return true;
         }
@@ -174,13 +195,18 @@ class isotropic : public material {
 
 };
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
     public:
         shared_ptr<texture> emit;
 
     public:
-        diffuse_light(shared_ptr<texture> a) : emit(a) {}
-        diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+        diffuse_light(shared_ptr<texture> a) : emit(a) {
+            kind = diffuse_light_kind;
+        }
+
+        diffuse_light(color c) : emit(make_shared<solid_color>(c)) {
+            kind = diffuse_light_kind;
+        }
 
         virtual bool scatter(
             const ray &r_in, 
@@ -192,13 +218,65 @@ class diffuse_light : public material {
 
         virtual color emitted(
             const ray& r_in, const hit_record& rec, 
-            double u, double v, const point3& p
+            real u, real v, const point3& p
         ) const override {
 
             if (rec.front_face)
-                return emit->value(u, v, p);
+                return texture_value(*emit, u, v, p, rec.footprint);
             else 
                 return color(0.0, 0.0, 0.0);
         }
 };
+
+// Calls to the built-in materials by their kind, so the integrators inline them instead of
+// making a virtual call per bounce. The built-in materials that don't override a function
+// get the base result directly. Any other material goes through its virtual functions.
+inline bool material_scatter(const material &m, const ray &r_in, const hit_record &rec, scatter_record &srec) {
+    switch (m.kind) {
+        case material::lambertian_kind:
+            return static_cast<const lambertian &>(m).lambertian::scatter(r_in, rec, srec);
+
+        case material::metal_kind:
+            return static_cast<const metal &>(m).metal::scatter(r_in, rec, srec);
+
+        case material::dielectric_kind:
+            return static_cast<const dielectric &>(m).dielectric::scatter(r_in, rec, srec);
+
+        case material::isotropic_kind:
+            return static_cast<const isotropic &>(m).isotropic::scatter(r_in, rec, srec);
+
+        case material::diffuse_light_kind:
+            return false;
+
+        default:
+            return m.scatter(r_in, rec, srec);
+    }
+}
+
+inline real material_scattering_pdf(const material &m, const ray &r_in, const hit_record &rec, const ray &scattered) {
+    switch (m.kind) {
+        case material::lambertian_kind:
+            return static_cast<const lambertian &>(m).lambertian::scattering_pdf(r_in, rec, scattered);
+
+        case material::other_kind:
+            return m.scattering_pdf(r_in, rec, scattered);
+
+        default:
+            return 0;
+    }
+}
+
+inline color material_emitted(const material &m, const ray &r_in, const hit_record &rec, real u, real v, const point3 &p) {
+    switch (m.kind) {
+        case material::diffuse_light_kind:
+            return static_cast<const diffuse_light &>(m).diffuse_light::emitted(r_in, rec, u, v, p);
+
+        case material::other_kind:
+            return m.emitted(r_in, rec, u, v, p);
+
+        default:
+            return color(0, 0, 0);
+    }
+}
+
 #endif // MATERIAL_H
\ No newline at end of file
@@ -0,0 +1,304 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "utility.h"
+#include "triangle_mesh.h"
+
+// Header of the binary mesh format. The arrays follow it in this order, all of them made
+// of 4 byte elements: positions (3 floats per vertex), normals and uvs when flagged, and
+// the indices (3 per triangle). The layout matches mesh_buffers, so a loaded file is used
+// in place from its mapping.
+struct mesh_file_header {
+    char magic[4];
+    uint32_t flags;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+};
+
+enum : uint32_t {
+    mesh_has_normals = 1,
+    mesh_has_uvs = 2
+};
+
+// Loads a Wavefront OBJ file. Polygons are split into triangle fans, and every distinct
+// position/uv/normal combination becomes one vertex of the shared buffers. Normals and uvs
+// are only kept when every face provides them. Returns nullptr when the file can't be read.
+inline shared_ptr<mesh_buffers> load_obj(const char *file_name) {
+    std::ifstream file(file_name);
+
+    if (!file) {
+        std::cerr << "ERROR: Could not load OBJ file '" << file_name << "'.\n";
+        return nullptr;
+    }
+
+    std::vector<float> positions, normals, uvs;
+    auto buffers = make_shared<mesh_buffers>();
+
+    // Vertices already emitted, keyed by their position, uv and normal indices
+    struct vertex_key {
+        long v, vt, vn;
+
+        bool operator == (const vertex_key &other) const {
+            return v == other.v and vt == other.vt and vn == other.vn;
+        }
+    };
+
+    struct vertex_key_hash {
+        size_t operator () (const vertex_key &k) const {
+            return std::hash<long>()(k.v) ^ (std::hash<long>()(k.vt) << 1) ^ (std::hash<long>()(k.vn) << 2);
+        }
+    };
+
+    std::unordered_map<vertex_key, uint32_t, vertex_key_hash> vertices;
+    bool all_normals = true, all_uvs = true;
+
+    // OBJ indices start at 1 and negative ones count back from the last element
+    auto resolve = [](long index, size_t count) -> long {
+        return (index < 0) ? static_cast<long>(count) + index : index - 1;
+    };
+
+    std::string line;
+    std::vector<uint32_t> polygon;
+
+    while (std::getline(file, line)) {
+        const char *s = line.c_str();
+        while (*s == ' ' or *s == '\t')
+            s++;
+
+        char *end;
+
+        if (s[0] == 'v' and (s[1] == ' ' or s[1] == '\t')) {
+            s += 1;
+            for (int i = 0; i < 3; i++) {
+                positions.push_back(strtof(s, &end));
+                s = end;
+            }
+        } else if (s[0] == 'v' and s[1] == 'n') {
+            s += 2;
+            for (int i = 0; i < 3; i++) {
+                normals.push_back(strtof(s, &end));
+                s = end;
+            }
+        } else if (s[0] == 'v' and s[1] == 't') {
+            s += 2;
+            for (int i = 0; i < 2; i++) {
+                uvs.push_back(strtof(s, &end));
+                s = end;
+            }
+        } else if (s[0] == 'f' and (s[1] == ' ' or s[1] == '\t')) {
+            polygon.clear();
+            s++;
+
+            while (true) {
+                while (*s == ' ' or *s == '\t')
+                    s++;
+
+                vertex_key key = {strtol(s, &end, 10), 0, 0};
+                if (end == s)
+                    break;
+
+                s = end;
+                if (*s == '/') {
+                    s++;
+                    if (*s != '/') {
+                        key.vt = strtol(s, &end, 10);
+                        s = end;
+                    }
+                    if (*s == '/') {
+                        key.vn = strtol(s + 1, &end, 10);
+                        s = end;
+                    }
+                }
+
+                all_uvs = all_uvs and key.vt != 0;
+                all_normals = all_normals and key.vn != 0;
+
+                key.v = resolve(key.v, positions.size() / 3);
+                key.vt = key.vt ? resolve(key.vt, uvs.size() / 2) : -1;
+                key.vn = key.vn ? resolve(key.vn, normals.size() / 3) : -1;
+
+                if (key.v < 0 or key.v >= static_cast<long>(positions.size() / 3)
+                    or key.vt >= static_cast<long>(uvs.size() / 2)
+                    or key.vn >= static_cast<long>(normals.size() / 3)) {
+                    std::cerr << "ERROR: Invalid face in OBJ file '" << file_name << "'.\n";
+                    return nullptr;
+                }
+
+                auto found = vertices.find(key);
+                if (found == vertices.end()) {
+                    auto index = static_cast<uint32_t>(vertices.size());
+                    found = vertices.emplace(key, index).first;
+
+                    for (int i = 0; i < 3; i++)
+                        buffers->position_storage.push_back(positions[3 * key.v + i]);
+                    for (int i = 0; i < 3; i++)
+                        buffers->normal_storage.push_back((key.vn >= 0) ? normals[3 * key.vn + i] : 0.0f);
+                    for (int i = 0; i < 2; i++)
+                        buffers->uv_storage.push_back((key.vt >= 0) ? uvs[2 * key.vt + i] : 0.0f);
+                }
+
+                polygon.push_back(found->second);
+            }
+
+            for (size_t i = 2; i < polygon.size(); i++) {
+                buffers->index_storage.push_back(polygon[0]);
+                buffers->index_storage.push_back(polygon[i - 1]);
+                buffers->index_storage.push_back(polygon[i]);
+            }
+        }
+    }
+
+    if (!all_normals)
+        std::vector<float>().swap(buffers->normal_storage);
+    if (!all_uvs)
+        std::vector<float>().swap(buffers->uv_storage);
+
+    buffers->use_storage();
+
+    return buffers;
+}
+
+// Writes the buffers in the binary mesh format
+inline bool save_mesh_binary(const char *file_name, const mesh_buffers &buffers) {
+    FILE *file = fopen(file_name, "wb");
+
+    if (!file) {
+        std::cerr << "ERROR: Could not write mesh file '" << file_name << "'.\n";
+        return false;
+    }
+
+    mesh_file_header header;
+    memcpy(header.magic, "RTM1", 4);
+    header.flags = (buffers.normals ? uint32_t(mesh_has_normals) : 0u) | (buffers.uvs ? uint32_t(mesh_has_uvs) : 0u);
+    header.vertex_count = buffers.vertex_count;
+    header.triangle_count = buffers.triangle_count;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok and fwrite(buffers.positions, sizeof(float), 3 * buffers.vertex_count, file) == 3 * buffers.vertex_count;
+    if (buffers.normals)
+        ok = ok and fwrite(buffers.normals, sizeof(float), 3 * buffers.vertex_count, file) == 3 * buffers.vertex_count;
+    if (buffers.uvs)
+        ok = ok and fwrite(buffers.uvs, sizeof(float), 2 * buffers.vertex_count, file) == 2 * buffers.vertex_count;
+    ok = ok and fwrite(buffers.indices, sizeof(uint32_t), 3 * buffers.triangle_count, file) == 3 * buffers.triangle_count;
+
+    ok = (fclose(file) == 0) and ok;
+
+    if (!ok)
+        std::cerr << "ERROR: Could not write mesh file '" << file_name << "'.\n";
+
+    return ok;
+}
+
+// Loads a binary mesh file. On POSIX systems the file is memory-mapped and the buffers
+// point straight into the mapping, so nothing is parsed or copied at startup and pages
+// are only read when the hierarchy build touches them. Returns nullptr on failure.
+inline shared_ptr<mesh_buffers> load_mesh_binary(const char *file_name) {
+    auto buffers = make_shared<mesh_buffers>();
+    const char *data = nullptr;
+    size_t size = 0;
+
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(file_name, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd >= 0 and fstat(fd, &file_stat) == 0 and file_stat.st_size > 0) {
+        size = static_cast<size_t>(file_stat.st_size);
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping != MAP_FAILED) {
+            buffers->mapping = mapping;
+            buffers->mapping_size = size;
+            data = static_cast<const char *>(mapping);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+#else
+    std::ifstream file(file_name, std::ios::binary);
+    std::vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    if (!contents.empty()) {
+        data = contents.data();
+        size = contents.size();
+    }
+#endif
+
+    mesh_file_header header;
+    if (!data or size < sizeof(header)) {
+        std::cerr << "ERROR: Could not load mesh file '" << file_name << "'.\n";
+        return nullptr;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    auto vertex_floats = 3 + ((header.flags & mesh_has_normals) ? 3 : 0) + ((header.flags & mesh_has_uvs) ? 2 : 0);
+    auto expected_size = sizeof(header)
+        + 4 * (vertex_floats * header.vertex_count + 3 * header.triangle_count);
+
+    if (memcmp(header.magic, "RTM1", 4) != 0 or size != expected_size) {
+        std::cerr << "ERROR: Invalid mesh file '" << file_name << "'.\n";
+        return nullptr;
+    }
+
+    auto positions = reinterpret_cast<const float *>(data + sizeof(header));
+    auto next = positions + 3 * header.vertex_count;
+    const float *normals = nullptr, *uvs = nullptr;
+
+    if (header.flags & mesh_has_normals) {
+        normals = next;
+        next += 3 * header.vertex_count;
+    }
+
+    if (header.flags & mesh_has_uvs) {
+        uvs = next;
+        next += 2 * header.vertex_count;
+    }
+
+    auto indices = reinterpret_cast<const uint32_t *>(next);
+
+    if (buffers->mapping) {
+        buffers->vertex_count = header.vertex_count;
+        buffers->triangle_count = header.triangle_count;
+        buffers->positions = positions;
+        buffers->normals = normals;
+        buffers->uvs = uvs;
+        buffers->indices = indices;
+    } else {
+        buffers->position_storage.assign(positions, positions + 3 * header.vertex_count);
+        if (normals)
+            buffers->normal_storage.assign(normals, normals + 3 * header.vertex_count);
+        if (uvs)
+            buffers->uv_storage.assign(uvs, uvs + 2 * header.vertex_count);
+        buffers->index_storage.assign(indices, indices + 3 * header.triangle_count);
+        buffers->use_storage();
+    }
+
+    // Out of range indices would read past the buffers
+    for (size_t i = 0; i < 3 * buffers->triangle_count; i++) {
+        if (buffers->indices[i] >= buffers->vertex_count) {
+            std::cerr << "ERROR: Invalid mesh file '" << file_name << "'.\n";
+            return nullptr;
+        }
+    }
+
+    return buffers;
+}
+
+#endif // MESH_LOADER_H
@@ -0,0 +1,185 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "vec3.h"
+
+// 8 bit RGB image stored as a pyramid of levels, each half the size of the one before down
+// to a single texel, for lookups filtered over a footprint. The levels are stored in tiles
+// of 4 x 4 texels padded to 4 bytes, one 64 byte cache line each, so the four texels of a
+// bilinear lookup are mostly on one line instead of on two rows of a wide image.
+class mipmap {
+    public:
+        enum { tile_size = 4, texel_bytes = 4, tile_bytes = tile_size * tile_size * texel_bytes };
+
+        struct level {
+            int width, height;
+            int tiles_x;
+
+            // Of the first tile of the level in the aligned storage
+            size_t offset;
+        };
+
+        std::vector<level> levels;
+
+    public:
+        mipmap() {}
+
+        // From the width x height RGB pixels of an image, top row first. Each level
+        // averages 2 x 2 texels of the one before, the last ones of an odd size repeating.
+        mipmap(const unsigned char *pixels, int width, int height) {
+            size_t size = 0;
+
+            for (int w = width, h = height; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+                level l;
+                l.width = w;
+                l.height = h;
+                l.tiles_x = (w + tile_size - 1) / tile_size;
+                l.offset = size;
+
+                levels.push_back(l);
+                size += static_cast<size_t>(l.tiles_x) * ((h + tile_size - 1) / tile_size) * tile_bytes;
+
+                if (w == 1 and h == 1)
+                    break;
+            }
+
+            storage.assign(size + 64, 0);
+            alignment = (64 - reinterpret_cast<uintptr_t>(storage.data()) % 64) % 64;
+
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    auto *pixel = pixels + 3 * (static_cast<size_t>(y) * width + x);
+                    auto *t = mutable_texel(0, x, y);
+
+                    t[0] = pixel[0];
+                    t[1] = pixel[1];
+                    t[2] = pixel[2];
+                }
+            }
+
+            for (size_t l = 1; l < levels.size(); l++) {
+                const auto &source = levels[l - 1];
+
+                for (int y = 0; y < levels[l].height; y++) {
+                    for (int x = 0; x < levels[l].width; x++) {
+                        int x0 = std::min(2 * x, source.width - 1), x1 = std::min(2 * x + 1, source.width - 1);
+                        int y0 = std::min(2 * y, source.height - 1), y1 = std::min(2 * y + 1, source.height - 1);
+
+                        const unsigned char *corners[4] = {
+                            texel(l - 1, x0, y0), texel(l - 1, x1, y0), texel(l - 1, x0, y1), texel(l - 1, x1, y1)
+                        };
+                        auto *t = mutable_texel(l, x, y);
+
+                        for (int c = 0; c < 3; c++)
+                            t[c] = static_cast<unsigned char>((corners[0][c] + corners[1][c] + corners[2][c] + corners[3][c] + 2) / 4);
+                    }
+                }
+            }
+        }
+
+        mipmap(const mipmap &other) : levels(other.levels) {
+            copy_storage(other);
+        }
+
+        mipmap &operator = (const mipmap &other) {
+            levels = other.levels;
+            copy_storage(other);
+
+            return *this;
+        }
+
+        bool empty() const {
+            return levels.empty();
+        }
+
+        const unsigned char *texel(size_t l, int x, int y) const {
+            return storage.data() + alignment + texel_offset(l, x, y);
+        }
+
+        // Bilinear lookup in level l at u, v in [0, 1], v running down from the top row.
+        // Texels past the edges repeat the ones on them.
+        color bilinear(size_t l, real u, real v) const {
+            const auto &lev = levels[l];
+
+            auto x = u * lev.width - 0.5;
+            auto y = v * lev.height - 0.5;
+            auto fx_floor = floor(x), fy_floor = floor(y);
+            auto fx = x - fx_floor, fy = y - fy_floor;
+
+            int x0 = std::min(std::max(static_cast<int>(fx_floor), 0), lev.width - 1);
+            int y0 = std::min(std::max(static_cast<int>(fy_floor), 0), lev.height - 1);
+            int x1 = std::min(std::max(static_cast<int>(fx_floor) + 1, 0), lev.width - 1);
+            int y1 = std::min(std::max(static_cast<int>(fy_floor) + 1, 0), lev.height - 1);
+
+            const auto *t00 = texel(l, x0, y0), *t10 = texel(l, x1, y0);
+            const auto *t01 = texel(l, x0, y1), *t11 = texel(l, x1, y1);
+
+            real result[3];
+
+            for (int c = 0; c < 3; c++) {
+                auto top = (1 - fx) * t00[c] + fx * t10[c];
+                auto bottom = (1 - fx) * t01[c] + fx * t11[c];
+
+                result[c] = static_cast<real>(((1 - fy) * top + fy * bottom) / 255.0);
+            }
+
+            return color(result[0], result[1], result[2]);
+        }
+
+        // Trilinear lookup at u, v for a footprint as wide as the fraction footprint of the
+        // image, between the two levels whose texels are closest to that width. Footprints
+        // of up to a texel of the full image read it bilinearly.
+        color lookup(real u, real v, real footprint) const {
+            auto texels = footprint * levels[0].width;
+
+            if (!(texels > 1))
+                return bilinear(0, u, v);
+
+            auto lod = log2(texels);
+            auto last = levels.size() - 1;
+
+            if (lod >= last)
+                return bilinear(last, u, v);
+
+            auto l = static_cast<size_t>(lod);
+            auto f = static_cast<real>(lod - l);
+
+            return (1 - f) * bilinear(l, u, v) + f * bilinear(l + 1, u, v);
+        }
+
+    protected:
+        // Holds the tiles starting at a 64 byte boundary alignment bytes into it
+        std::vector<unsigned char> storage;
+        size_t alignment = 0;
+
+        size_t texel_offset(size_t l, int x, int y) const {
+            const auto &lev = levels[l];
+            auto tx = static_cast<unsigned>(x), ty = static_cast<unsigned>(y);
+            auto tile = static_cast<size_t>(ty / tile_size) * lev.tiles_x + tx / tile_size;
+
+            return lev.offset + tile * tile_bytes + ((ty % tile_size) * tile_size + tx % tile_size) * texel_bytes;
+        }
+
+        unsigned char *mutable_texel(size_t l, int x, int y) {
+            return storage.data() + alignment + texel_offset(l, x, y);
+        }
+
+        // A copied vector isn't aligned like the original, so the tiles are moved in place
+        void copy_storage(const mipmap &other) {
+            storage.assign(other.storage.size(), 0);
+            alignment = (64 - reinterpret_cast<uintptr_t>(storage.data()) % 64) % 64;
+
+            if (!other.storage.empty())
+                std::copy(
+                    other.storage.begin() + other.alignment, other.storage.end() - (64 - other.alignment),
+                    storage.begin() + alignment
+                );
+        }
+};
+
+#endif // MIPMAP_H
@@ -0,0 +1,162 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "utility.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+// linear_bvh over one slice of the shutter interval. Besides the box swept over the whole
+// slice, every node stores its bounds at key_count evenly spaced keyframes, and the
+// traversal tests the box interpolated at the time of the ray. A fast moving primitive
+// then only enlarges the boxes around where it actually is at that time, instead of
+// covering its whole path for every ray.
+//
+// Interpolating keyframes is conservative for primitives whose box moves linearly
+// between keyframes, like moving_sphere, and for static ones.
+class motion_bvh_segment : public linear_bvh {
+    public:
+        real time0, time1;
+        int key_count;
+        std::vector<aabb> key_boxes;  // key_count boxes per node, in node order
+
+    public:
+        motion_bvh_segment(
+            const hittable_list &list, real _time0, real _time1, int _key_count,
+            bvh_quality quality, int max_leaf_size
+        ) : linear_bvh(list, _time0, _time1, quality, max_leaf_size),
+            time0(_time0), time1(_time1), key_count(std::max(_key_count, 2)) {
+            compute_key_boxes();
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            // Keyframe interval of the ray time and the position inside it
+            auto u = (r.time() - time0) / (time1 - time0) * (key_count - 1);
+            u = clamp(u, 0.0, key_count - 1);
+
+            auto key = std::min(static_cast<int>(u), key_count - 2);
+            auto f = u - key;
+            auto g = 1.0 - f;
+
+            return traverse(r, t_min, t_max, rec, [this, key, f, g](uint32_t index) {
+                const auto &a = key_boxes[index * key_count + key];
+                const auto &b = key_boxes[index * key_count + key + 1];
+
+                return aabb(g * a.min() + f * b.min(), g * a.max() + f * b.max());
+            });
+        }
+
+        // The packet traversal of linear_bvh would test the boxes swept over the whole
+        // slice, the rays are traced one at a time against the interpolated ones instead
+        virtual void hit_packet(
+            const ray_packet &packet, real t_min, real t_max, hit_record *recs, bool *hits
+        ) const override {
+            hittable::hit_packet(packet, t_min, t_max, recs, hits);
+        }
+
+    protected:
+        void compute_key_boxes() {
+            key_boxes.assign(nodes.size() * key_count, empty_box());
+
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (int64_t i = 0; i < static_cast<int64_t>(nodes.size()); i++) {
+                const auto &node = nodes[i];
+                aabb primitive_box;
+
+                for (uint32_t p = node.offset; node.count > 0 and p < node.offset + node.count; p++) {
+                    for (int k = 0; k < key_count; k++) {
+                        auto t = time0 + (time1 - time0) * k / (key_count - 1);
+                        auto &box = key_boxes[i * key_count + k];
+
+                        if (primitives[p]->bounding_box(t, t, primitive_box))
+                            box = surrounding_box(box, primitive_box);
+                    }
+                }
+            }
+
+            // Children always follow their parent, so a reverse sweep sees them first
+            for (size_t i = nodes.size(); i-- > 0;) {
+                if (nodes[i].count > 0)
+                    continue;
+
+                for (int k = 0; k < key_count; k++) {
+                    key_boxes[i * key_count + k] = surrounding_box(
+                        key_boxes[(i + 1) * key_count + k],
+                        key_boxes[nodes[i].offset * key_count + k]
+                    );
+                }
+            }
+        }
+};
+
+// Hierarchy for scenes with motion blur. The shutter interval is split into
+// time_segments slices, each with its own hierarchy built from the boxes swept over that
+// slice, which are the temporal splits: a primitive crossing the scene is then grouped
+// with its neighbours in each slice rather than with everything along its path.
+//
+// The rays of a packet sample different times, so packets are traced ray by ray by the
+// default hit_packet, each ray in the hierarchy of its slice.
+class motion_bvh : public hittable {
+    public:
+        real time0, time1;
+        std::vector<motion_bvh_segment> segments;
+        aabb box;
+
+    public:
+        motion_bvh(
+            const hittable_list &list, real _time0, real _time1,
+            int key_count = 2, int time_segments = 1,
+            bvh_quality quality = bvh_quality::medium, int max_leaf_size = 4,
+            bvh_build_stats *stats = nullptr
+        ) : time0(_time0), time1(_time1) {
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            time_segments = std::max(time_segments, 1);
+            segments.reserve(time_segments);
+            box = empty_box();
+
+            for (int s = 0; s < time_segments; s++) {
+                auto segment_time0 = time0 + (time1 - time0) * s / time_segments;
+                auto segment_time1 = time0 + (time1 - time0) * (s + 1) / time_segments;
+
+                segments.emplace_back(list, segment_time0, segment_time1, key_count, quality, max_leaf_size);
+
+                if (!segments.back().nodes.empty())
+                    box = surrounding_box(box, segments.back().nodes[0].box);
+            }
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = 0;
+                for (const auto &segment : segments)
+                    stats->node_count += segment.nodes.size();
+                stats->primitive_count = list.objects.size();
+            }
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            // Rays are expected inside the shutter interval, times outside use the nearest slice
+            auto s = static_cast<int>((r.time() - time0) / (time1 - time0) * segments.size());
+            s = std::max(0, std::min(s, static_cast<int>(segments.size()) - 1));
+
+            return segments[s].hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
+            if (segments.front().nodes.empty())
+                return false;
+
+            output_box = box;
+
+            return true;
+        }
+};
+
+#endif // MOTION_BVH_H
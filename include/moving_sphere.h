@@ -4,21 +4,26 @@
 #include "aabb.h"
 #include "hittable.h"
 
-class moving_sphere : public hittable {
+class moving_sphere final : public hittable {
     public:
         point3 center_0, center_1;
-        double time_0, time_1;
-        double radius;
+        real time_0, time_1;
+        real radius;
         shared_ptr<material> mat_ptr;
 
     public:
-        moving_sphere() {}
+        moving_sphere() {
+            kind = moving_sphere_kind;
+        }
+
         moving_sphere(
             point3 cen0, point3 cen1, 
-            double _time0, double _time1, 
-            double r, 
+            real _time0, real _time1, 
+            real r, 
             shared_ptr<material> m
         ) {
+            kind = moving_sphere_kind;
+
             center_0 = cen0;
             center_1 = cen1;
 
@@ -32,7 +37,7 @@ class moving_sphere : public hittable {
 
         virtual bool hit(
             const ray &r, 
-            double t_min, double t_max, 
+            real t_min, real t_max, 
             hit_record &rec
         ) const override {
             vec3 oc = r.origin() - center(r.time());
@@ -42,7 +47,7 @@ class moving_sphere : public hittable {
             auto c = oc.length_squared() - radius*radius;
 
             auto discriminant = half_b*half_b - a*c;
-            if (discriminant < 0) return false;
+            if (!(discriminant >= 0)) return false;
             auto sqrtd = sqrt(discriminant);
 
             // Find the nearest root that lies in the acceptable range.
@@ -54,21 +59,28 @@ class moving_sphere : public hittable {
             }
 
             rec.t = root;
-            rec.p = r.at(rec.t);
+
+            // Projected back onto the sphere, like sphere::hit does
+            auto current_center = center(r.time());
+            auto offset = r.at(rec.t) - current_center;
+            auto outward_normal = ((radius < 0 ? -1 : 1) / offset.length()) * offset;
+
+            rec.p = current_center + radius * outward_normal;
+            rec.error_magnitude = max_magnitude(current_center) + fabs(radius);
+            rec.footprint = 0;
             
-            auto outward_normal = (rec.p - center(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
             
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
 
             return true;
         }
 
-        point3 center(double time) const {
+        point3 center(real time) const {
             return center_0 + ((time - time_0) / (time_1 - time_0)) * (center_1 - center_0);
         }
 
-        virtual bool bounding_box(double _time_0, double _time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real _time_0, real _time_1, aabb &output_box) const override {
             aabb box_0(
                 center(_time_0) - vec3(radius, radius, radius),
                 center(_time_0) + vec3(radius, radius, radius)
@@ -4,74 +4,98 @@
 #include "utility.h"
 
 #include "hittable.h"
+#include "primitives.h"
 #include "onb.h"
 
-class pdf {    
+// Distribution of directions, stored by value. The built-in distributions are kinds of
+// this one class instead of virtual subclasses behind shared_ptrs, so a bounce builds
+// them on the stack: no allocation, no reference count and no virtual call to sample them.
+class pdf {
     public:
-        pdf() {}
-        ~pdf() {}
+        enum pdf_kind { empty, cosine, towards_hittable };
 
-        virtual double value(const vec3& direction) const = 0;
-        virtual vec3 generate() const = 0;    
-};
+        pdf_kind kind;
 
-class cosine_pdf : public pdf {
-    public:
+        // cosine: the frame around the normal
         onb uvw;
 
+        // towards_hittable: the object and the point the directions start from. The
+        // object isn't owned, it has to outlive the pdf.
+        const hittable *object;
+        point3 o;
+
     public:
-        cosine_pdf(const vec3& w) {
-            uvw.build_from_w(w);
-        }
+        pdf() : kind(empty), object(nullptr) {}
+
+        real value(const vec3& direction) const {
+            switch (kind) {
+                case cosine: {
+                    auto cos_theta = dot(unit_vector(direction), uvw.w());
 
-        virtual double value(const vec3& direction) const override {
-            auto cosine = dot(unit_vector(direction), uvw.w());
-            
-            return (cosine <= 0) ? 0 : cosine / pi;
+                    return (cos_theta <= 0) ? 0 : cos_theta / pi;
+                }
+
+                case towards_hittable:
+                    return primitive_pdf_value(*object, o, direction);
+
+                default:
+                    return 0;
+            }
         }
 
-        virtual vec3 generate() const override {
-            return uvw.local(random_cosine_direction());
+        vec3 generate() const {
+            switch (kind) {
+                case cosine:
+                    return uvw.local(random_cosine_direction());
+
+                case towards_hittable:
+                    return primitive_random(*object, o);
+
+                default:
+                    return vec3(0, 0, 0);
+            }
         }
 };
 
-class hittable_pdf : public pdf {
-    public:
-        point3 o;
-        shared_ptr<hittable> ptr;
-
+// Cosine-weighted directions around w
+class cosine_pdf : public pdf {
     public:
-        hittable_pdf(shared_ptr<hittable> p, const point3& origin) : ptr(p), o(origin) {}
-
-        virtual double value(const vec3& direction) const override {
-            return ptr->pdf_value(o, direction);
+        cosine_pdf(const vec3& w) {
+            kind = cosine;
+            uvw.build_from_w(w);
         }
+};
 
-        virtual vec3 generate() const override {
-            return ptr->random(o);
+// Directions from origin towards the object p
+class hittable_pdf : public pdf {
+    public:
+        hittable_pdf(const hittable &p, const point3& origin) {
+            kind = towards_hittable;
+            object = &p;
+            o = origin;
         }
 };
 
-class mixture_pdf : public pdf {
+class mixture_pdf {
     public:
-        shared_ptr<pdf> p[2];
+        pdf p[2];
 
     public:
-        mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
+        mixture_pdf(const pdf &p0, const pdf &p1) {
             p[0] = p0;
             p[1] = p1;
         }
 
-        virtual double value(const vec3& direction) const override {
-            return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
+        real value(const vec3& direction) const {
+            return 0.5 * p[0].value(direction) + 0.5 * p[1].value(direction);
         }
 
-        virtual vec3 generate() const override {
-            if(random_double() < 0.5) 
-                return p[0]->generate();
+        vec3 generate() const {
+            if(random_double() < 0.5)
+                return p[0].generate();
             else
-                return p[1]->generate();
+                return p[1].generate();
         }
 };
 
-#endif // PDF_H
\ No newline at end of file
+#endif // PDF_H
@@ -31,7 +31,7 @@ class perlin {
             }
         }
 
-        static double trilinear_interp(double c[2][2][2], double u, double v, double w) {
+        static real trilinear_interp(real c[2][2][2], real u, real v, real w) {
             auto accum = 0.0;
             for (int i=0; i < 2; i++)
                 for (int j=0; j < 2; j++)
@@ -43,7 +43,7 @@ class perlin {
             return accum;
         }
 
-        static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
+        static real perlin_interp(vec3 c[2][2][2], real u, real v, real w) {
             // Using a Hermite cubic to round off the interpolation
             auto uu = u * u * (3 - 2 * u);
             auto vv = v * v * (3 - 2 * v);
@@ -83,7 +83,7 @@ class perlin {
             delete[] perm_z;
         }
 
-        double noise(const point3 &p) const {
+        real noise(const point3 &p) const {
             auto u = p.x() - floor(p.x());
             auto v = p.y() - floor(p.y());
             auto w = p.z() - floor(p.z());
@@ -108,7 +108,7 @@ class perlin {
             return perlin_interp(c, u, v, w);    
         }
 
-        double turbulence(const point3 &p, int depth = 7) const {
+        real turbulence(const point3 &p, int depth = 7) const {
             auto accum = 0.0;
             auto temp_p = p;
             auto weight = 1.0;
@@ -0,0 +1,66 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include "utility.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "box.h"
+
+// Calls to the built-in primitives by their kind, so the leaf loops of the hierarchies and
+// the light sampling inline the primitive tests instead of making a virtual call per
+// primitive. Any other hittable goes through its virtual functions.
+inline bool primitive_hit(const hittable &object, const ray &r, real t_min, real t_max, hit_record &rec) {
+    switch (object.kind) {
+        case hittable::sphere_kind:
+            return static_cast<const sphere &>(object).sphere::hit(r, t_min, t_max, rec);
+
+        case hittable::moving_sphere_kind:
+            return static_cast<const moving_sphere &>(object).moving_sphere::hit(r, t_min, t_max, rec);
+
+        case hittable::xy_rect_kind:
+            return static_cast<const xy_rect &>(object).xy_rect::hit(r, t_min, t_max, rec);
+
+        case hittable::xz_rect_kind:
+            return static_cast<const xz_rect &>(object).xz_rect::hit(r, t_min, t_max, rec);
+
+        case hittable::yz_rect_kind:
+            return static_cast<const yz_rect &>(object).yz_rect::hit(r, t_min, t_max, rec);
+
+        case hittable::box_kind:
+            return static_cast<const box &>(object).box::hit(r, t_min, t_max, rec);
+
+        default:
+            return object.hit(r, t_min, t_max, rec);
+    }
+}
+
+// The lights that can be sampled are spheres and xz_rects
+inline real primitive_pdf_value(const hittable &object, const point3 &o, const vec3 &v) {
+    switch (object.kind) {
+        case hittable::sphere_kind:
+            return static_cast<const sphere &>(object).sphere::pdf_value(o, v);
+
+        case hittable::xz_rect_kind:
+            return static_cast<const xz_rect &>(object).xz_rect::pdf_value(o, v);
+
+        default:
+            return object.pdf_value(o, v);
+    }
+}
+
+inline vec3 primitive_random(const hittable &object, const point3 &o) {
+    switch (object.kind) {
+        case hittable::sphere_kind:
+            return static_cast<const sphere &>(object).sphere::random(o);
+
+        case hittable::xz_rect_kind:
+            return static_cast<const xz_rect &>(object).xz_rect::random(o);
+
+        default:
+            return object.random(o);
+    }
+}
+
+#endif // PRIMITIVES_H
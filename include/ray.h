@@ -3,35 +3,79 @@
 
 #include "vec3.h"
 
-class ray {
+// Ray with an origin and direction of scalar type T, traced through the scene as the
+// ray alias with the real scalar type of the build
+template <typename T>
+class basic_ray {
     public:
-        point3 orig;
-        vec3 dir;
-        double tm;
+        basic_vec3<T> orig;
+        basic_vec3<T> dir;
+        T tm;
+
+        // Width that the cone of directions the ray stands for (the pixel of a camera ray)
+        // grows by per unit of t, which textures pick their level of detail from. Zero
+        // for rays that don't carry a cone.
+        T spread = 0;
 
     public:
-        ray() {}
-        ray(const point3 &origin, const vec3 &direction, double time) {
+        basic_ray() {}
+        basic_ray(const basic_vec3<T> &origin, const basic_vec3<T> &direction, T time) {
             orig = origin;
             dir = direction;
             tm = time;
         }
 
-        point3 origin() const {
+        basic_vec3<T> origin() const {
             return orig;
         }
 
-        vec3 direction() const {
+        basic_vec3<T> direction() const {
             return dir;
         }
 
-        double time() const {
+        T time() const {
             return tm;
         }
 
-        point3 at(double t) const {
+        basic_vec3<T> at(T t) const {
             return orig + t * dir;
         }   
 };
 
-#endif // RAY_H
\ No newline at end of file
+using ray = basic_ray<real>;
+
+// Size of the offsets of offset_ray_origin for each precision: a fraction of the magnitude
+// of the coordinates the point was computed from, plus a floor for points at the world
+// origin. The fractions are about a hundred times the smallest ones tests/precision.cpp
+// passes with.
+template <typename T>
+struct ray_offset_constants;
+
+template <>
+struct ray_offset_constants<float> {
+    static constexpr float relative = 1.0f / 65536.0f;
+    static constexpr float absolute = 1.0f / 1048576.0f;
+};
+
+template <>
+struct ray_offset_constants<double> {
+    static constexpr double relative = 1.0 / 1099511627776.0;
+    static constexpr double absolute = 1.0 / 17592186044416.0;
+};
+
+// Moves the point p, lying on a surface with normal n, just off the surface on the side n
+// points to. magnitude bounds the coordinates p was computed from, which its rounding
+// error is relative to. Scaling the offset with it instead of using a fixed distance
+// keeps rays started there from hitting the surface again or skipping nearby geometry, at
+// any scale of the scene and in either precision (after "A Fast and Robust Method for
+// Avoiding Self-Intersection", Wächter and Binder, Ray Tracing Gems).
+template <typename T>
+inline basic_vec3<T> offset_ray_origin(const basic_vec3<T> &p, const basic_vec3<T> &n, T magnitude) {
+    typedef ray_offset_constants<T> constants;
+
+    // The largest component of n is at least 1/sqrt(3), so the offset along it is hundreds
+    // of ulps of p and can't round away
+    return p + (constants::absolute + constants::relative * magnitude) * n;
+}
+
+#endif // RAY_H
@@ -0,0 +1,190 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "utility.h"
+
+// Up to max_size coherent rays traced together, typically the primary rays of one pixel
+// or of a few neighbouring ones. Sizes of 4, 8 and 16 fill whole SIMD registers.
+struct ray_packet {
+    enum { max_size = 16 };
+
+    ray rays[max_size];
+    int size = 0;
+
+    void add(const ray &r) {
+        rays[size++] = r;
+    }
+};
+
+// Index of the first ray set in a mask
+inline int lowest_ray(uint32_t mask) {
+    #if defined(__GNUC__)
+    return __builtin_ctz(mask);
+    #else
+    int i = 0;
+    while (!(mask & (1u << i)))
+        i++;
+    return i;
+    #endif
+}
+
+// Structure-of-arrays copy of a packet used by the hierarchy traversals, so the box
+// tests run over all rays with SIMD, plus the bounds of the packet frustum.
+struct packet_rays {
+    int size;
+    alignas(64) double origin[3][ray_packet::max_size];
+    alignas(64) double inv_dir[3][ray_packet::max_size];
+    alignas(64) double closest[ray_packet::max_size];
+
+    // Direction signs of the first ray, which picks the near child for the whole packet
+    bool dir_is_neg[3];
+
+    // Interval bounds over all rays, only valid when every ray has finite reciprocals
+    // with the same signs, otherwise the frustum test is skipped
+    bool has_frustum;
+    double origin_min[3], origin_max[3];
+    double inv_min[3], inv_max[3];
+
+    packet_rays(const ray_packet &packet, double t_max) : size(packet.size) {
+        for (int i = 0; i < size; i++) {
+            for (int a = 0; a < 3; a++) {
+                origin[a][i] = packet.rays[i].origin()[a];
+                inv_dir[a][i] = 1.0 / packet.rays[i].direction()[a];
+            }
+
+            closest[i] = t_max;
+        }
+
+        // Unused lanes can never hit anything, so the box test can run whole registers
+        for (int i = size; i < ray_packet::max_size; i++) {
+            for (int a = 0; a < 3; a++)
+                origin[a][i] = inv_dir[a][i] = 0;
+
+            closest[i] = -infinity;
+        }
+
+        has_frustum = true;
+
+        for (int a = 0; a < 3; a++) {
+            dir_is_neg[a] = inv_dir[a][0] < 0;
+            origin_min[a] = origin_max[a] = origin[a][0];
+            inv_min[a] = inv_max[a] = inv_dir[a][0];
+
+            for (int i = 0; i < size; i++) {
+                origin_min[a] = fmin(origin_min[a], origin[a][i]);
+                origin_max[a] = fmax(origin_max[a], origin[a][i]);
+                inv_min[a] = fmin(inv_min[a], inv_dir[a][i]);
+                inv_max[a] = fmax(inv_max[a], inv_dir[a][i]);
+
+                if (!std::isfinite(inv_dir[a][i]) or (inv_dir[a][i] < 0) != dir_is_neg[a])
+                    has_frustum = false;
+            }
+        }
+    }
+
+    double max_closest() const {
+        double t = closest[0];
+        for (int i = 1; i < size; i++)
+            t = closest[i] > t ? closest[i] : t;
+
+        return t;
+    }
+
+    // True when no ray of the packet can hit the box, from interval arithmetic on the
+    // frustum. Rounding is monotone, so the interval ends bound every ray's slab distances.
+    bool frustum_misses(const double *lower, const double *upper, double t_min, double t_max) const {
+        if (!has_frustum)
+            return false;
+
+        for (int a = 0; a < 3; a++) {
+            // Smallest entry and largest exit distance over the packet on this axis. The
+            // reciprocals share a sign, so each end comes from one corner of the intervals.
+            auto near = dir_is_neg[a] ? upper[a] - origin_min[a] : lower[a] - origin_max[a];
+            auto far = dir_is_neg[a] ? lower[a] - origin_max[a] : upper[a] - origin_min[a];
+
+            auto t_enter = near * (near >= 0 ? inv_min[a] : inv_max[a]);
+            auto t_exit = far * (far >= 0 ? inv_max[a] : inv_min[a]);
+
+            t_min = t_enter > t_min ? t_enter : t_min;
+            t_max = t_exit < t_max ? t_exit : t_max;
+        }
+
+        return t_min > t_max;
+    }
+
+    // Slab test of every ray against one box, with the same arithmetic as the single ray
+    // aabb::hit. Returns a bit mask of the rays that hit it and stores the smallest entry
+    // distance among them in t_near.
+    uint32_t box_test(const double *lower, const double *upper, double t_min, double &t_near) const {
+        alignas(64) double entry[ray_packet::max_size];
+        uint32_t mask = 0;
+
+#if defined(__AVX__)
+        // Four rays per iteration, min/max operand order matches the ternaries below
+        for (int i = 0; i < size; i += 4) {
+            auto t0 = _mm256_set1_pd(t_min);
+            auto t1 = _mm256_load_pd(closest + i);
+
+            for (int a = 0; a < 3; a++) {
+                auto origin_a = _mm256_load_pd(origin[a] + i);
+                auto inv_dir_a = _mm256_load_pd(inv_dir[a] + i);
+
+                auto near = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(lower[a]), origin_a), inv_dir_a);
+                auto far = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(upper[a]), origin_a), inv_dir_a);
+
+                t0 = _mm256_max_pd(_mm256_min_pd(near, far), t0);
+                t1 = _mm256_min_pd(_mm256_max_pd(far, near), t1);
+            }
+
+            _mm256_store_pd(entry + i, t0);
+            mask |= static_cast<uint32_t>(_mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LE_OQ))) << i;
+        }
+#else
+        for (int i = 0; i < size; i++) {
+            auto t0 = t_min;
+            auto t1 = closest[i];
+
+            for (int a = 0; a < 3; a++) {
+                auto near = (lower[a] - origin[a][i]) * inv_dir[a][i];
+                auto far = (upper[a] - origin[a][i]) * inv_dir[a][i];
+                auto t_enter = near < far ? near : far;
+                auto t_exit = near < far ? far : near;
+
+                t0 = t_enter > t0 ? t_enter : t0;
+                t1 = t_exit < t1 ? t_exit : t1;
+            }
+
+            entry[i] = t0;
+            mask |= static_cast<uint32_t>(t0 <= t1) << i;
+        }
+#endif
+
+        t_near = infinity;
+
+        for (uint32_t m = mask; m; m &= m - 1) {
+            auto t = entry[lowest_ray(m)];
+            t_near = t < t_near ? t : t_near;
+        }
+
+        return mask;
+    }
+};
+
+// True once at most a quarter of the packet still hits a node, the remaining rays then
+// finish that subtree on the single ray path
+inline bool packet_diverged(uint32_t mask, int size) {
+    int active = 0;
+    for (; mask; mask &= mask - 1)
+        active++;
+
+    return active * 4 <= size;
+}
+
+#endif // RAY_PACKET_H
@@ -0,0 +1,220 @@
+#ifndef RECT_SET_H
+#define RECT_SET_H
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "utility.h"
+#include "hittable.h"
+#include "aarect.h"
+
+// Up to four rects of one orientation in structure-of-arrays layout: the plane at k along
+// axis, and the bounds along the two other axes, u before v in x, y, z order like the
+// rects. Unused lanes hold empty rects that no ray hits.
+struct rect_pack {
+    double k[4], u0[4], u1[4], v0[4], v1[4];
+    int axis, u_axis, v_axis;
+    uint32_t count;
+};
+
+// Tests the ray against the rects of count packs. Each lane keeps the nearest hit it has
+// seen so far, without branching from one pack to the next, and the lanes are compared
+// once at the end. Returns the pack and lane of the nearest hit in [t_min, t_max], or
+// false, and its distance.
+inline bool rect_packs_hit(
+    const rect_pack *packs, size_t count, const ray &r, double t_min, double t_max,
+    double &t, size_t &hit_pack, int &hit_lane
+) {
+    double o[3], d[3], inv_d[3];
+
+    // The inverse direction is infinite for a ray parallel to a rect, and the distance NaN
+    // when the ray lies in its plane, so the rect isn't hit in either case
+    for (int a = 0; a < 3; a++) {
+        o[a] = r.orig[a];
+        d[a] = r.dir[a];
+        inv_d[a] = 1.0 / d[a];
+    }
+
+    alignas(32) double lane_t[4], lane_pack[4];
+
+#if defined(__AVX__)
+    auto low = _mm256_set1_pd(t_min);
+    auto best_t = _mm256_set1_pd(t_max);
+    auto best_pack = _mm256_set1_pd(-1);
+
+    for (size_t p = 0; p < count; p++) {
+        const auto &pack = packs[p];
+
+        auto lanes = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(pack.k), _mm256_set1_pd(o[pack.axis])), _mm256_set1_pd(inv_d[pack.axis]));
+        auto u = _mm256_add_pd(_mm256_set1_pd(o[pack.u_axis]), _mm256_mul_pd(lanes, _mm256_set1_pd(d[pack.u_axis])));
+        auto v = _mm256_add_pd(_mm256_set1_pd(o[pack.v_axis]), _mm256_mul_pd(lanes, _mm256_set1_pd(d[pack.v_axis])));
+
+        auto hit = _mm256_and_pd(_mm256_cmp_pd(lanes, low, _CMP_GE_OQ), _mm256_cmp_pd(lanes, best_t, _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(u, _mm256_loadu_pd(pack.u0), _CMP_GE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(u, _mm256_loadu_pd(pack.u1), _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(v, _mm256_loadu_pd(pack.v0), _CMP_GE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(v, _mm256_loadu_pd(pack.v1), _CMP_LE_OQ));
+
+        best_t = _mm256_blendv_pd(best_t, lanes, hit);
+        best_pack = _mm256_blendv_pd(best_pack, _mm256_set1_pd(static_cast<double>(p)), hit);
+    }
+
+    _mm256_store_pd(lane_t, best_t);
+    _mm256_store_pd(lane_pack, best_pack);
+#else
+    for (int i = 0; i < 4; i++) {
+        lane_t[i] = t_max;
+        lane_pack[i] = -1;
+    }
+
+    for (size_t p = 0; p < count; p++) {
+        const auto &pack = packs[p];
+
+        for (int i = 0; i < 4; i++) {
+            auto lane = (pack.k[i] - o[pack.axis]) * inv_d[pack.axis];
+            auto u = o[pack.u_axis] + lane * d[pack.u_axis];
+            auto v = o[pack.v_axis] + lane * d[pack.v_axis];
+
+            if (t_min <= lane and lane <= lane_t[i] and pack.u0[i] <= u and u <= pack.u1[i]
+                and pack.v0[i] <= v and v <= pack.v1[i]) {
+                lane_t[i] = lane;
+                lane_pack[i] = static_cast<double>(p);
+            }
+        }
+    }
+#endif
+
+    hit_lane = -1;
+    t = t_max;
+
+    for (int i = 0; i < 4; i++) {
+        if (lane_pack[i] >= 0 and (hit_lane < 0 or lane_t[i] < t)) {
+            hit_lane = i;
+            t = lane_t[i];
+        }
+    }
+
+    if (hit_lane < 0)
+        return false;
+
+    hit_pack = static_cast<size_t>(lane_pack[hit_lane]);
+
+    return true;
+}
+
+// Static axis-aligned rects stored by value and tested four at a time, instead of as one
+// object and one virtual call each. The shading data is that of the rect classes. It pays
+// off for many rects outside of a hierarchy: a handful of large ones, like the walls of a
+// Cornell box, are as fast as separate rects, which reject the rects behind the ray right
+// after their division.
+class rect_set : public hittable {
+    public:
+        std::vector<rect_pack> packs;
+
+        // The material of lane i of pack p at 4 p + i
+        std::vector<shared_ptr<material>> materials;
+        aabb box;
+
+    public:
+        rect_set() {}
+
+        void add(const xy_rect &rect) {
+            add(2, 0, 1, rect.x0, rect.x1, rect.y0, rect.y1, rect.k, rect.mp);
+            extend(rect);
+        }
+
+        void add(const xz_rect &rect) {
+            add(1, 0, 2, rect.x0, rect.x1, rect.z0, rect.z1, rect.k, rect.mp);
+            extend(rect);
+        }
+
+        void add(const yz_rect &rect) {
+            add(0, 1, 2, rect.y0, rect.y1, rect.z0, rect.z1, rect.k, rect.mp);
+            extend(rect);
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            double t;
+            size_t hit_pack;
+            int hit_lane;
+
+            if (!rect_packs_hit(packs.data(), packs.size(), r, t_min, t_max, t, hit_pack, hit_lane))
+                return false;
+
+            // Shading data is only computed for the closest hit
+            const auto &p = packs[hit_pack];
+            rec.t = static_cast<real>(t);
+
+            // The plane coordinate is exact instead of carrying the error of the ray
+            rec.p = r.at(rec.t);
+            rec.p[p.axis] = static_cast<real>(p.k[hit_lane]);
+            rec.error_magnitude = 0;
+
+            rec.u = static_cast<real>((rec.p[p.u_axis] - p.u0[hit_lane]) / (p.u1[hit_lane] - p.u0[hit_lane]));
+            rec.v = static_cast<real>((rec.p[p.v_axis] - p.v0[hit_lane]) / (p.v1[hit_lane] - p.v0[hit_lane]));
+            rec.footprint = static_cast<real>(r.spread * t / (p.u1[hit_lane] - p.u0[hit_lane]));
+
+            vec3 outward_normal;
+            outward_normal[p.axis] = 1;
+            rec.set_face_normal(r, outward_normal);
+
+            rec.mat_ptr = materials[4 * hit_pack + hit_lane].get();
+
+            return true;
+        }
+
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
+            if (packs.empty())
+                return false;
+
+            output_box = box;
+
+            return true;
+        }
+
+    protected:
+        // Adds the rect to the last pack of its orientation, or to a new one when that is full
+        void add(int axis, int u_axis, int v_axis, real u0, real u1, real v0, real v1, real k, shared_ptr<material> m) {
+            size_t p = packs.size();
+
+            while (p > 0 and packs[p - 1].axis != axis)
+                p--;
+
+            if (p == 0 or packs[p - 1].count == 4) {
+                rect_pack pack = {};
+                pack.axis = axis;
+                pack.u_axis = u_axis;
+                pack.v_axis = v_axis;
+
+                for (int i = 0; i < 4; i++)
+                    pack.u1[i] = pack.v1[i] = -1;
+
+                packs.push_back(pack);
+                materials.resize(4 * packs.size());
+                p = packs.size();
+            }
+
+            auto &pack = packs[p - 1];
+            auto i = pack.count++;
+
+            pack.k[i] = k;
+            pack.u0[i] = u0;
+            pack.u1[i] = u1;
+            pack.v0[i] = v0;
+            pack.v1[i] = v1;
+            materials[4 * (p - 1) + i] = m;
+        }
+
+        void extend(const hittable &rect) {
+            aabb rect_box;
+            rect.bounding_box(0, 1, rect_box);
+
+            box = packs.size() == 1 and packs[0].count == 1 ? rect_box : surrounding_box(box, rect_box);
+        }
+};
+
+#endif // RECT_SET_H
@@ -0,0 +1,204 @@
+#ifndef RENDER_SCHEDULER_H
+#define RENDER_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+
+// Rectangle of pixels [x0, x1) x [y0, y1) rendered as one unit of work
+struct render_tile {
+    int x0, y0, x1, y1;
+};
+
+// Deque of tile indices owned by one thread. The owner pops from the bottom and idle
+// threads steal from the top (Chase–Lev). Every tile is pushed before the render starts,
+// so the storage never grows and both ends only need atomic indices, no locks.
+class tile_deque {
+    public:
+        std::vector<uint32_t> items;
+
+        // Padded so the indices of different threads never share a cache line
+        alignas(64) std::atomic<int64_t> top;
+        alignas(64) std::atomic<int64_t> bottom;
+
+    public:
+        tile_deque() : top(0), bottom(0) {}
+
+        void reset(std::vector<uint32_t> tiles) {
+            items = std::move(tiles);
+            top = 0;
+            bottom = static_cast<int64_t>(items.size());
+        }
+
+        bool pop(uint32_t &item) {
+            auto b = bottom.load() - 1;
+            bottom.store(b);
+            auto t = top.load();
+
+            if (t > b) {
+                bottom.store(t);
+                return false;
+            }
+
+            item = items[b];
+
+            // The last tile may be stolen at the same time, the top decides who gets it
+            if (t == b) {
+                bool won = top.compare_exchange_strong(t, t + 1);
+                bottom.store(t + 1);
+                return won;
+            }
+
+            return true;
+        }
+
+        bool steal(uint32_t &item) {
+            auto t = top.load();
+            auto b = bottom.load();
+
+            if (t >= b)
+                return false;
+
+            item = items[t];
+
+            return top.compare_exchange_strong(t, t + 1);
+        }
+
+        bool empty() const {
+            return top.load() >= bottom.load();
+        }
+};
+
+// Fixed array of tile deques in storage aligned for them. Before C++17, new doesn't honour
+// the 64 byte alignment of tile_deque, which its padding relies on.
+class tile_deque_array {
+    public:
+        explicit tile_deque_array(int _count) : count(_count) {
+            void *storage = nullptr;
+
+            if (posix_memalign(&storage, alignof(tile_deque), count * sizeof(tile_deque)) != 0)
+                throw std::bad_alloc();
+
+            deques = static_cast<tile_deque *>(storage);
+
+            for (int i = 0; i < count; i++)
+                new (deques + i) tile_deque();
+        }
+
+        ~tile_deque_array() {
+            for (int i = 0; i < count; i++)
+                deques[i].~tile_deque();
+
+            free(deques);
+        }
+
+        tile_deque_array(const tile_deque_array &) = delete;
+        tile_deque_array &operator = (const tile_deque_array &) = delete;
+
+        tile_deque &operator [] (int i) {
+            return deques[i];
+        }
+
+        tile_deque *get() {
+            return deques;
+        }
+
+    protected:
+        tile_deque *deques;
+        int count;
+};
+
+// Splits the image in tiles and renders them on every hardware thread. Tiles are dealt
+// round-robin to per-thread deques, so each thread starts with a mix of cheap and
+// expensive regions, and threads that run out steal from the others until no work is
+// left. Nothing is locked while rendering: each pixel belongs to exactly one tile.
+class render_scheduler {
+    public:
+        int width, height;
+        int tile_size;
+        int thread_count;
+
+        std::vector<render_tile> tiles;
+
+    public:
+        render_scheduler(int _width, int _height, int _tile_size = 16, int _thread_count = 0)
+            : width(_width), height(_height), tile_size(_tile_size), thread_count(_thread_count) {
+            if (thread_count <= 0)
+                thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+            for (int y = 0; y < height; y += tile_size) {
+                for (int x = 0; x < width; x += tile_size)
+                    tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+            }
+        }
+
+        // Calls render for every tile, from thread_count threads. progress is called on
+        // the calling thread only, after each of its tiles, with the number of tiles done.
+        void run(
+            const std::function<void(const render_tile &)> &render,
+            const std::function<void(size_t done, size_t total)> &progress = nullptr
+        ) {
+            tile_deque_array deques(thread_count);
+
+            for (int t = 0; t < thread_count; t++) {
+                std::vector<uint32_t> owned;
+                for (size_t i = t; i < tiles.size(); i += thread_count)
+                    owned.push_back(static_cast<uint32_t>(i));
+
+                // Popped from the back, so the first tiles are rendered first
+                std::reverse(owned.begin(), owned.end());
+                deques[t].reset(std::move(owned));
+            }
+
+            std::atomic<size_t> tiles_done(0);
+
+            #pragma omp parallel num_threads(thread_count)
+            {
+                // The runtime may give fewer threads than requested, the missing ones'
+                // tiles are then stolen
+                int id = omp_get_thread_num();
+                uint32_t index;
+
+                while (next_tile(deques.get(), id, index)) {
+                    render(tiles[index]);
+
+                    auto done = ++tiles_done;
+                    if (id == 0 and progress)
+                        progress(done, tiles.size());
+                }
+            }
+        }
+
+    protected:
+        bool next_tile(tile_deque *deques, int id, uint32_t &index) const {
+            if (deques[id].pop(index))
+                return true;
+
+            // Visit the other deques starting after our own. No work is ever added, so
+            // once every deque is empty the render is over.
+            while (true) {
+                bool any_left = false;
+
+                for (int k = 1; k < thread_count; k++) {
+                    auto &victim = deques[(id + k) % thread_count];
+
+                    if (victim.steal(index))
+                        return true;
+
+                    any_left = any_left or !victim.empty();
+                }
+
+                if (!any_left)
+                    return false;
+            }
+        }
+};
+
+#endif // RENDER_SCHEDULER_H
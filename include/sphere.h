@@ -5,14 +5,14 @@
 #include "vec3.h"
 #include "onb.h"
 
-class sphere : public hittable {
+class sphere final : public hittable {
     public:
         point3 center;
-        double radius;
+        real radius;
         shared_ptr<material> mat_ptr;
     
-    private:
-        static void get_sphere_uv(const point3 &p, double &u, double &v) {
+    public:
+        static void get_sphere_uv(const point3 &p, real &u, real &v) {
             // p: a given point on the sphere of radius one, centered at the origin.
             // u: returned value [0,1] of angle around the Y axis from X=-1.
             // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -28,14 +28,18 @@ class sphere : public hittable {
         }
 
     public:
-        sphere() {}
-        sphere(point3 c, double r, shared_ptr<material> m) {
+        sphere() {
+            kind = sphere_kind;
+        }
+
+        sphere(point3 c, real r, shared_ptr<material> m) {
+            kind = sphere_kind;
             center = c;
             radius = r;
             mat_ptr = m;
         }
 
-        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
             vec3 oc = r.origin() - center;
             
             auto a = r.direction().length_squared();
@@ -44,7 +48,8 @@ class sphere : public hittable {
 
             auto discriminant = half_b * half_b - a * c;
 
-            if (discriminant < 0)
+            // Also rejects a NaN discriminant, from a NaN ray or terms past the range of real
+            if (!(discriminant >= 0))
                 return false;
 
             auto sqrt_d = sqrt(discriminant);
@@ -59,19 +64,29 @@ class sphere : public hittable {
             }
 
             rec.t = root;
-            rec.p = r.at(rec.t);
-            
-            vec3 outward_normal = (rec.p - center) / radius;
+
+            // The point is projected back onto the sphere, so its error is relative to the
+            // sphere instead of to the distance the ray travelled
+            auto offset = r.at(rec.t) - center;
+            vec3 outward_normal = ((radius < 0 ? -1 : 1) / offset.length()) * offset;
+
+            rec.p = center + radius * outward_normal;
+            rec.error_magnitude = max_magnitude(center) + fabs(radius);
             rec.set_face_normal(r, outward_normal);
 
-            get_sphere_uv(outward_normal, rec.u, rec.v);
+            // The uvs don't need the projection, so their trigonometry doesn't wait for its
+            // square root
+            get_sphere_uv(offset / radius, rec.u, rec.v);
 
-            rec.mat_ptr = mat_ptr;
+            // u runs once around the equator
+            rec.footprint = r.spread * rec.t / (2 * pi * fabs(radius));
+
+            rec.mat_ptr = mat_ptr.get();
 
             return true;
         }
 
-        virtual bool bounding_box(double time_0, double time_1, aabb &output_box) const override {
+        virtual bool bounding_box(real time_0, real time_1, aabb &output_box) const override {
             output_box = aabb(
                 center - vec3(radius, radius, radius),
                 center + vec3(radius, radius, radius)
@@ -80,13 +95,19 @@ class sphere : public hittable {
             return true;
         }
 
-        double pdf_value(const point3& o, const vec3& v) const {
+        real pdf_value(const point3& o, const vec3& v) const {
             hit_record rec;
 
-            if (!this->hit(ray(o, v, 0), 0.001, infinity, rec))
+            if (!sphere::hit(ray(o, v, 0), 0.001, infinity, rec))
                 return 0.0;
 
-            auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
+            // From inside the sphere every direction hits it
+            auto distance_squared = (center - o).length_squared();
+
+            if (distance_squared <= radius * radius)
+                return 1 / (4 * pi);
+
+            auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
             auto solid_anlge = 2 * pi * (1 - cos_theta_max);
 
             return 1 / solid_anlge;
@@ -96,7 +117,12 @@ class sphere : public hittable {
             vec3 direction = center - o;
 
             auto distance_squared = direction.length_squared();
-            
+
+            // The cone towards the sphere isn't defined from inside it, which every
+            // direction leaves through
+            if (distance_squared <= radius * radius)
+                return random_unit_vector();
+
             onb uvw;
             uvw.build_from_w(direction);
 
@@ -0,0 +1,509 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "utility.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+
+// Spheres in structure-of-arrays layout, the input of a sphere_set. Each one refers to a
+// material of the set by its index.
+class sphere_buffers {
+    public:
+        std::vector<real> center[3];
+        std::vector<real> radius;
+        std::vector<uint32_t> material;
+
+    public:
+        size_t size() const {
+            return radius.size();
+        }
+
+        void add(const point3 &c, real r, uint32_t m) {
+            for (int a = 0; a < 3; a++)
+                center[a].push_back(c[a]);
+
+            radius.push_back(r);
+            material.push_back(m);
+        }
+
+        point3 sphere_center(size_t sphere) const {
+            return point3(center[0][sphere], center[1][sphere], center[2][sphere]);
+        }
+};
+
+// Eight spheres of a leaf in structure-of-arrays layout, tested as two AVX halves. Only
+// the first count lanes hold spheres.
+struct sphere_pack {
+    double center[3][8];
+    double radius[8];
+    uint32_t material[8];
+    uint32_t count;
+};
+
+// Tests the ray against the spheres of a pack, solving the quadratic of sphere::hit with
+// a multiplication by 1/a instead of the divisions. Returns the lane of the nearest hit in
+// [t_min, t_max], or -1, and its distance.
+inline int sphere_pack_hit(const sphere_pack &pack, const ray &r, double t_min, double t_max, double &t) {
+    alignas(32) double lane_t[8];
+    int mask = 0;
+
+    const auto &o = r.orig;
+    const auto &d = r.dir;
+    auto a = d.length_squared();
+    auto inverse_a = 1.0 / a;
+
+#if defined(__AVX__)
+    auto dx = _mm256_set1_pd(d[0]), dy = _mm256_set1_pd(d[1]), dz = _mm256_set1_pd(d[2]);
+    auto ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+    auto va = _mm256_set1_pd(a);
+    auto inv_a = _mm256_set1_pd(inverse_a);
+    auto low = _mm256_set1_pd(t_min), high = _mm256_set1_pd(t_max);
+
+    for (int half = 0; half < 8; half += 4) {
+        // oc = o - center, half_b = oc . d, c = oc . oc - r^2
+        auto ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(pack.center[0] + half));
+        auto ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(pack.center[1] + half));
+        auto ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(pack.center[2] + half));
+        auto radius = _mm256_loadu_pd(pack.radius + half);
+
+        auto half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        auto c = _mm256_sub_pd(
+            _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+            _mm256_mul_pd(radius, radius)
+        );
+
+        auto discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(va, c));
+        auto hit = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+
+        if (!_mm256_movemask_pd(hit))
+            continue;
+
+        // The nearest root in range, else the farthest one
+        auto sqrt_d = _mm256_sqrt_pd(_mm256_max_pd(discriminant, _mm256_setzero_pd()));
+        auto near = _mm256_mul_pd(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_add_pd(half_b, sqrt_d)), inv_a);
+        auto far = _mm256_mul_pd(_mm256_sub_pd(sqrt_d, half_b), inv_a);
+
+        auto near_ok = _mm256_and_pd(_mm256_cmp_pd(near, low, _CMP_GE_OQ), _mm256_cmp_pd(near, high, _CMP_LE_OQ));
+        auto far_ok = _mm256_and_pd(_mm256_cmp_pd(far, low, _CMP_GE_OQ), _mm256_cmp_pd(far, high, _CMP_LE_OQ));
+
+        hit = _mm256_and_pd(hit, _mm256_or_pd(near_ok, far_ok));
+        mask |= _mm256_movemask_pd(hit) << half;
+
+        _mm256_store_pd(lane_t + half, _mm256_blendv_pd(far, near, near_ok));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        vec3 oc = o - point3(pack.center[0][i], pack.center[1][i], pack.center[2][i]);
+
+        auto half_b = dot(oc, d);
+        auto c = oc.length_squared() - pack.radius[i] * pack.radius[i];
+        auto discriminant = half_b * half_b - a * c;
+
+        if (!(discriminant >= 0))
+            continue;
+
+        auto sqrt_d = sqrt(discriminant);
+        auto root = (-half_b - sqrt_d) * inverse_a;
+
+        if (root < t_min or t_max < root)
+            root = (-half_b + sqrt_d) * inverse_a;
+
+        lane_t[i] = root;
+        mask |= (t_min <= root and root <= t_max) << i;
+    }
+#endif
+
+    mask &= (1 << pack.count) - 1;
+
+    if (!mask)
+        return -1;
+
+    int nearest = -1;
+    t = t_max;
+
+    for (int i = 0; i < 8; i++) {
+        if ((mask & (1 << i)) and (nearest < 0 or lane_t[i] < t)) {
+            nearest = i;
+            t = lane_t[i];
+        }
+    }
+
+    return nearest;
+}
+
+// Static spheres stored by value, with their own 8-wide hierarchy whose leaves hold up to
+// eight spheres as one sphere_pack. A set replaces thousands of sphere objects: no
+// allocation or virtual call per sphere, and both the nodes and the leaves are tested
+// with a few SIMD instructions. The set owns the materials its spheres refer to.
+class sphere_set : public hittable {
+    public:
+        typedef wide_bvh<8> wide;
+
+        std::vector<shared_ptr<material>> materials;
+
+        // Leaf children point to their sphere pack, with the number of spheres as count
+        std::vector<wide_bvh_node<8>> nodes;
+        std::vector<sphere_pack> packs;
+        aabb box;
+
+    public:
+        sphere_set(
+            const sphere_buffers &spheres, const std::vector<shared_ptr<material>> &_materials,
+            bvh_quality quality = bvh_quality::medium, bvh_build_stats *stats = nullptr
+        ) : materials(_materials) {
+            for (auto m : spheres.material) {
+                if (m >= materials.size()) {
+                    std::cerr << "ERROR: Sphere material " << m << " out of the " << materials.size() << " given.\n";
+                    return;
+                }
+            }
+
+            if (spheres.size() == 0)
+                return;
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            std::vector<bvh_build_entry> entries(spheres.size());
+
+            #pragma omp parallel for
+            for (int64_t i = 0; i < static_cast<int64_t>(entries.size()); i++) {
+                auto center = spheres.sphere_center(i);
+                auto extent = vec3(spheres.radius[i], spheres.radius[i], spheres.radius[i]);
+
+                entries[i].box = aabb(center - extent, center + extent);
+                entries[i].centroid = center;
+                entries[i].index = i;
+            }
+
+            std::vector<bvh_build_node> build_nodes;
+            auto root = linear_bvh::build(entries, quality, 8, build_nodes);
+
+            box = build_nodes[root].box;
+            packs.reserve(spheres.size() / 4 + 1);
+
+            uint32_t first, count;
+            linear_bvh::subtree_range(build_nodes, root, first, count);
+
+            // A single pack still needs a root node to hang from
+            if (count <= 8) {
+                nodes.resize(1);
+                wide::init_node(nodes[0]);
+                wide::set_bounds(nodes[0], 0, box);
+                nodes[0].child[0] = add_pack(first, count, entries, spheres);
+                nodes[0].count[0] = static_cast<uint16_t>(count);
+                nodes[0].child_count = 1;
+            } else {
+                collapse(build_nodes, root, entries, spheres);
+            }
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = nodes.size();
+                stats->primitive_count = spheres.size();
+            }
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            if (nodes.empty())
+                return false;
+
+            wide_ray wr(r, box);
+
+            struct stack_entry {
+                uint32_t node;
+                float t_near;
+            };
+
+            stack_entry stack[64 * 8];
+            int stack_size = 0;
+            stack[stack_size++] = {0, static_cast<float>(t_min)};
+
+            auto closest_so_far = t_max;
+            const sphere_pack *hit_pack = nullptr;
+            int hit_lane = 0;
+
+            // Widened like the box tests of wide_bvh, so rounding never culls a sphere
+            const float t_min_f = wide_ray::lower_t(t_min);
+            auto t_max_f = wide_ray::upper_t(closest_so_far);
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+
+                if (entry.t_near > t_max_f)
+                    continue;
+
+                const auto &node = nodes[entry.node];
+
+                alignas(32) float t_near[8];
+                int mask = wide_box_test<8>(node, wr, t_min_f, t_max_f, t_near);
+                mask &= (1 << node.child_count) - 1;
+
+                // Hit children are pushed farthest first, so the nearest one is popped next
+                int first = stack_size;
+
+                while (mask) {
+                    int i = wide::lowest_bit(mask);
+                    mask &= mask - 1;
+
+                    if (node.count[i] > 0) {
+                        const auto &pack = packs[node.child[i]];
+                        double t;
+                        int lane = sphere_pack_hit(pack, r, t_min, closest_so_far, t);
+
+                        if (lane >= 0) {
+                            closest_so_far = t;
+                            hit_pack = &pack;
+                            hit_lane = lane;
+                            t_max_f = wide_ray::upper_t(closest_so_far);
+                        }
+                    } else {
+                        stack_entry child = {node.child[i], t_near[i]};
+
+                        int j = stack_size++;
+                        while (j > first and stack[j - 1].t_near < child.t_near) {
+                            stack[j] = stack[j - 1];
+                            j--;
+                        }
+                        stack[j] = child;
+                    }
+                }
+            }
+
+            if (!hit_pack)
+                return false;
+
+            // Shading data is only computed for the closest hit
+            auto center = point3(hit_pack->center[0][hit_lane], hit_pack->center[1][hit_lane], hit_pack->center[2][hit_lane]);
+
+            auto radius = static_cast<real>(hit_pack->radius[hit_lane]);
+
+            rec.t = closest_so_far;
+
+            // Projected back onto the sphere, like sphere::hit does
+            auto offset = r.at(rec.t) - center;
+            vec3 outward_normal = ((radius < 0 ? -1 : 1) / offset.length()) * offset;
+
+            rec.p = center + radius * outward_normal;
+            rec.error_magnitude = max_magnitude(center) + fabs(radius);
+
+            rec.set_face_normal(r, outward_normal);
+
+            // Like sphere::hit, the uvs don't wait for the square root of the projection
+            sphere::get_sphere_uv(offset / radius, rec.u, rec.v);
+            rec.footprint = r.spread * rec.t / (2 * pi * fabs(radius));
+
+            rec.mat_ptr = materials[hit_pack->material[hit_lane]].get();
+
+            return true;
+        }
+
+        virtual bool bounding_box(real time0, real time1, aabb &output_box) const override {
+            if (nodes.empty())
+                return false;
+
+            output_box = box;
+
+            return true;
+        }
+
+    protected:
+        // Packs the spheres of entries[first, first + count) and returns the pack index
+        uint32_t add_pack(
+            uint32_t first, uint32_t count, const std::vector<bvh_build_entry> &entries, const sphere_buffers &spheres
+        ) {
+            sphere_pack pack = {};
+
+            for (uint32_t i = 0; i < count; i++) {
+                auto sphere = entries[first + i].index;
+
+                for (int a = 0; a < 3; a++)
+                    pack.center[a][i] = spheres.center[a][sphere];
+
+                pack.radius[i] = spheres.radius[sphere];
+                pack.material[i] = spheres.material[sphere];
+            }
+
+            pack.count = count;
+            packs.push_back(pack);
+
+            return static_cast<uint32_t>(packs.size() - 1);
+        }
+
+        // Emits the wide node for the binary interior node build_nodes[index] and all of
+        // its descendants, returning its index. As in wide_bvh, the largest children are
+        // opened until the node is full, except that subtrees of up to eight spheres
+        // aren't opened: the SAH builder splits down to single spheres, but a pack tests
+        // eight for the price of one, so they become a single leaf.
+        uint32_t collapse(
+            const std::vector<bvh_build_node> &build_nodes, uint32_t index,
+            const std::vector<bvh_build_entry> &entries, const sphere_buffers &spheres
+        ) {
+            auto offset = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+
+            uint32_t children[8], firsts[8], counts[8];
+            int child_count = 2;
+            children[0] = build_nodes[index].child[0];
+            children[1] = build_nodes[index].child[1];
+
+            for (int i = 0; i < 2; i++)
+                linear_bvh::subtree_range(build_nodes, children[i], firsts[i], counts[i]);
+
+            while (child_count < 8) {
+                int best = -1;
+                real best_area = -1;
+
+                for (int i = 0; i < child_count; i++) {
+                    auto area = build_nodes[children[i]].box.surface_area();
+
+                    if (counts[i] > 8 and area > best_area) {
+                        best = i;
+                        best_area = area;
+                    }
+                }
+
+                if (best < 0)
+                    break;
+
+                auto opened = children[best];
+                children[best] = build_nodes[opened].child[0];
+                children[child_count] = build_nodes[opened].child[1];
+
+                linear_bvh::subtree_range(build_nodes, children[best], firsts[best], counts[best]);
+                linear_bvh::subtree_range(build_nodes, children[child_count], firsts[child_count], counts[child_count]);
+                child_count++;
+            }
+
+            wide::init_node(nodes[offset]);
+            nodes[offset].child_count = child_count;
+
+            for (int i = 0; i < child_count; i++) {
+                wide::set_bounds(nodes[offset], i, build_nodes[children[i]].box);
+
+                if (counts[i] <= 8) {
+                    nodes[offset].child[i] = add_pack(firsts[i], counts[i], entries, spheres);
+                    nodes[offset].count[i] = static_cast<uint16_t>(counts[i]);
+                } else {
+                    auto child = collapse(build_nodes, children[i], entries, spheres);
+                    nodes[offset].child[i] = child;
+                }
+            }
+
+            return offset;
+        }
+};
+
+// Header of the binary sphere format, followed by the spheres as 4 floats each (center and
+// radius), then their material indices as one uint32 each
+struct sphere_file_header {
+    char magic[4];
+    uint32_t reserved;
+    uint64_t sphere_count;
+};
+
+// Writes the spheres in the binary sphere format
+inline bool save_spheres_binary(const char *file_name, const sphere_buffers &spheres) {
+    FILE *file = fopen(file_name, "wb");
+
+    if (!file) {
+        std::cerr << "ERROR: Could not write sphere file '" << file_name << "'.\n";
+        return false;
+    }
+
+    sphere_file_header header;
+    memcpy(header.magic, "RTS1", 4);
+    header.reserved = 0;
+    header.sphere_count = spheres.size();
+
+    std::vector<float> values(4 * spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        for (int a = 0; a < 3; a++)
+            values[4 * i + a] = static_cast<float>(spheres.center[a][i]);
+
+        values[4 * i + 3] = static_cast<float>(spheres.radius[i]);
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok and fwrite(values.data(), sizeof(float), values.size(), file) == values.size();
+    ok = ok and fwrite(spheres.material.data(), sizeof(uint32_t), spheres.size(), file) == spheres.size();
+    ok = (fclose(file) == 0) and ok;
+
+    if (!ok)
+        std::cerr << "ERROR: Could not write sphere file '" << file_name << "'.\n";
+
+    return ok;
+}
+
+// Loads a binary sphere file, such as particle data exported by a simulation. Returns
+// nullptr when the file can't be read or isn't valid.
+inline shared_ptr<sphere_buffers> load_spheres_binary(const char *file_name) {
+    FILE *file = fopen(file_name, "rb");
+
+    if (!file) {
+        std::cerr << "ERROR: Could not load sphere file '" << file_name << "'.\n";
+        return nullptr;
+    }
+
+    sphere_file_header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        and memcmp(header.magic, "RTS1", 4) == 0;
+
+    // The file size bounds the count before anything is allocated
+    long data_size = -1;
+    if (ok and fseek(file, 0, SEEK_END) == 0) {
+        data_size = ftell(file) - static_cast<long>(sizeof(header));
+        fseek(file, sizeof(header), SEEK_SET);
+    }
+
+    ok = ok and data_size >= 0 and header.sphere_count == static_cast<uint64_t>(data_size) / 20
+        and static_cast<uint64_t>(data_size) % 20 == 0;
+
+    auto spheres = make_shared<sphere_buffers>();
+    std::vector<float> values;
+
+    if (ok) {
+        values.resize(4 * header.sphere_count);
+        spheres->material.resize(header.sphere_count);
+
+        ok = fread(values.data(), sizeof(float), values.size(), file) == values.size()
+            and fread(spheres->material.data(), sizeof(uint32_t), header.sphere_count, file) == header.sphere_count;
+    }
+
+    fclose(file);
+
+    if (!ok) {
+        std::cerr << "ERROR: Invalid sphere file '" << file_name << "'.\n";
+        return nullptr;
+    }
+
+    for (int a = 0; a < 3; a++)
+        spheres->center[a].resize(header.sphere_count);
+    spheres->radius.resize(header.sphere_count);
+
+    for (size_t i = 0; i < header.sphere_count; i++) {
+        for (int a = 0; a < 3; a++)
+            spheres->center[a][i] = values[4 * i + a];
+
+        spheres->radius[i] = values[4 * i + 3];
+    }
+
+    return spheres;
+}
+
+#endif // SPHERE_SET_H
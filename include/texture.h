@@ -8,89 +8,116 @@
 
 #include "utility.h"
 #include "perlin.h"
+#include "mipmap.h"
 
 
 class texture {
     public:
-        virtual color value(double u, double v, const point3 &p) const = 0;
+        // The built-in texture this is, which texture_value() calls without going through
+        // value(). Anything else is other_kind. The built-in textures are final, so an
+        // overridden value() can't be skipped by a kind inherited from one of them.
+        enum texture_kind { other_kind, solid_color_kind, checker_kind, noise_kind, image_kind };
+
+        texture_kind kind = other_kind;
+
+    public:
+        virtual color value(real u, real v, const point3 &p) const = 0;
 };
 
-class solid_color : public texture {
+inline color texture_value(const texture &t, real u, real v, const point3 &p, real footprint = 0);
+
+class solid_color final : public texture {
     private:
         color color_value;
 
     public:
-        solid_color() {}
-        solid_color(color c) : color_value(c) {}
-        solid_color(double red, double green, double blue) {
+        solid_color() {
+            kind = solid_color_kind;
+        }
+
+        solid_color(color c) : color_value(c) {
+            kind = solid_color_kind;
+        }
+
+        solid_color(real red, real green, real blue) {
+            kind = solid_color_kind;
             color_value = color(red, green, blue);
         }
 
-        virtual color value(double u, double v, const point3 &p) const override {
+        virtual color value(real u, real v, const point3 &p) const override {
             return color_value;
         }
     
 };
 
-class checker_texture : public texture {
+class checker_texture final : public texture {
     public:
         shared_ptr<texture> odd, even;
 
     public:
-        checker_texture() {}
+        checker_texture() {
+            kind = checker_kind;
+        }
+
         checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd) {
+            kind = checker_kind;
             even = _even;
             odd = _odd;
         }
 
         checker_texture(color c1, color c2) {
+            kind = checker_kind;
             even = make_shared<solid_color>(c1);
             odd = make_shared<solid_color>(c2);
         }
 
-        virtual color value(double u, double v, const point3 &p) const override {
+        virtual color value(real u, real v, const point3 &p) const override {
             auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
 
             if (sines < 0) 
-                return odd->value(u, v, p);
+                return texture_value(*odd, u, v, p);
             else 
-                return even->value(u, v, p);
+                return texture_value(*even, u, v, p);
         }
 };
 
-class noise_texture : public texture {
+class noise_texture final : public texture {
     public:
         perlin noise;
-        double sc;
+        real sc;
     
     public:
-        noise_texture() {}
-        noise_texture(double scale) : sc(scale) {}
+        noise_texture() {
+            kind = noise_kind;
+        }
 
-        virtual color value(double u, double v, const point3 &p) const override {\
+        noise_texture(real scale) : sc(scale) {
+            kind = noise_kind;
+        }
+
+        virtual color value(real u, real v, const point3 &p) const override {\
             return color(1.0, 1.0, 1.0) * 0.5 * (1 + sin(sc * p.z() + 10 * noise.turbulence(p)));
         }
 };
 
-class image_texture : public texture {
+class image_texture final : public texture {
     private:
-        unsigned char *data;
-        int width, height;
-        int bytes_per_scanline;
+        mipmap texels;
 
     public:
         const static int bytes_per_pixel = 3;
 
         image_texture() {
-            data = nullptr;
-            width = height = 0;
-            bytes_per_scanline = 0;
+            kind = image_kind;
         }
 
         image_texture(const char* file_name) {
+            kind = image_kind;
+
             auto components_per_pixel = bytes_per_pixel;
+            int width, height;
 
-            data = stbi_load(
+            auto data = stbi_load(
                 file_name, 
                 &width, &height, 
                 &components_per_pixel,
@@ -99,41 +126,51 @@ class image_texture : public texture {
 
             if (!data) {
                 std::cerr << "ERROR: Could not load texture image file '" << file_name << "'.\n";
-                width = height = 0;
+                return;
             }
-            
-            bytes_per_scanline = bytes_per_pixel * width;
+
+            texels = mipmap(data, width, height);
+            stbi_image_free(data);
         }
 
-        ~image_texture() {
-            delete data;
+        virtual color value(real u, real v, const vec3 &p) const override {
+            return filtered_value(u, v, 0);
         }
 
-        virtual color value(double u, double v, const vec3 &p) const override {
+        // Color averaged over a footprint as wide as that fraction of the range of u
+        color filtered_value(real u, real v, real footprint) const {
             // If there is no texture data, then return solid cyan as a debugging aid.
-            if (data == nullptr)
+            if (texels.empty())
                 return color(0.0, 1.0, 1.0);
 
             // Clamp input texture coordinates to [0,1] x [1,0]
             u = clamp(u, 0.0, 1.0);
             v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
-        
-            auto i = static_cast<int>(u * width);
-            auto j = static_cast<int>(v * height);
 
-            // Clamp integer mapping, since actual coordinates should be less than 1.0
-            if (i >= width)  i = width  - 1;
-            if (j >= height) j = height - 1;
-
-            const auto color_scale = 1.0 / 255.0;
-            auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
-
-            return color(
-                color_scale * pixel[0], 
-                color_scale * pixel[1], 
-                color_scale * pixel[2]
-            );
+            return texels.lookup(u, v, footprint);
         }
 };
 
+// Calls to the built-in textures by their kind, so the materials inline the lookup instead
+// of making a virtual call. Any other texture goes through value(). Image textures are
+// filtered over footprint, the width of the lookup as a fraction of the range of u.
+inline color texture_value(const texture &t, real u, real v, const point3 &p, real footprint) {
+    switch (t.kind) {
+        case texture::solid_color_kind:
+            return static_cast<const solid_color &>(t).solid_color::value(u, v, p);
+
+        case texture::checker_kind:
+            return static_cast<const checker_texture &>(t).checker_texture::value(u, v, p);
+
+        case texture::noise_kind:
+            return static_cast<const noise_texture &>(t).noise_texture::value(u, v, p);
+
+        case texture::image_kind:
+            return static_cast<const image_texture &>(t).filtered_value(u, v, footprint);
+
+        default:
+            return t.value(u, v, p);
+    }
+}
+
 #endif // TEXTURE_H
\ No newline at end of file
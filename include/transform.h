@@ -0,0 +1,149 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "utility.h"
+#include "aabb.h"
+
+// Affine transform stored as the upper 3x4 part of a row-major 4x4 matrix
+class transform {
+    public:
+        real m[3][4];
+
+    public:
+        transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+        static transform translation(const vec3 &offset) {
+            transform t;
+            t.m[0][3] = offset.x();
+            t.m[1][3] = offset.y();
+            t.m[2][3] = offset.z();
+
+            return t;
+        }
+
+        // Rotation around the Y axis by an angle in degrees
+        static transform rotation_y(real angle) {
+            auto radians = degrees_to_radians(angle);
+            auto sin_theta = sin(radians);
+            auto cos_theta = cos(radians);
+
+            transform t;
+            t.m[0][0] =  cos_theta;
+            t.m[0][2] =  sin_theta;
+            t.m[2][0] = -sin_theta;
+            t.m[2][2] =  cos_theta;
+
+            return t;
+        }
+
+        static transform scaling(const vec3 &s) {
+            transform t;
+            t.m[0][0] = s.x();
+            t.m[1][1] = s.y();
+            t.m[2][2] = s.z();
+
+            return t;
+        }
+
+        point3 point(const point3 &p) const {
+            return point3(
+                m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]
+            );
+        }
+
+        vec3 vector(const vec3 &v) const {
+            return vec3(
+                m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z()
+            );
+        }
+
+        // Transforms a normal with the transpose of this matrix, so calling it on the
+        // inverse transform maps normals the same way vector() maps directions
+        vec3 normal(const vec3 &n) const {
+            return vec3(
+                m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+                m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+                m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z()
+            );
+        }
+
+        // Bound on the magnitude of the terms summed by point() for a point whose
+        // coordinates are at most magnitude
+        real magnitude(real magnitude) const {
+            real largest = 0;
+
+            for (int i = 0; i < 3; i++)
+                largest = std::max(largest, (fabs(m[i][0]) + fabs(m[i][1]) + fabs(m[i][2])) * magnitude + fabs(m[i][3]));
+
+            return largest;
+        }
+
+        // Box enclosing the eight transformed corners of box
+        aabb box(const aabb &box) const {
+            point3 min( infinity,  infinity,  infinity);
+            point3 max(-infinity, -infinity, -infinity);
+
+            for (int i = 0; i < 8; i++) {
+                auto corner = point(point3(
+                    (i & 1) ? box.max().x() : box.min().x(),
+                    (i & 2) ? box.max().y() : box.min().y(),
+                    (i & 4) ? box.max().z() : box.min().z()
+                ));
+
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], corner[c]);
+                    max[c] = fmax(max[c], corner[c]);
+                }
+            }
+
+            return aabb(min, max);
+        }
+
+        transform inverse() const {
+            // Inverse of the linear part from its cofactors
+            auto det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                     - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                     + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+            auto inv_det = 1.0 / det;
+
+            transform t;
+            t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+            t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+            t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+            t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+            t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+            t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+            t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+            // The inverse translation is the inverted linear part applied to -offset
+            auto offset = t.vector(vec3(-m[0][3], -m[1][3], -m[2][3]));
+            t.m[0][3] = offset.x();
+            t.m[1][3] = offset.y();
+            t.m[2][3] = offset.z();
+
+            return t;
+        }
+};
+
+// Composition, applying b first and then a
+inline transform operator * (const transform &a, const transform &b) {
+    transform t;
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            t.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+
+        t.m[i][3] += a.m[i][3];
+    }
+
+    return t;
+}
+
+#endif // TRANSFORM_H
@@ -0,0 +1,395 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+#include "utility.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+
+// Vertex and index buffers of an indexed triangle mesh, shared by every triangle_mesh
+// built on them. The arrays either point into the owned vectors or straight into a
+// memory-mapped binary mesh file, see mesh_loader.h.
+class mesh_buffers {
+    public:
+        size_t vertex_count = 0;
+        size_t triangle_count = 0;
+
+        const float *positions = nullptr;   // 3 per vertex
+        const float *normals = nullptr;     // 3 per vertex, optional
+        const float *uvs = nullptr;         // 2 per vertex, optional
+        const uint32_t *indices = nullptr;  // 3 per triangle
+
+        std::vector<float> position_storage, normal_storage, uv_storage;
+        std::vector<uint32_t> index_storage;
+
+        // Mapped file the arrays point into, unmapped with the buffers
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+
+    public:
+        mesh_buffers() {}
+        mesh_buffers(const mesh_buffers &) = delete;
+        mesh_buffers &operator = (const mesh_buffers &) = delete;
+
+        ~mesh_buffers() {
+            #if defined(__unix__) || defined(__APPLE__)
+            if (mapping)
+                munmap(mapping, mapping_size);
+            #endif
+        }
+
+        // Points the arrays at the storage vectors once they are filled
+        void use_storage() {
+            vertex_count = position_storage.size() / 3;
+            triangle_count = index_storage.size() / 3;
+
+            positions = position_storage.data();
+            normals = normal_storage.empty() ? nullptr : normal_storage.data();
+            uvs = uv_storage.empty() ? nullptr : uv_storage.data();
+            indices = index_storage.data();
+        }
+
+        point3 position(uint32_t vertex) const {
+            return point3(positions[3 * vertex], positions[3 * vertex + 1], positions[3 * vertex + 2]);
+        }
+
+        vec3 normal(uint32_t vertex) const {
+            return vec3(normals[3 * vertex], normals[3 * vertex + 1], normals[3 * vertex + 2]);
+        }
+};
+
+// Four triangles of a leaf in structure-of-arrays layout, with the edges precomputed for
+// the Möller–Trumbore test. Unused lanes have zero edges, which can never be hit.
+struct triangle_pack {
+    double v0[3][4];
+    double e1[3][4];
+    double e2[3][4];
+    uint32_t triangle[4];
+};
+
+// Tests the ray against the four triangles of a pack. Returns the lane of the nearest hit
+// in (t_min, t_max), or -1, and its distance and barycentric coordinates.
+inline int triangle_pack_hit(
+    const triangle_pack &pack, const ray &r, double t_min, double t_max,
+    double &t, double &u, double &v
+) {
+    alignas(32) double lane_t[4], lane_u[4], lane_v[4];
+    int mask = 0;
+
+    const auto &o = r.orig;
+    const auto &d = r.dir;
+
+#if defined(__AVX__)
+    auto dx = _mm256_set1_pd(d[0]), dy = _mm256_set1_pd(d[1]), dz = _mm256_set1_pd(d[2]);
+    auto e1x = _mm256_loadu_pd(pack.e1[0]), e1y = _mm256_loadu_pd(pack.e1[1]), e1z = _mm256_loadu_pd(pack.e1[2]);
+    auto e2x = _mm256_loadu_pd(pack.e2[0]), e2y = _mm256_loadu_pd(pack.e2[1]), e2z = _mm256_loadu_pd(pack.e2[2]);
+
+    // p = d x e2, det = e1 . p
+    auto px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    auto py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    auto pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+    auto det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)), _mm256_mul_pd(e1z, pz));
+    auto inv_det = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+
+    // s = o - v0, u = (s . p) / det
+    auto sx = _mm256_sub_pd(_mm256_set1_pd(o[0]), _mm256_loadu_pd(pack.v0[0]));
+    auto sy = _mm256_sub_pd(_mm256_set1_pd(o[1]), _mm256_loadu_pd(pack.v0[1]));
+    auto sz = _mm256_sub_pd(_mm256_set1_pd(o[2]), _mm256_loadu_pd(pack.v0[2]));
+    auto bu = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)), _mm256_mul_pd(sz, pz)), inv_det);
+
+    // q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+    auto qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+    auto qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+    auto qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+    auto bv = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)), inv_det);
+    auto bt = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)), inv_det);
+
+    auto zero = _mm256_setzero_pd();
+    auto hit = _mm256_and_pd(_mm256_cmp_pd(det, zero, _CMP_NEQ_OQ), _mm256_cmp_pd(bu, zero, _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(bv, zero, _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(_mm256_add_pd(bu, bv), _mm256_set1_pd(1.0), _CMP_LE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(bt, _mm256_set1_pd(t_min), _CMP_GT_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(bt, _mm256_set1_pd(t_max), _CMP_LT_OQ));
+
+    mask = _mm256_movemask_pd(hit);
+    if (!mask)
+        return -1;
+
+    _mm256_store_pd(lane_t, bt);
+    _mm256_store_pd(lane_u, bu);
+    _mm256_store_pd(lane_v, bv);
+#else
+    for (int i = 0; i < 4; i++) {
+        vec3 e1(pack.e1[0][i], pack.e1[1][i], pack.e1[2][i]);
+        vec3 e2(pack.e2[0][i], pack.e2[1][i], pack.e2[2][i]);
+
+        auto p = cross(d, e2);
+        auto det = dot(e1, p);
+        auto inv_det = 1.0 / det;
+
+        auto s = o - vec3(pack.v0[0][i], pack.v0[1][i], pack.v0[2][i]);
+        lane_u[i] = dot(s, p) * inv_det;
+
+        auto q = cross(s, e1);
+        lane_v[i] = dot(d, q) * inv_det;
+        lane_t[i] = dot(e2, q) * inv_det;
+
+        bool hit = det != 0 and lane_u[i] >= 0 and lane_v[i] >= 0 and lane_u[i] + lane_v[i] <= 1
+                and lane_t[i] > t_min and lane_t[i] < t_max;
+        mask |= hit << i;
+    }
+
+    if (!mask)
+        return -1;
+#endif
+
+    int nearest = -1;
+    t = t_max;
+
+    for (int i = 0; i < 4; i++) {
+        if ((mask & (1 << i)) and lane_t[i] < t) {
+            nearest = i;
+            t = lane_t[i];
+        }
+    }
+
+    u = lane_u[nearest];
+    v = lane_v[nearest];
+
+    return nearest;
+}
+
+// Indexed triangle mesh with its own hierarchy over the triangles. Leaves hold up to four
+// triangles stored as one triangle_pack, so each leaf is a single SIMD test. The mesh is
+// a single hittable, so it can be placed in the world hierarchy or instanced any number
+// of times while the buffers and the hierarchy are stored once.
+class triangle_mesh : public hittable {
+    public:
+        shared_ptr<mesh_buffers> buffers;
+        shared_ptr<material> mat_ptr;
+
+        // Leaves point to their triangle pack at `offset`
+        std::vector<linear_bvh_node> nodes;
+        std::vector<triangle_pack> packs;
+
+    public:
+        triangle_mesh(
+            shared_ptr<mesh_buffers> _buffers, shared_ptr<material> m,
+            bvh_quality quality = bvh_quality::medium, bvh_build_stats *stats = nullptr
+        ) : buffers(_buffers), mat_ptr(m) {
+            if (!buffers or buffers->triangle_count == 0)
+                return;
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            std::vector<bvh_build_entry> entries(buffers->triangle_count);
+
+            #pragma omp parallel for
+            for (int64_t i = 0; i < static_cast<int64_t>(entries.size()); i++) {
+                auto box = empty_box();
+                for (int k = 0; k < 3; k++)
+                    box = surrounding_box(box, buffers->position(buffers->indices[3 * i + k]));
+
+                entries[i].box = box;
+                entries[i].centroid = box.centroid();
+                entries[i].index = i;
+            }
+
+            std::vector<bvh_build_node> build_nodes;
+            auto root = linear_bvh::build(entries, quality, 4, build_nodes);
+
+            nodes.reserve(build_nodes.size());
+            packs.reserve(build_nodes.size() / 2 + 1);
+            flatten(build_nodes, root, entries);
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = nodes.size();
+                stats->primitive_count = buffers->triangle_count;
+            }
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            if (nodes.empty())
+                return false;
+
+            auto origin = r.origin();
+            auto dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+            bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+            uint32_t stack[128];
+            int stack_size = 0;
+            uint32_t current = 0;
+
+            auto closest_so_far = t_max;
+            uint32_t hit_triangle = 0;
+            real hit_u = 0, hit_v = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const auto &node = nodes[current];
+
+                if (node.box.hit(origin, inv_dir, t_min, closest_so_far)) {
+                    if (node.count > 0) {
+                        const auto &pack = packs[node.offset];
+                        double t, u, v;
+                        int lane = triangle_pack_hit(pack, r, t_min, closest_so_far, t, u, v);
+
+                        if (lane >= 0) {
+                            hit_anything = true;
+                            closest_so_far = t;
+                            hit_triangle = pack.triangle[lane];
+                            hit_u = u;
+                            hit_v = v;
+                        }
+                    } else {
+                        if (dir_is_neg[node.axis]) {
+                            stack[stack_size++] = current + 1;
+                            current = node.offset;
+                        } else {
+                            stack[stack_size++] = node.offset;
+                            current = current + 1;
+                        }
+
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0)
+                    break;
+
+                current = stack[--stack_size];
+            }
+
+            if (!hit_anything)
+                return false;
+
+            // Shading data is only computed for the closest hit
+            const auto *index = buffers->indices + 3 * hit_triangle;
+            auto w = 1.0 - hit_u - hit_v;
+
+            auto p0 = buffers->position(index[0]);
+            auto p1 = buffers->position(index[1]);
+            auto p2 = buffers->position(index[2]);
+
+            // The point is interpolated from the vertices rather than found along the ray, so
+            // its error is relative to the triangle instead of to the distance travelled
+            rec.t = closest_so_far;
+            rec.p = w * p0 + hit_u * p1 + hit_v * p2;
+            rec.error_magnitude = std::max(max_magnitude(p0), std::max(max_magnitude(p1), max_magnitude(p2)));
+
+            auto outward_normal = unit_vector(cross(p1 - p0, p2 - p0));
+
+            if (buffers->normals) {
+                outward_normal = unit_vector(
+                    w * buffers->normal(index[0]) + hit_u * buffers->normal(index[1]) + hit_v * buffers->normal(index[2])
+                );
+            }
+
+            rec.set_face_normal(r, outward_normal);
+
+            if (buffers->uvs) {
+                const auto *uvs = buffers->uvs;
+                rec.u = w * uvs[2 * index[0]] + hit_u * uvs[2 * index[1]] + hit_v * uvs[2 * index[2]];
+                rec.v = w * uvs[2 * index[0] + 1] + hit_u * uvs[2 * index[1] + 1] + hit_v * uvs[2 * index[2] + 1];
+
+                // The cone width scaled by how much the mapping to u, v shrinks or stretches
+                // the area of the triangle
+                auto uv_area = fabs(
+                    (uvs[2 * index[1]] - uvs[2 * index[0]]) * (uvs[2 * index[2] + 1] - uvs[2 * index[0] + 1])
+                    - (uvs[2 * index[2]] - uvs[2 * index[0]]) * (uvs[2 * index[1] + 1] - uvs[2 * index[0] + 1])
+                );
+                auto area = cross(p1 - p0, p2 - p0).length();
+
+                rec.footprint = area > 0 ? r.spread * rec.t * sqrt(uv_area / area) : 0;
+            } else {
+                rec.u = hit_u;
+                rec.v = hit_v;
+                rec.footprint = 0;
+            }
+
+            rec.mat_ptr = mat_ptr.get();
+
+            return true;
+        }
+
+        virtual bool bounding_box(real time0, real time1, aabb &output_box) const override {
+            if (nodes.empty())
+                return false;
+
+            output_box = nodes[0].box;
+
+            return true;
+        }
+
+    protected:
+        // Appends the subtree rooted at build_nodes[index] in depth-first order, packing the
+        // triangles of every leaf
+        uint32_t flatten(
+            const std::vector<bvh_build_node> &build_nodes, uint32_t index,
+            const std::vector<bvh_build_entry> &entries
+        ) {
+            const auto &build_node = build_nodes[index];
+            auto offset = static_cast<uint32_t>(nodes.size());
+
+            // The SAH builder splits down to single triangles, but a pack tests four for
+            // the price of one, so small subtrees become a single leaf
+            uint32_t first, count;
+            linear_bvh::subtree_range(build_nodes, index, first, count);
+
+            linear_bvh_node node;
+            node.box = build_node.box;
+            node.axis = static_cast<uint8_t>(build_node.axis);
+            node.count = static_cast<uint16_t>((count <= 4) ? count : 0);
+            node.offset = static_cast<uint32_t>(packs.size());
+            nodes.push_back(node);
+
+            if (node.count > 0) {
+                triangle_pack pack = {};
+
+                for (uint32_t i = 0; i < count; i++) {
+                    auto triangle = static_cast<uint32_t>(entries[first + i].index);
+                    const auto *vertex = buffers->indices + 3 * triangle;
+
+                    auto v0 = buffers->position(vertex[0]);
+                    auto e1 = buffers->position(vertex[1]) - v0;
+                    auto e2 = buffers->position(vertex[2]) - v0;
+
+                    for (int a = 0; a < 3; a++) {
+                        pack.v0[a][i] = v0[a];
+                        pack.e1[a][i] = e1[a];
+                        pack.e2[a][i] = e2[a];
+                    }
+
+                    pack.triangle[i] = triangle;
+                }
+
+                packs.push_back(pack);
+            } else {
+                flatten(build_nodes, build_node.child[0], entries);
+
+                auto second_child = flatten(build_nodes, build_node.child[1], entries);
+                nodes[offset].offset = second_child;
+            }
+
+            return offset;
+        }
+};
+
+#endif // TRIANGLE_MESH_H
@@ -2,7 +2,7 @@
 #define UTILITY_H
 
 #include <cmath>
-#include <random>
+#include <cstdint>
 #include <limits>
 #include <memory>
 
@@ -12,14 +12,22 @@ using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 
+// Scalar type of the geometry and shading math. Building with RAYTRACING_FLOAT traces in
+// single precision, halving the size of the vectors, rays, boxes and hit records.
+#ifdef RAYTRACING_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
 // Constants
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = 3.1415926535897932385;
 
 // Utility Functions
 
-inline double degrees_to_radians(double degrees) {
-    return degrees * pi / 180.0;
+inline real degrees_to_radians(real degrees) {
+    return degrees * pi / 180;
 }
 
 // Clamps the value x to the range [min,max]
@@ -32,12 +40,48 @@ inline double clamp(double x, double min, double max) {
 
 // Random number generation
 
+// Counter-based generator (SplitMix64): the n-th number of a stream is a hash of the
+// stream key and n, so there is no shared state to race on. The renderer gives every
+// pixel sample its own stream keyed by (pixel, sample), making each number a function
+// of (pixel, sample, dimension) only, and images identical for any thread count.
+class random_stream {
+    public:
+        uint64_t key;
+        uint64_t dimension;
+
+    public:
+        constexpr random_stream() : key(0), dimension(0) {}
+
+        random_stream(uint64_t pixel, uint64_t sample)
+            : key(mix(mix(pixel) ^ (sample + 0x632be59bd9b4e019ull))), dimension(0) {}
+
+        // Returns a random real number in [0, 1)
+        double next() {
+            auto bits = mix(key + (++dimension) * 0x9e3779b97f4a7c15ull);
+
+            return static_cast<double>(bits >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        static uint64_t mix(uint64_t x) {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+
+            return x ^ (x >> 31);
+        }
+};
+
+// Stream used by random_double() on the calling thread. The render loop points it at the
+// stream of the sample being traced, so the camera, materials, PDFs, perlin noise and
+// constant_medium draw from it without passing it around.
+inline random_stream &thread_random_stream() {
+    static thread_local random_stream stream;
+
+    return stream;
+}
+
 // Returns a random real number in [0, 1)
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribuition(0.0, 1.0);
-    static std::mt19937 generator;
-
-    return distribuition(generator);
+    return thread_random_stream().next();
 }
 
 // Returns a random real number in [min,max)
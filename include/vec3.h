@@ -1,44 +1,55 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
 using std::sqrt;
 using std::fabs;
 
-class vec3 {
+// 3D vector with components of type T. The renderer uses it through the vec3 alias, with
+// the real scalar type of the build.
+template <typename T>
+class basic_vec3 {
     public:
-        double vec[3];
+        typedef T scalar;
+
+        T vec[3];
     public:
-        vec3() : vec{0, 0, 0} {};
-        vec3(double x, double y, double z) : vec{x, y, z} {};
+        basic_vec3() : vec{0, 0, 0} {};
+        basic_vec3(T x, T y, T z) : vec{x, y, z} {};
+
+        // Conversion from a vector of another precision
+        template <typename U>
+        explicit basic_vec3(const basic_vec3<U> &v)
+            : vec{static_cast<T>(v.vec[0]), static_cast<T>(v.vec[1]), static_cast<T>(v.vec[2])} {};
 
-        double x() const { 
+        T x() const { 
             return vec[0]; 
         }
         
-        double y() const { 
+        T y() const { 
             return vec[1]; 
         }
         
-        double z() const { 
+        T z() const { 
             return vec[2]; 
         }
 
-        double operator [] (int i) const { 
+        T operator [] (int i) const { 
             return vec[i]; 
         }
 
-        double& operator [] (int i) { 
+        T& operator [] (int i) { 
             return vec[i]; 
         }
 
-        vec3 operator - () const { 
-            return vec3(-vec[0], -vec[1], -vec[2]);
+        basic_vec3 operator - () const { 
+            return basic_vec3(-vec[0], -vec[1], -vec[2]);
         }
 
-        vec3& operator += (const vec3 &v) {
+        basic_vec3& operator += (const basic_vec3 &v) {
             vec[0] += v.vec[0];
             vec[1] += v.vec[1];
             vec[2] += v.vec[2];
@@ -46,7 +57,7 @@ class vec3 {
             return *this;
         }
 
-        vec3& operator *= (const double t) {
+        basic_vec3& operator *= (const T t) {
             vec[0] *= t;
             vec[1] *= t;
             vec[2] *= t;
@@ -54,35 +65,35 @@ class vec3 {
             return *this;
         }
 
-        vec3& operator /= (const double t) {
+        basic_vec3& operator /= (const T t) {
             return *this *= 1 / t;
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2];
         }
 
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
         // Return true if the vector is close to zero in all dimensions
         bool near_zero() const {
-            const auto s = 1e-8;
+            const T s = 1e-8;
 
             return (fabs(vec[0]) < s) and (fabs(vec[1]) < s) and (fabs(vec[2]) < s);
         }
 
-        inline static vec3 random() {
-            return vec3(
+        inline static basic_vec3 random() {
+            return basic_vec3(
                 random_double(), 
                 random_double(), 
                 random_double()
             );
         }
 
-        inline static vec3 random(double min, double max) {
-            return vec3(
+        inline static basic_vec3 random(T min, T max) {
+            return basic_vec3(
                 random_double(min, max), 
                 random_double(min, max), 
                 random_double(min, max)
@@ -91,70 +102,89 @@ class vec3 {
 };
 
 // Type aliases for vec3
+using vec3 = basic_vec3<real>;
 using point3 = vec3; // 3D Point
 using color = vec3;  // RGB Color
 
 // vec3 Utility Functions
-inline std::ostream& operator << (std::ostream &out, const vec3 &v) {
+template <typename T>
+inline std::ostream& operator << (std::ostream &out, const basic_vec3<T> &v) {
     return out << "(" << v.vec[0] << " " << v.vec[1] << " " << v.vec[2] << ")";
 }
 
-inline vec3 operator + (const vec3 &u, const vec3 v) {
-    return vec3(
+template <typename T>
+inline basic_vec3<T> operator + (const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(
         u.vec[0] + v.vec[0],
         u.vec[1] + v.vec[1],
         u.vec[2] + v.vec[2]
     );
 }
 
-inline vec3 operator - (const vec3 &u, const vec3 v) {
-    return vec3(
+template <typename T>
+inline basic_vec3<T> operator - (const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(
         u.vec[0] - v.vec[0],
         u.vec[1] - v.vec[1],
         u.vec[2] - v.vec[2]
     );
 }
 
-inline vec3 operator * (const vec3 &u, const vec3 v) {
-    return vec3(
+template <typename T>
+inline basic_vec3<T> operator * (const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(
         u.vec[0] * v.vec[0],
         u.vec[1] * v.vec[1],
         u.vec[2] * v.vec[2]
     );
 }
 
-inline vec3 operator * (double t, const vec3 &v) {
-    return vec3(
+// The scalar is taken as the vector's own type, so literals and other arithmetic types
+// convert to it instead of failing template deduction
+template <typename T>
+inline basic_vec3<T> operator * (typename basic_vec3<T>::scalar t, const basic_vec3<T> &v) {
+    return basic_vec3<T>(
         t * v.vec[0],
         t * v.vec[1],
         t * v.vec[2]
     );
 }
 
-inline vec3 operator * (const vec3 &v, double t) {
+template <typename T>
+inline basic_vec3<T> operator * (const basic_vec3<T> &v, typename basic_vec3<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator / (vec3 v, double t) {
+template <typename T>
+inline basic_vec3<T> operator / (const basic_vec3<T> &v, typename basic_vec3<T>::scalar t) {
     return (1 / t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3& v) {
+template <typename T>
+inline T dot(const basic_vec3<T> &u, const basic_vec3<T> &v) {
     return u.vec[0] * v.vec[0] + u.vec[1] * v.vec[1] + u.vec[2] * v.vec[2];
 } 
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(
         u.vec[1] * v.vec[2] - u.vec[2] * v.vec[1],
         u.vec[2] * v.vec[0] - u.vec[0] * v.vec[2],
         u.vec[0] * v.vec[1] - u.vec[1] * v.vec[0]
     );
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(const basic_vec3<T> &v) {
     return v / v.length();
 }
 
+// Largest magnitude among the components
+template <typename T>
+inline T max_magnitude(const basic_vec3<T> &v) {
+    return std::max(fabs(v.vec[0]), std::max(fabs(v.vec[1]), fabs(v.vec[2])));
+}
+
 inline vec3 random_in_unit_sphere() {
     while (true) {
         auto p = vec3::random(-1, 1);
@@ -206,7 +236,7 @@ inline vec3 random_cosine_direction() {
     return vec3(x, y, z);
 }
 
-inline vec3 random_to_sphere(double radius, double distance_squared) {
+inline vec3 random_to_sphere(real radius, real distance_squared) {
     auto r1 = random_double();
     auto r2 = random_double();
     auto z = 1 + r2 * (sqrt(1 - (radius * radius) / distance_squared) - 1);
@@ -218,15 +248,16 @@ inline vec3 random_to_sphere(double radius, double distance_squared) {
     return vec3(x, y, z);
 }
 
-inline vec3 reflect(const vec3 &v, const vec3 &n) {
+template <typename T>
+inline basic_vec3<T> reflect(const basic_vec3<T> &v, const basic_vec3<T> &n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat) {
+    auto cos_theta = fmin(dot(-uv, n), real(1));
     
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -sqrt(fabs(1 - r_out_perp.length_squared())) * n;
 
     return r_out_perp + r_out_parallel;
 }
@@ -0,0 +1,260 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "hittable.h"
+#include "ray_packet.h"
+#include "integrator.h"
+
+// Traces a whole batch of paths one stage at a time instead of one path after the other:
+// every active path is intersected, then every hit is shaded, and the paths that survive
+// start the next round. The camera rays of a pixel arrive one after the other, so the
+// first round is traced as packets; the materials are shaded in runs sorted by material,
+// so each one's code and data stay hot while it is evaluated.
+//
+// Every path draws from its own random stream, saved in its state between stages. The
+// result of a path doesn't depend on the order it is processed in, and matches the one
+// shade_iterative computes for the same camera ray and stream.
+class wavefront_integrator {
+    public:
+        const hittable &world;
+        shared_ptr<hittable> lights;
+        color background;
+        int max_depth;
+
+        // Path states, one entry per path
+        std::vector<real> origin[3], direction[3], time, spread;
+        std::vector<real> throughput[3], radiance[3];
+        std::vector<random_stream> streams;
+        std::vector<uint32_t> bounces;
+
+        // Indices of the paths still being traced, and the closest hit of each path
+        std::vector<uint32_t> active;
+        std::vector<hit_record> recs;
+
+        // Materials hit in the current round, and the number of paths that hit each one
+        std::vector<const material *> materials;
+        std::vector<uint32_t> material_counts, material_of_path, sorted;
+
+    public:
+        wavefront_integrator(const hittable &_world, shared_ptr<hittable> _lights, const color &_background, int _max_depth)
+            : world(_world), lights(_lights), background(_background), max_depth(_max_depth) {}
+
+        size_t size() const {
+            return streams.size();
+        }
+
+        void clear() {
+            for (int a = 0; a < 3; a++) {
+                origin[a].clear();
+                direction[a].clear();
+                throughput[a].clear();
+                radiance[a].clear();
+            }
+
+            time.clear();
+            spread.clear();
+            streams.clear();
+            bounces.clear();
+        }
+
+        // Generation stage: adds a path starting with the camera ray r, drawing its random
+        // numbers from stream
+        void add_path(const ray &r, const random_stream &stream) {
+            for (int a = 0; a < 3; a++) {
+                origin[a].push_back(r.origin()[a]);
+                direction[a].push_back(r.direction()[a]);
+                throughput[a].push_back(1.0);
+                radiance[a].push_back(0.0);
+            }
+
+            time.push_back(r.time());
+            spread.push_back(r.spread);
+            streams.push_back(stream);
+            bounces.push_back(0);
+        }
+
+        // Traces every path to its end
+        void trace() {
+            active.resize(size());
+            for (size_t p = 0; p < size(); p++)
+                active[p] = static_cast<uint32_t>(p);
+
+            recs.resize(size());
+
+            while (!active.empty()) {
+                intersect();
+                shade();
+            }
+        }
+
+        color result(size_t path) const {
+            return color(radiance[0][path], radiance[1][path], radiance[2][path]);
+        }
+
+    protected:
+        ray path_ray(uint32_t path) const {
+            ray r(
+                point3(origin[0][path], origin[1][path], origin[2][path]),
+                vec3(direction[0][path], direction[1][path], direction[2][path]),
+                time[path]
+            );
+            r.spread = spread[path];
+
+            return r;
+        }
+
+        void set_path_ray(uint32_t path, const ray &r) {
+            for (int a = 0; a < 3; a++) {
+                origin[a][path] = r.origin()[a];
+                direction[a][path] = r.direction()[a];
+            }
+
+            time[path] = r.time();
+            spread[path] = r.spread;
+        }
+
+        color path_throughput(uint32_t path) const {
+            return color(throughput[0][path], throughput[1][path], throughput[2][path]);
+        }
+
+        // Intersection stage: finds the closest hit of every active path. Paths that leave
+        // the scene gather the background and end. Participating media draw random numbers
+        // while intersecting: single rays draw them from their path's stream, packets from
+        // the stream of their last path, without keeping its state, like the render loop.
+        void intersect() {
+            auto &rng = thread_random_stream();
+            size_t kept = 0;
+
+            for (size_t first = 0; first < active.size(); ) {
+                ray_packet packet;
+                bool hits[ray_packet::max_size];
+
+                // Only the camera rays are coherent enough for packets
+                if (bounces[active[first]] == 0) {
+                    while (first + packet.size < active.size() and packet.size < ray_packet::max_size
+                        and bounces[active[first + packet.size]] == 0)
+                        packet.add(path_ray(active[first + packet.size]));
+
+                    rng = streams[active[first + packet.size - 1]];
+
+                    // The paths of a packet are consecutive when they were generated
+                    // together, their records are then written in place
+                    if (active[first + packet.size - 1] == active[first] + packet.size - 1) {
+                        world.hit_packet(packet, 0, infinity, &recs[active[first]], hits);
+                    } else {
+                        hit_record packet_recs[ray_packet::max_size];
+                        world.hit_packet(packet, 0, infinity, packet_recs, hits);
+
+                        for (int k = 0; k < packet.size; k++)
+                            recs[active[first + k]] = packet_recs[k];
+                    }
+                } else {
+                    packet.size = 1;
+                    rng = streams[active[first]];
+                    hits[0] = world.hit(path_ray(active[first]), 0, infinity, recs[active[first]]);
+                    streams[active[first]] = rng;
+                }
+
+                for (int k = 0; k < packet.size; k++) {
+                    auto path = active[first + k];
+
+                    if (hits[k]) {
+                        active[kept++] = path;
+                        continue;
+                    }
+
+                    for (int a = 0; a < 3; a++)
+                        radiance[a][path] += throughput[a][path] * background[a];
+                }
+
+                first += packet.size;
+            }
+
+            active.resize(kept);
+        }
+
+        // Reorders the active paths so the ones hitting the same material are contiguous,
+        // with a counting sort: scenes use a handful of materials, found by a linear search
+        // from the last one seen
+        void group_by_material() {
+            materials.clear();
+            material_counts.clear();
+            material_of_path.resize(active.size());
+
+            size_t last = 0;
+
+            for (size_t k = 0; k < active.size(); k++) {
+                auto m = recs[active[k]].mat_ptr;
+
+                if (last >= materials.size() or materials[last] != m) {
+                    last = std::find(materials.begin(), materials.end(), m) - materials.begin();
+
+                    if (last == materials.size()) {
+                        materials.push_back(m);
+                        material_counts.push_back(0);
+                    }
+                }
+
+                material_of_path[k] = static_cast<uint32_t>(last);
+                material_counts[last]++;
+            }
+
+            // Counts become the first position of every material
+            uint32_t position = 0;
+            for (auto &count : material_counts) {
+                auto next = position + count;
+                count = position;
+                position = next;
+            }
+
+            sorted.resize(active.size());
+            for (size_t k = 0; k < active.size(); k++)
+                sorted[material_counts[material_of_path[k]]++] = active[k];
+
+            active.swap(sorted);
+        }
+
+        // Shading stage: scatters every path at its hit, grouped by material. Paths that
+        // are absorbed, reach the depth limit or lose the roulette end.
+        void shade() {
+            group_by_material();
+
+            auto &rng = thread_random_stream();
+            size_t kept = 0;
+
+            for (auto path : active) {
+                rng = streams[path];
+
+                ray current = path_ray(path);
+                color path_radiance = result(path);
+                color path_throughput = this->path_throughput(path);
+                auto bounce = bounces[path];
+
+                bool alive = scatter_path(current, recs[path], lights, path_throughput, path_radiance)
+                    and static_cast<int>(bounce) + 1 < max_depth
+                    and (bounce < roulette_bounces or survive_roulette(path_throughput));
+
+                for (int a = 0; a < 3; a++) {
+                    radiance[a][path] = path_radiance[a];
+                    throughput[a][path] = path_throughput[a];
+                }
+
+                streams[path] = rng;
+
+                if (alive) {
+                    set_path_ray(path, current);
+                    bounces[path] = bounce + 1;
+                    active[kept++] = path;
+                }
+            }
+
+            active.resize(kept);
+        }
+};
+
+#endif // WAVEFRONT_H
@@ -0,0 +1,564 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "utility.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "primitives.h"
+
+// Node of a wide_bvh with up to N children. Child bounds are stored as single precision
+// structure-of-arrays, so one node test checks all children with a few SIMD instructions.
+// bounds[0..2] hold the lower x, y, z planes and bounds[3..5] the upper ones.
+template <int N>
+struct alignas(16) wide_bvh_node {
+    float bounds[6][N];
+
+    // Interior children point to a node, leaves to `count` primitives starting at child
+    uint32_t child[N];
+    uint16_t count[N];
+    int child_count;
+};
+
+// Bound on the rounding error of a single precision slab distance, as a fraction of
+// (|origin| + |bound|) / |direction|. Rounding the origin and the reciprocal direction to
+// float and the two operations of the distance add up to about 4 ulps of it.
+const double wide_slab_error = 8.0 / 16777216;
+
+// Per-ray data shared by every node test
+struct wide_ray {
+    float inv_dir[3];
+
+    // origin * inv_dir, moved by the rounding error bound of the slab distances so the
+    // near planes come out closer and the far planes farther than they are
+    float near_origin[3];
+    float far_origin[3];
+
+    // Index into wide_bvh_node::bounds of the near and far plane on each axis
+    int near_plane[3];
+    int far_plane[3];
+
+    // bounds contains every box the ray is tested against. The rounding error of a slab
+    // distance is relative to the magnitude of the origin and the plane, not to the
+    // distance, so it's bounded with the largest coordinates of bounds.
+    wide_ray(const ray &r, const aabb &bounds) {
+        for (int a = 0; a < 3; a++) {
+            auto inv = 1.0 / r.direction()[a];
+
+            // Keep the reciprocal finite so 0 * inf never turns a slab test into NaN
+            if (fabs(inv) > 1e30)
+                inv = std::copysign(1e30, inv);
+
+            auto origin = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(inv);
+
+            auto extent = std::max(fabs(bounds.min()[a]), fabs(bounds.max()[a]));
+            auto error = wide_slab_error * (fabs(r.origin()[a]) + extent) * fabs(inv);
+            auto scaled_origin = static_cast<double>(origin) * inv_dir[a];
+
+            near_plane[a] = (inv < 0) ? a + 3 : a;
+            far_plane[a] = (inv < 0) ? a : a + 3;
+            near_origin[a] = static_cast<float>(scaled_origin + error);
+            far_origin[a] = static_cast<float>(scaled_origin - error);
+        }
+    }
+
+    // The t interval of a ray in single precision, widened past the rounding
+    static float lower_t(real t) {
+        return static_cast<float>(t - fabs(t) * 1e-6);
+    }
+
+    static float upper_t(real t) {
+        return static_cast<float>(t + fabs(t) * 1e-6);
+    }
+};
+
+// Tests the ray against every child box of the node. Returns a bit mask of the children
+// that are hit and stores their entry distances in t_near. A distance is bound * inv_dir
+// minus the scaled origin of wide_ray, so no box the ray touches is culled by rounding.
+template <int N>
+inline int wide_box_test(
+    const wide_bvh_node<N> &node, const wide_ray &r, float t_min, float t_max, float *t_near
+) {
+    int mask = 0;
+
+    for (int i = 0; i < N; i++) {
+        auto t0 = t_min, t1 = t_max;
+
+        for (int a = 0; a < 3; a++) {
+            auto near = node.bounds[r.near_plane[a]][i] * r.inv_dir[a] - r.near_origin[a];
+            auto far = node.bounds[r.far_plane[a]][i] * r.inv_dir[a] - r.far_origin[a];
+
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+
+        t_near[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+
+    return mask;
+}
+
+#if defined(__SSE2__)
+template <>
+inline int wide_box_test<4>(
+    const wide_bvh_node<4> &node, const wide_ray &r, float t_min, float t_max, float *t_near
+) {
+    auto t0 = _mm_set1_ps(t_min);
+    auto t1 = _mm_set1_ps(t_max);
+
+    for (int a = 0; a < 3; a++) {
+        auto inv_dir = _mm_set1_ps(r.inv_dir[a]);
+
+        auto near = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.bounds[r.near_plane[a]]), inv_dir), _mm_set1_ps(r.near_origin[a]));
+        auto far = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.bounds[r.far_plane[a]]), inv_dir), _mm_set1_ps(r.far_origin[a]));
+
+        t0 = _mm_max_ps(near, t0);
+        t1 = _mm_min_ps(far, t1);
+    }
+
+    _mm_storeu_ps(t_near, t0);
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX2__)
+template <>
+inline int wide_box_test<8>(
+    const wide_bvh_node<8> &node, const wide_ray &r, float t_min, float t_max, float *t_near
+) {
+    auto t0 = _mm256_set1_ps(t_min);
+    auto t1 = _mm256_set1_ps(t_max);
+
+    for (int a = 0; a < 3; a++) {
+        auto inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+
+        // A single fused multiply-subtract per plane
+        auto near = _mm256_fmsub_ps(_mm256_loadu_ps(node.bounds[r.near_plane[a]]), inv_dir, _mm256_set1_ps(r.near_origin[a]));
+        auto far = _mm256_fmsub_ps(_mm256_loadu_ps(node.bounds[r.far_plane[a]]), inv_dir, _mm256_set1_ps(r.far_origin[a]));
+
+        t0 = _mm256_max_ps(near, t0);
+        t1 = _mm256_min_ps(far, t1);
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Multi-branching hierarchy collapsed from the binary SAH tree. Each node holds up to N
+// children, so a ray visits roughly log_N instead of log_2 levels.
+template <int N>
+class wide_bvh : public hittable {
+    public:
+        std::vector<wide_bvh_node<N>> nodes;
+        std::vector<shared_ptr<hittable>> primitives;
+        aabb box;
+
+        // SAH cost right after the build, the reference for refit degradation
+        real build_sah_cost = 0;
+
+    public:
+        wide_bvh() {}
+
+        wide_bvh(
+            const hittable_list &list, real time0, real time1,
+            bvh_quality quality = bvh_quality::medium, int max_leaf_size = 4,
+            bvh_build_stats *stats = nullptr
+        ) {
+            if (list.objects.empty())
+                return;
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            auto entries = make_build_entries(list.objects, 0, list.objects.size(), time0, time1);
+
+            std::vector<bvh_build_node> build_nodes;
+            auto root = linear_bvh::build(entries, quality, max_leaf_size, build_nodes);
+
+            primitives.resize(entries.size());
+            for (size_t i = 0; i < entries.size(); i++)
+                primitives[i] = list.objects[entries[i].index];
+
+            box = build_nodes[root].box;
+
+            // A single leaf still needs a root node to hang from
+            if (build_nodes[root].count > 0) {
+                nodes.resize(1);
+                init_node(nodes[0]);
+                set_child(nodes[0], 0, build_nodes[root], 0);
+                nodes[0].child_count = 1;
+            } else {
+                collapse(build_nodes, root);
+            }
+
+            build_sah_cost = sah_cost();
+
+            if (stats) {
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                stats->build_time_ms =
+                    std::chrono::duration<double, std::milli>(build_end - build_start).count();
+                stats->node_count = nodes.size();
+                stats->primitive_count = primitives.size();
+            }
+        }
+
+        virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override {
+            if (nodes.empty())
+                return false;
+
+            return traverse(r, t_min, t_max, rec, 0);
+        }
+
+        // Traverses the hierarchy with the whole packet. Every child box is first tested
+        // against the packet frustum and then against all rays at once, and subtrees that
+        // only a few rays still reach are finished on the single ray path.
+        virtual void hit_packet(
+            const ray_packet &packet, real t_min, real t_max, hit_record *recs, bool *hits
+        ) const override {
+            for (int i = 0; i < packet.size; i++)
+                hits[i] = false;
+
+            if (nodes.empty())
+                return;
+
+            packet_rays rays(packet, t_max);
+
+            struct stack_entry {
+                uint32_t node;
+                double t_near;
+            };
+
+            stack_entry stack[64 * N];
+            int stack_size = 0;
+            stack[stack_size++] = {0, t_min};
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+                auto packet_t_max = rays.max_closest();
+
+                if (entry.t_near > packet_t_max)
+                    continue;
+
+                const auto &node = nodes[entry.node];
+                int first = stack_size;
+
+                for (int c = 0; c < node.child_count; c++) {
+                    double lower[3], upper[3];
+                    for (int a = 0; a < 3; a++) {
+                        lower[a] = node.bounds[a][c];
+                        upper[a] = node.bounds[a + 3][c];
+                    }
+
+                    if (rays.frustum_misses(lower, upper, t_min, packet_t_max))
+                        continue;
+
+                    double t_near;
+                    uint32_t mask = rays.box_test(lower, upper, t_min, t_near);
+
+                    if (!mask)
+                        continue;
+
+                    if (node.count[c] > 0) {
+                        for (; mask; mask &= mask - 1) {
+                            int i = lowest_ray(mask);
+
+                            for (uint32_t p = node.child[c]; p < node.child[c] + node.count[c]; p++) {
+                                if (primitive_hit(*primitives[p], packet.rays[i], t_min, rays.closest[i], recs[i])) {
+                                    hits[i] = true;
+                                    rays.closest[i] = recs[i].t;
+                                }
+                            }
+                        }
+                    } else if (packet_diverged(mask, rays.size)) {
+                        for (; mask; mask &= mask - 1) {
+                            int i = lowest_ray(mask);
+
+                            if (traverse(packet.rays[i], t_min, rays.closest[i], recs[i], node.child[c])) {
+                                hits[i] = true;
+                                rays.closest[i] = recs[i].t;
+                            }
+                        }
+                    } else {
+                        // Farthest first, so the nearest child is popped next
+                        stack_entry child = {node.child[c], t_near};
+
+                        int j = stack_size++;
+                        while (j > first and stack[j - 1].t_near < child.t_near) {
+                            stack[j] = stack[j - 1];
+                            j--;
+                        }
+                        stack[j] = child;
+                    }
+                }
+            }
+        }
+
+        virtual bool bounding_box(real time0, real time1, aabb &output_box) const override {
+            if (nodes.empty())
+                return false;
+
+            output_box = box;
+
+            return true;
+        }
+
+        // Expected cost of tracing a ray relative to one primitive intersection
+        real sah_cost() const {
+            if (nodes.empty())
+                return 0;
+
+            auto cost = bvh_traversal_cost * box.surface_area();
+
+            for (const auto &node : nodes) {
+                for (int i = 0; i < node.child_count; i++) {
+                    auto weight = (node.count[i] > 0) ? node.count[i] : bvh_traversal_cost;
+                    cost += weight * child_box(node, i).surface_area();
+                }
+            }
+
+            return cost / box.surface_area();
+        }
+
+        // Recomputes every child box bottom-up from the current primitive bounding boxes,
+        // keeping the topology. Returns the SAH cost relative to the build, so callers
+        // can decide when a rebuild is worth it.
+        real refit(real time0, real time1) {
+            if (nodes.empty())
+                return 1.0;
+
+            #pragma omp parallel
+            #pragma omp single
+            box = refit_node(0, time0, time1, 0);
+
+            return sah_cost() / build_sah_cost;
+        }
+
+    protected:
+        // Subtrees this close to the root are refit in their own OpenMP task
+        static const int refit_task_depth = 3;
+
+        aabb refit_node(uint32_t index, real time0, real time1, int depth) {
+            auto &node = nodes[index];
+            aabb boxes[N];
+
+            for (int i = 0; i < node.child_count; i++) {
+                if (node.count[i] > 0) {
+                    aabb primitive_box;
+                    boxes[i] = empty_box();
+
+                    for (uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                        if (primitives[p]->bounding_box(time0, time1, primitive_box))
+                            boxes[i] = surrounding_box(boxes[i], primitive_box);
+                    }
+                } else {
+                    #pragma omp task default(shared) firstprivate(i) if (depth < refit_task_depth)
+                    boxes[i] = refit_node(node.child[i], time0, time1, depth + 1);
+                }
+            }
+
+            #pragma omp taskwait
+
+            aabb node_box = empty_box();
+            for (int i = 0; i < node.child_count; i++) {
+                set_bounds(node, i, boxes[i]);
+                node_box = surrounding_box(node_box, boxes[i]);
+            }
+
+            return node_box;
+        }
+
+        // Single ray traversal of the subtree below node root
+        bool traverse(const ray &r, real t_min, real t_max, hit_record &rec, uint32_t root) const {
+            wide_ray wr(r, box);
+
+            struct stack_entry {
+                uint32_t node;
+                float t_near;
+            };
+
+            stack_entry stack[64 * N];
+            int stack_size = 0;
+            stack[stack_size++] = {root, static_cast<float>(t_min)};
+
+            bool hit_anything = false;
+            auto closest_so_far = t_max;
+
+            // Together with the error bound of wide_ray, rounding can't cull a box the
+            // primitive test would hit
+            const float t_min_f = wide_ray::lower_t(t_min);
+            auto t_max_f = wide_ray::upper_t(closest_so_far);
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+
+                if (entry.t_near > t_max_f)
+                    continue;
+
+                const auto &node = nodes[entry.node];
+
+                alignas(32) float t_near[N];
+                int mask = wide_box_test<N>(node, wr, t_min_f, t_max_f, t_near);
+                mask &= (1 << node.child_count) - 1;
+
+                // Hit children are pushed farthest first, so the nearest one is popped next
+                int first = stack_size;
+
+                while (mask) {
+                    int i = lowest_bit(mask);
+                    mask &= mask - 1;
+
+                    if (node.count[i] > 0) {
+                        for (uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                            if (primitive_hit(*primitives[p], r, t_min, closest_so_far, rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                                t_max_f = wide_ray::upper_t(closest_so_far);
+                            }
+                        }
+                    } else {
+                        stack_entry child = {node.child[i], t_near[i]};
+
+                        int j = stack_size++;
+                        while (j > first and stack[j - 1].t_near < child.t_near) {
+                            stack[j] = stack[j - 1];
+                            j--;
+                        }
+                        stack[j] = child;
+                    }
+                }
+            }
+
+            return hit_anything;
+        }
+
+    public:
+        // Node helpers, also used by the primitives that store their own wide hierarchy
+        static aabb child_box(const wide_bvh_node<N> &node, int i) {
+            return aabb(
+                point3(node.bounds[0][i], node.bounds[1][i], node.bounds[2][i]),
+                point3(node.bounds[3][i], node.bounds[4][i], node.bounds[5][i])
+            );
+        }
+
+        static int lowest_bit(int mask) {
+            #if defined(__GNUC__)
+            return __builtin_ctz(static_cast<unsigned>(mask));
+            #else
+            int i = 0;
+            while (!(mask & (1 << i)))
+                i++;
+            return i;
+            #endif
+        }
+
+        static void init_node(wide_bvh_node<N> &node) {
+            for (int i = 0; i < N; i++) {
+                for (int a = 0; a < 3; a++) {
+                    node.bounds[a][i] = std::numeric_limits<float>::infinity();
+                    node.bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+                }
+
+                node.child[i] = 0;
+                node.count[i] = 0;
+            }
+
+            node.child_count = 0;
+        }
+
+        // Rounds the box outwards, so the float box always contains it
+        static void set_bounds(wide_bvh_node<N> &node, int i, const aabb &child_box) {
+            for (int a = 0; a < 3; a++) {
+                auto lower = static_cast<float>(child_box.min()[a]);
+                auto upper = static_cast<float>(child_box.max()[a]);
+
+                if (lower > child_box.min()[a])
+                    lower = std::nextafter(lower, -std::numeric_limits<float>::infinity());
+                if (upper < child_box.max()[a])
+                    upper = std::nextafter(upper, std::numeric_limits<float>::infinity());
+
+                node.bounds[a][i] = lower;
+                node.bounds[a + 3][i] = upper;
+            }
+        }
+
+        static void set_child(
+            wide_bvh_node<N> &node, int i, const bvh_build_node &child, uint32_t index
+        ) {
+            set_bounds(node, i, child.box);
+
+            node.child[i] = (child.count > 0) ? child.first : index;
+            node.count[i] = static_cast<uint16_t>(child.count);
+        }
+
+    protected:
+        // Emits the wide node for the binary interior node build_nodes[index] and all of
+        // its descendants, returning the index of the emitted node
+        uint32_t collapse(const std::vector<bvh_build_node> &build_nodes, uint32_t index) {
+            auto offset = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+
+            // Open the interior child with the largest surface area until the node is full
+            uint32_t children[N];
+            int child_count = 2;
+            children[0] = build_nodes[index].child[0];
+            children[1] = build_nodes[index].child[1];
+
+            while (child_count < N) {
+                int best = -1;
+                real best_area = -1;
+
+                for (int i = 0; i < child_count; i++) {
+                    const auto &child = build_nodes[children[i]];
+                    auto area = child.box.surface_area();
+
+                    if (child.count == 0 and area > best_area) {
+                        best = i;
+                        best_area = area;
+                    }
+                }
+
+                if (best < 0)
+                    break;
+
+                auto opened = children[best];
+                children[best] = build_nodes[opened].child[0];
+                children[child_count++] = build_nodes[opened].child[1];
+            }
+
+            init_node(nodes[offset]);
+            nodes[offset].child_count = child_count;
+
+            for (int i = 0; i < child_count; i++) {
+                const auto &child = build_nodes[children[i]];
+                uint32_t child_index = 0;
+
+                if (child.count == 0)
+                    child_index = collapse(build_nodes, children[i]);
+
+                // nodes may have been reallocated by the recursion
+                set_child(nodes[offset], i, child, child_index);
+            }
+
+            return offset;
+        }
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+#endif // WIDE_BVH_H
@@ -13,6 +13,7 @@
 #include "../include/box.h"
 #include "../include/bvh.h"
 #include "../include/pdf.h"
+#include "../include/accumulation_buffer.h"
 
 color ray_color(const ray &r, const color &background, const hittable &world, const shared_ptr<hittable>& lights, int depth) {
     hit_record rec;
@@ -22,12 +23,12 @@ color ray_color(const ray &r, const color &background, const hittable &world, co
         return color(0.0, 0.0, 0.0);
 
     // If the ray hits nothing, return the background color
-    if (!world.hit(r, 0.001, infinity, rec)) 
+    if (!world.hit(r, 0, infinity, rec)) 
         return background;
 
     scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-    if (!rec.mat_ptr->scatter(r, rec, srec))
+    color emitted = material_emitted(*rec.mat_ptr, r, rec, rec.u, rec.v, rec.p);
+    if (!material_scatter(*rec.mat_ptr, r, rec, srec))
         return emitted;
 
     if (srec.is_specular) {
@@ -35,14 +36,13 @@ color ray_color(const ray &r, const color &background, const hittable &world, co
             * ray_color(srec.specular_ray, background, world, lights, depth - 1);
     }
 
-    auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-    mixture_pdf p(light_ptr, srec.pdf_ptr);
+    mixture_pdf p(hittable_pdf(*lights, rec.p), srec.direction_pdf);
 
-    ray scattered = ray(rec.p, p.generate(), r.time());
+    ray scattered = rec.spawn_ray(p.generate(), r.time());
     auto pdf_val = p.value(scattered.direction());
 
     return emitted + srec.attenuation 
-        * rec.mat_ptr->scattering_pdf(r, rec, scattered)
+        * material_scattering_pdf(*rec.mat_ptr, r, rec, scattered)
         * ray_color(scattered, background, world, lights, depth - 1) / pdf_val;
 }
 
@@ -90,6 +90,21 @@ int main(int argc, char* argv[]) {
     int samples_per_pixel = 200;
     int max_depth = 50;
 
+    // The image is refined in passes adding pass_samples to every pixel that still needs
+    // them. Every pixel takes samples_per_pixel samples, unless "-a threshold" enables
+    // adaptive sampling: then a pixel stops once it has min_samples_per_pixel and the error
+    // of every pixel around it is below the threshold.
+    int min_samples_per_pixel = 32;
+    int pass_samples = 16;
+    double adaptive_threshold = 0.0;
+
+    if (argc == 3 and std::string(argv[1]) == "-a") {
+        adaptive_threshold = atof(argv[2]);
+    } else if (argc != 1) {
+        std::cerr << "Usage: " << argv[0] << " [-a threshold]\n";
+        exit(-1);
+    }
+
     // World
     hittable_list world = cornell_box();
     auto lights = make_shared<hittable_list>();
@@ -114,42 +129,76 @@ int main(int argc, char* argv[]) {
         aperture, dist_to_focus,
         0.0, 1.0
     );
+    cam.set_image_height(im_height);
 
     // Render
-    std::cout << "P3\n" << im_width << " " << im_height << "\n255\n";
+    accumulation_buffer accumulated(im_width, im_height);
+    std::vector<uint8_t> active;
 
-    std::cerr.precision(3);
-    for (int j = im_height - 1; j >= 0; j--) {
-        
+    auto min_samples = static_cast<uint32_t>(adaptive_threshold > 0 ? min_samples_per_pixel : samples_per_pixel);
+    size_t active_count;
+    int pass = 0;
+
+    while ((active_count = accumulated.update_active(min_samples, samples_per_pixel, adaptive_threshold, active)) > 0) {
         auto start = std::chrono::high_resolution_clock::now();
-    
-        for (int i = 0; i < im_width; i++) {
-            
-            color pixel_color(0, 0, 0);
 
-            for (int s = 0; s < samples_per_pixel; s++) {
-                auto u = double(i + random_double()) / (im_width - 1);
-                auto v = double(j + random_double()) / (im_height - 1);
-                
-                ray r = cam.get_ray(u, v);
+        for (int j = 0; j < im_height; j++) {
+            for (int i = 0; i < im_width; i++) {
+                auto pixel = static_cast<size_t>(j) * im_width + i;
 
-                pixel_color += ray_color(r, background, world, lights, max_depth);
-            }
+                if (!active[pixel])
+                    continue;
+
+                color pixel_color = accumulated.sum(pixel);
+                double square_sum = accumulated.squares[pixel];
+                int s = accumulated.samples[pixel];
+
+                for (int end_sample = std::min(s + pass_samples, samples_per_pixel); s < end_sample; s++) {
+                    auto u = double(i + random_double()) / (im_width - 1);
+                    auto v = double(j + random_double()) / (im_height - 1);
+                    
+                    ray r = cam.get_ray(u, v);
+
+                    auto sample = ray_color(r, background, world, lights, max_depth);
+                    auto l = luminance(sample);
+                    if (l == l)
+                        square_sum += l * l;
+
+                    pixel_color += sample;
+                }
 
-            write_color(std::cout, pixel_color, samples_per_pixel);
+                accumulated.set(pixel, pixel_color, square_sum, s);
+            }
         }
 
         auto end = std::chrono::high_resolution_clock::now();
-    
         auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-        
-        std::cerr << "Scanlines reamaining: " << std::setw(3) << j  
-            << " of " << im_height 
-            << " - " << std::setw(6) <<  static_cast<double>(im_height - j) / im_height * 100 << "%" 
-        << " - ETA: "  << time_remaining(elapsed, j) << '\r';
+        pass++;
+
+        // At most, as adaptive sampling may stop sooner
+        int passes_left = (samples_per_pixel - static_cast<int>(accumulated.min_samples()) + pass_samples - 1) / pass_samples;
+
+        std::cerr << "Pass " << std::setw(3) << pass
+            << ", active pixels: " << std::setw(7) << active_count
+        << " - ETA: "  << time_remaining(elapsed, passes_left) << '\r';
+    }
+
+    // Top row first
+    std::cout << "P3\n" << im_width << " " << im_height << "\n255\n";
+
+    uint64_t total_samples = 0;
+
+    for (int j = im_height - 1; j >= 0; j--) {
+        for (int i = 0; i < im_width; i++) {
+            auto pixel = static_cast<size_t>(j) * im_width + i;
+
+            total_samples += accumulated.samples[pixel];
+            write_color(std::cout, accumulated.sum(pixel), std::max<uint32_t>(accumulated.samples[pixel], 1));
+        }
     }
 
     std::cerr << "\nRendereing Done!\n";
+    std::cerr << "Average samples per pixel: " << static_cast<double>(total_samples) / (im_width * im_height) << '\n';
 
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <omp.h>
@@ -17,6 +20,43 @@
 #include "../include/box.h"
 #include "../include/constant_medium.h"
 #include "../include/bvh.h"
+#include "../include/linear_bvh.h"
+#include "../include/wide_bvh.h"
+#include "../include/instance.h"
+#include "../include/motion_bvh.h"
+#include "../include/triangle_mesh.h"
+#include "../include/mesh_loader.h"
+#include "../include/sphere_set.h"
+#include "../include/render_scheduler.h"
+#include "../include/framebuffer.h"
+#include "../include/accumulation_buffer.h"
+#include "../include/integrator.h"
+#include "../include/wavefront.h"
+#include "../include/distributed.h"
+
+color ray_color(const ray &r, const color &background, const hittable &world, const shared_ptr<hittable>& lights, int depth);
+
+// Light leaving the hit point in rec towards the origin of r
+color shade(const ray &r, const hit_record &rec, const color &background, const hittable &world, const shared_ptr<hittable>& lights, int depth) {
+    scatter_record srec;
+    color emitted = material_emitted(*rec.mat_ptr, r, rec, rec.u, rec.v, rec.p);
+    if (!material_scatter(*rec.mat_ptr, r, rec, srec))
+        return emitted;
+
+    if (srec.is_specular) {
+        return srec.attenuation
+            * ray_color(srec.specular_ray, background, world, lights, depth - 1);
+    }
+
+    mixture_pdf p(hittable_pdf(*lights, rec.p), srec.direction_pdf);
+
+    ray scattered = rec.spawn_ray(p.generate(), r.time());
+    auto pdf_val = p.value(scattered.direction());
+
+    return emitted + srec.attenuation 
+        * material_scattering_pdf(*rec.mat_ptr, r, rec, scattered)
+        * ray_color(scattered, background, world, lights, depth - 1) / pdf_val;
+}
 
 color ray_color(const ray &r, const color &background, const hittable &world, const shared_ptr<hittable>& lights, int depth) {
     hit_record rec;
@@ -26,28 +66,37 @@ color ray_color(const ray &r, const color &background, const hittable &world, co
         return color(0.0, 0.0, 0.0);
 
     // If the ray hits nothing, return the background color
-    if (!world.hit(r, 0.001, infinity, rec)) 
+    if (!world.hit(r, 0, infinity, rec)) 
         return background;
 
-    scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-    if (!rec.mat_ptr->scatter(r, rec, srec))
-        return emitted;
+    return shade(r, rec, background, world, lights, depth);
+}
 
-    if (srec.is_specular) {
-        return srec.attenuation
-            * ray_color(srec.specular_ray, background, world, lights, depth - 1);
-    }
+// Same estimate as shade, computed in a loop that carries the product of the bounce
+// weights (the throughput) instead of recursing. After a few bounces paths are ended at
+// random with Russian roulette, so dim paths stop early instead of running to the depth
+// limit.
+color shade_iterative(const ray &r, const hit_record &first_rec, const color &background, const hittable &world, const shared_ptr<hittable>& lights, int depth) {
+    color radiance(0.0, 0.0, 0.0);
+    color throughput(1.0, 1.0, 1.0);
 
-    auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-    mixture_pdf p(light_ptr, srec.pdf_ptr);
+    ray current = r;
+    hit_record rec = first_rec;
 
-    ray scattered = ray(rec.p, p.generate(), r.time());
-    auto pdf_val = p.value(scattered.direction());
+    for (int bounce = 0; ; bounce++, depth--) {
+        if (!scatter_path(current, rec, lights, throughput, radiance))
+            return radiance;
 
-    return emitted + srec.attenuation 
-        * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-        * ray_color(scattered, background, world, lights, depth - 1) / pdf_val;
+        // The next ray would be past the bounce limit
+        if (depth - 1 <= 0)
+            return radiance;
+
+        if (bounce >= roulette_bounces and !survive_roulette(throughput))
+            return radiance;
+
+        if (!world.hit(current, 0, infinity, rec))
+            return radiance + throughput * background;
+    }
 }
 
 hittable_list random_scene() {
@@ -281,27 +330,199 @@ hittable_list final_scene() {
     auto pertext = make_shared<noise_texture>(0.1);
     objects.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
 
-    hittable_list boxes2;
+    sphere_buffers boxes2;
     auto white = make_shared<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+        boxes2.add(point3::random(0,165), 10, 0);
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
-            vec3(-100,270,395)
-        )
-    );
+    objects.add(make_shared<instance>(
+        make_shared<sphere_set>(boxes2, std::vector<shared_ptr<material>>{white}),
+        transform::translation(vec3(-100,270,395)) * transform::rotation_y(15)
+    ));
+
+    return objects;
+}
+
+hittable_list instanced_scene() {
+    hittable_list objects;
+
+    // Bottom level hierarchies, built once and shared by every instance
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    sphere_buffers cluster;
+    for (int j = 0; j < 1000; j++) {
+        cluster.add(point3::random(0,165), 10, 0);
+    }
+    auto cluster_set = make_shared<sphere_set>(cluster, std::vector<shared_ptr<material>>{white});
+
+    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    auto unit_box = make_shared<box>(point3(0,0,0), point3(1,1,1), ground);
+
+    const int clusters_per_side = 40;
+    const double spacing = 200.0;
+    for (int i = 0; i < clusters_per_side; i++) {
+        for (int j = 0; j < clusters_per_side; j++) {
+            auto x = (i - clusters_per_side / 2) * spacing;
+            auto z = (j - clusters_per_side / 2) * spacing;
+            auto height = random_double(1, 101);
+
+            objects.add(make_shared<instance>(
+                unit_box,
+                transform::translation(vec3(x, 0, z)) * transform::scaling(vec3(spacing, height, spacing))
+            ));
+
+            // Rotate around the cluster center so it stays on its tile
+            objects.add(make_shared<instance>(
+                cluster_set,
+                transform::translation(vec3(x + spacing / 2, height + 10, z + spacing / 2))
+                    * transform::rotation_y(random_double(0, 360))
+                    * transform::translation(vec3(-82.5, 0, -82.5))
+            ));
+        }
+    }
+
+    return objects;
+}
+
+// Empty cornell box with object scaled to fit the box and standing on its floor
+hittable_list cornell_box_with(shared_ptr<hittable> object) {
+    hittable_list objects;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    aabb box;
+    if (!object->bounding_box(0, 1, box))
+        return objects;
+
+    auto extent = box.max() - box.min();
+    auto scale = 350.0 / fmax(extent.x(), fmax(extent.y(), extent.z()));
+    auto center = box.centroid();
+
+    objects.add(make_shared<instance>(object,
+        transform::translation(vec3(278, 0, 278))
+        * transform::rotation_y(-20)
+        * transform::scaling(vec3(scale, scale, scale))
+        * transform::translation(vec3(-center.x(), -box.min().y(), -center.z()))
+    ));
 
     return objects;
 }
 
+// Cornell box with a triangle mesh loaded from an OBJ or binary .rtm file
+hittable_list mesh_scene(const char *file_name) {
+    std::string name(file_name);
+    bool is_binary = name.size() > 4 and name.compare(name.size() - 4, 4, ".rtm") == 0;
+    auto buffers = is_binary ? load_mesh_binary(file_name) : load_obj(file_name);
+
+    if (!buffers)
+        exit(-1);
+
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+
+    bvh_build_stats stats;
+    auto mesh = make_shared<triangle_mesh>(buffers, white, bvh_quality::high, &stats);
+    std::cerr << "Mesh: " << buffers->triangle_count << " triangles, BVH: " << stats << '\n';
+
+    return cornell_box_with(mesh);
+}
+
+// Cornell box with the spheres of a binary .rts particle file. Material indices 0 to 3
+// select white, red, metal and glass.
+hittable_list particle_scene(const char *file_name) {
+    auto spheres = load_spheres_binary(file_name);
+
+    if (!spheres)
+        exit(-1);
+
+    std::vector<shared_ptr<material>> materials = {
+        make_shared<lambertian>(color(.73, .73, .73)),
+        make_shared<lambertian>(color(.65, .05, .05)),
+        make_shared<metal>(color(0.8, 0.85, 0.88), 0.0),
+        make_shared<dielectric>(1.5)
+    };
+
+    bvh_build_stats stats;
+    auto set = make_shared<sphere_set>(*spheres, materials, bvh_quality::medium, &stats);
+
+    if (set->nodes.empty())
+        exit(-1);
+
+    std::cerr << "Particles: " << spheres->size() << " spheres, BVH: " << stats << '\n';
+
+    return cornell_box_with(set);
+}
+
 int main(int argc, char* argv[]) {
 
-    if (argc < 2) {
-        std::cerr << "Missing Arguments!\nUsage: " << argv[0] << " scene_id\n";
+    // Positional arguments, with the options accepted anywhere:
+    //   -o file       output image, the extension picks the format (.png, .pfm or PPM),
+    //                 without it a PPM is written to stdout
+    //   -c file       checkpoint saved periodically, and resumed from when it exists
+    //   -a threshold  adaptive sampling, pixels stop once their error is below threshold
+    //   -m file       image of the number of samples taken by every pixel
+    //   -i name       integrator, "recursive" (default), "iterative" with Russian roulette,
+    //                 or "wavefront", the iterative one traced in batches of paths
+    //   -s port       coordinate a distributed render: workers connecting on port render
+    //                 the tiles, this process only merges them and writes the outputs
+    //   -w host:port  work for the coordinator at host:port, with the same arguments
+    //   -p size       trace the primary rays of a pixel in packets of up to 16 rays. Single
+    //                 rays (1, the default) are faster through the 8-wide hierarchy.
+    std::vector<char *> args;
+    std::string output_file, checkpoint_file, heatmap_file, integrator_name = "recursive";
+    std::string coordinator_address;
+    int coordinator_port = -1;
+    double adaptive_threshold = 0.0;
+    int packet_size = 1;
+
+    for (int a = 0; a < argc; a++) {
+        std::string option(argv[a]);
+
+        if (option == "-o" and a + 1 < argc)
+            output_file = argv[++a];
+        else if (option == "-c" and a + 1 < argc)
+            checkpoint_file = argv[++a];
+        else if (option == "-a" and a + 1 < argc)
+            adaptive_threshold = atof(argv[++a]);
+        else if (option == "-m" and a + 1 < argc)
+            heatmap_file = argv[++a];
+        else if (option == "-i" and a + 1 < argc)
+            integrator_name = argv[++a];
+        else if (option == "-s" and a + 1 < argc)
+            coordinator_port = atoi(argv[++a]);
+        else if (option == "-w" and a + 1 < argc)
+            coordinator_address = argv[++a];
+        else if (option == "-p" and a + 1 < argc)
+            packet_size = std::max(1, std::min(atoi(argv[++a]), static_cast<int>(ray_packet::max_size)));
+        else
+            args.push_back(argv[a]);
+    }
+
+    std::string usage = " [-o output_file] [-c checkpoint_file] [-a threshold] [-m heatmap_file] [-i integrator]"
+        " [-s port | -w host:port] [-p packet_size]\n";
+
+    if (args.size() < 2) {
+        std::cerr << "Missing Arguments!\nUsage: " << argv[0] << " scene_id [mesh_file | sphere_file]" << usage;
+        exit(-1);
+    }
+
+    // Estimates the light of the primary hits
+    auto integrator = shade;
+
+    if (integrator_name == "iterative") {
+        integrator = shade_iterative;
+    } else if (integrator_name != "recursive" and integrator_name != "wavefront") {
+        std::cerr << "Unknown integrator '" << integrator_name << "', use recursive, iterative or wavefront\n";
         exit(-1);
     }
 
@@ -309,8 +530,17 @@ int main(int argc, char* argv[]) {
     auto aspect_ratio = 16.0 / 9.0;
     int im_width  = 400;
     int samples_per_pixel = 100;
+    int min_samples_per_pixel = 16;
     int max_depth = 50;
 
+    // The image is refined in passes adding pass_samples to every pixel that still needs
+    // them, and saved to the checkpoint file after a pass when checkpoint_interval seconds
+    // went by since the last save. A multiple of packet_size keeps the packets of an
+    // uninterrupted render. With adaptive sampling every pixel takes at least
+    // min_samples_per_pixel samples, and samples_per_pixel at most.
+    int pass_samples = 16;
+    double checkpoint_interval = 60.0;
+
     // World
     hittable_list world;
 
@@ -323,13 +553,15 @@ int main(int argc, char* argv[]) {
     auto vfov = 40.0;
     auto aperture = 0.0;
     auto background = color(0.0, 0.0, 0.0);
+    auto motion_blur = false;
 
-    int scene_id = atoi(argv[1]);
+    int scene_id = atoi(args[1]);
     switch (scene_id) {
         case 1:
             std::cerr << "Rendering random spheres scene\n";
             
             world = random_scene();
+            motion_blur = true;
 
             background = color(0.70, 0.80, 1.00);
             lookfrom = point3(13, 2, 3);
@@ -428,6 +660,72 @@ int main(int argc, char* argv[]) {
 
             break;
 
+        case 8:
+            std::cerr << "Rendering instanced sphere clusters\n";
+
+            world = instanced_scene();
+
+            aspect_ratio = 16.0 / 9.0;
+            im_width = 800;
+            samples_per_pixel = 100;
+
+            background = color(0.70, 0.80, 1.00);
+            lookfrom = point3(0, 1500, -4500);
+            lookat = point3(0, 0, 0);
+            vfov = 40.0;
+
+            break;
+
+        case 9:
+            if (args.size() < 3) {
+                std::cerr << "Usage: " << argv[0] << " 9 mesh_file" << usage;
+                exit(-1);
+            }
+
+            std::cerr << "Rendering mesh " << args[2] << " in the cornell box\n";
+
+            world = mesh_scene(args[2]);
+
+            // The glass sphere of the default lights isn't in the mesh scene, so only the
+            // ceiling light is sampled
+            lights = make_shared<hittable_list>();
+            lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+
+            aspect_ratio = 1.0;
+            im_width = 600;
+            samples_per_pixel = 100;
+
+            background = color(0.0, 0.0, 0.0);
+            lookfrom = point3(278, 278, -800);
+            lookat = point3(278, 278, 0);
+            vfov = 40.0;
+
+            break;
+
+        case 10:
+            if (args.size() < 3) {
+                std::cerr << "Usage: " << argv[0] << " 10 sphere_file" << usage;
+                exit(-1);
+            }
+
+            std::cerr << "Rendering particles " << args[2] << " in the cornell box\n";
+
+            world = particle_scene(args[2]);
+
+            lights = make_shared<hittable_list>();
+            lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+
+            aspect_ratio = 1.0;
+            im_width = 600;
+            samples_per_pixel = 100;
+
+            background = color(0.0, 0.0, 0.0);
+            lookfrom = point3(278, 278, -800);
+            lookat = point3(278, 278, 0);
+            vfov = 40.0;
+
+            break;
+
         default:
             std::cerr << "Scene id not found!\n";
             exit(-1);
@@ -436,6 +734,18 @@ int main(int argc, char* argv[]) {
 
     int im_height = static_cast<int>(im_width / aspect_ratio);    
 
+    // Top level hierarchy over the scene objects, scenes with many moving objects use
+    // keyframe bounds so the blurred spheres don't make every node overlap
+    bvh_build_stats build_stats;
+    shared_ptr<hittable> world_bvh;
+
+    if (motion_blur)
+        world_bvh = make_shared<motion_bvh>(world, 0.0, 1.0, 2, 2, bvh_quality::medium, 4, &build_stats);
+    else
+        world_bvh = make_shared<bvh8>(world, 0.0, 1.0, bvh_quality::medium, 4, &build_stats);
+
+    std::cerr << "BVH: " << build_stats << '\n';
+
     // Camera
     vec3 vup(0, 1, 0);
     auto dist_to_focus = 10.0;
@@ -446,52 +756,256 @@ int main(int argc, char* argv[]) {
         aperture, dist_to_focus,
         0.0, 1.0
     );
+    cam.set_image_height(im_height);
 
     // Render
-    std::cout << "P3\n" << im_width << " " << im_height << "\n255\n";
+    // Sums of the samples of every pixel, restored from the checkpoint when resuming
+    accumulation_buffer accumulated(im_width, im_height);
 
-    // Show progress controls
-    auto total_steps = im_height;
-    size_t steps_completed = 0;
+    // The samples also depend on the scene, the path depth and the integrator, a
+    // checkpoint of another render is refused
+    auto settings = random_stream::mix(random_stream::mix(scene_id) ^ max_depth)
+        ^ std::hash<std::string>()((args.size() > 2) ? args[2] : "")
+        ^ std::hash<std::string>()(integrator_name);
 
-    // Stores the rednered image 
-    std::vector<std::vector<std::string>> image(im_height, std::vector<std::string>(im_width));
+    // Workers only render what the coordinator sends them
+    bool worker = !coordinator_address.empty();
 
-    #pragma omp parallel for num_threads(8) 
-    for (int j = im_height - 1; j >= 0; j--) {
-        #pragma omp atomic
-        ++steps_completed;
+    if (!checkpoint_file.empty() and !worker and std::ifstream(checkpoint_file)) {
+        if (!accumulated.load(checkpoint_file, settings))
+            exit(-1);
 
-        #pragma omp critical
-        std::cerr << "Scanlines done: " << std::setw(3) << steps_completed  
-            << " of " << total_steps 
-            << " - " << std::setw(6) << std::setprecision(3) << 100.0 * steps_completed / total_steps << "%" 
-        << '\r';   
-                
-        for (int i = 0; i < im_width; i++) {
-            
-            color pixel_color(0, 0, 0);
+        std::cerr << "Resuming from checkpoint '" << checkpoint_file << "' at "
+            << accumulated.min_samples() << " samples per pixel\n";
+    }
 
-            for (int s = 0; s < samples_per_pixel; s++) {
-                auto u = double(i + random_double()) / (im_width - 1);
-                auto v = double(j + random_double()) / (im_height - 1);
+    render_scheduler scheduler(im_width, im_height);
 
-                
-                ray r = cam.get_ray(u, v);
+    // Pixels sampled by the current pass
+    std::vector<uint8_t> active;
+
+    auto render_tile_pixels = [&](const render_tile &tile) {
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                auto pixel = static_cast<uint64_t>(j) * im_width + i;
+
+                if (!active[pixel])
+                    continue;
+
+                // Continues the sums of the previous passes, in the same order an
+                // uninterrupted render would add the samples
+                color pixel_color = accumulated.sum(pixel);
+                double square_sum = accumulated.squares[pixel];
+                int first_sample = accumulated.samples[pixel];
+                int end_sample = std::min(first_sample + pass_samples, samples_per_pixel);
+
+                // With -p the primary rays of a pixel are traced together as packets, the
+                // bounces are always traced one at a time
+                auto &rng = thread_random_stream();
+
+                for (int s = first_sample; s < end_sample; s += packet_size) {
+                    ray_packet packet;
+                    random_stream streams[ray_packet::max_size];
+
+                    // Each sample draws from its own stream, so its numbers don't depend
+                    // on the packet size or on which thread renders the pixel
+                    for (int k = s; k < end_sample and packet.size < packet_size; k++) {
+                        rng = random_stream(pixel, k);
+
+                        auto u = double(i + random_double()) / (im_width - 1);
+                        auto v = double(j + random_double()) / (im_height - 1);
+
+                        packet.add(cam.get_ray(u, v));
+                        streams[packet.size - 1] = rng;
+                    }
+
+                    hit_record recs[ray_packet::max_size];
+                    bool hits[ray_packet::max_size];
+
+                    // A packet of one would only pay for the packet setup
+                    if (packet.size == 1)
+                        hits[0] = world_bvh->hit(packet.rays[0], 0, infinity, recs[0]);
+                    else
+                        world_bvh->hit_packet(packet, 0, infinity, recs, hits);
+
+                    for (int k = 0; k < packet.size; k++) {
+                        rng = streams[k];
 
-                pixel_color += ray_color(r, background, world, lights, max_depth);
+                        auto sample = hits[k]
+                            ? integrator(packet.rays[k], recs[k], background, *world_bvh, lights, max_depth)
+                            : background;
+
+                        // NaN samples already blacken the pixel, they are left out of the
+                        // error estimate
+                        auto l = luminance(sample);
+                        if (l == l)
+                            square_sum += l * l;
+
+                        pixel_color += sample;
+                    }
+                }
+
+                // Every pixel belongs to a single tile, so no lock is needed
+                accumulated.set(pixel, pixel_color, square_sum, std::max(first_sample, end_sample));
+            }
+        }
+    };
+
+    // One wavefront per thread, its buffers are reused by every tile the thread renders
+    std::vector<std::unique_ptr<wavefront_integrator>> wavefronts;
+    for (int t = 0; t < scheduler.thread_count; t++)
+        wavefronts.emplace_back(new wavefront_integrator(*world_bvh, lights, background, max_depth));
+
+    // Same samples as render_tile_pixels, with the paths of the whole tile traced together
+    auto render_tile_wavefront = [&](const render_tile &tile) {
+        auto &wavefront = *wavefronts[omp_get_thread_num()];
+        wavefront.clear();
+
+        auto &rng = thread_random_stream();
+
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                auto pixel = static_cast<uint64_t>(j) * im_width + i;
+                int first_sample = accumulated.samples[pixel];
+                int end_sample = std::min(first_sample + pass_samples, samples_per_pixel);
+
+                if (!active[pixel])
+                    continue;
+
+                for (int k = first_sample; k < end_sample; k++) {
+                    rng = random_stream(pixel, k);
+
+                    auto u = double(i + random_double()) / (im_width - 1);
+                    auto v = double(j + random_double()) / (im_height - 1);
+
+                    wavefront.add_path(cam.get_ray(u, v), rng);
+                }
             }
+        }
+
+        wavefront.trace();
+
+        // The results are added in the order of the paths, like the samples of a pixel
+        size_t path = 0;
+
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                auto pixel = static_cast<uint64_t>(j) * im_width + i;
+                int first_sample = accumulated.samples[pixel];
+                int end_sample = std::min(first_sample + pass_samples, samples_per_pixel);
+
+                if (!active[pixel])
+                    continue;
+
+                color pixel_color = accumulated.sum(pixel);
+                double square_sum = accumulated.squares[pixel];
+
+                for (int k = first_sample; k < end_sample; k++) {
+                    auto sample = wavefront.result(path++);
+
+                    auto l = luminance(sample);
+                    if (l == l)
+                        square_sum += l * l;
+
+                    pixel_color += sample;
+                }
+
+                accumulated.set(pixel, pixel_color, square_sum, std::max(first_sample, end_sample));
+            }
+        }
+    };
 
-            #pragma omp critical
-            image[im_height - (j + 1)][i] = get_color(pixel_color, samples_per_pixel);
-        }   
+    std::function<void(const render_tile &)> render = render_tile_pixels;
+    if (integrator_name == "wavefront")
+        render = render_tile_wavefront;
+
+    if (worker) {
+        auto colon = coordinator_address.rfind(':');
+
+        if (colon == std::string::npos) {
+            std::cerr << "ERROR: Expected host:port after -w, got '" << coordinator_address << "'.\n";
+            return 1;
+        }
+
+        std::cerr << "Working for " << coordinator_address << " on " << scheduler.thread_count << " threads\n";
+
+        bool served = serve_render(
+            coordinator_address.substr(0, colon), static_cast<uint16_t>(atoi(coordinator_address.c_str() + colon + 1)),
+            settings, scheduler.thread_count, accumulated, active, render
+        );
+
+        return served ? 0 : 1;
     }
 
+    render_coordinator coordinator(im_width, im_height, settings);
+
+    if (coordinator_port >= 0 and !coordinator.listen(static_cast<uint16_t>(coordinator_port)))
+        return 1;
+
+    int pass = 0;
+    size_t active_count = 0;
+
+    // Only the thread that started the render prints the progress
+    auto show_progress = [&](size_t done, size_t total) {
+        std::cerr << "Pass " << std::setw(4) << pass + 1 
+            << ", active pixels: " << std::setw(7) << active_count
+            << ", tiles done: " << std::setw(5) << done
+            << " of " << total 
+            << " - " << std::setw(6) << std::setprecision(3) << 100.0 * done / total << "%" 
+        << '\r';
+    };
+
+    if (coordinator.listening())
+        std::cerr << "Rendering " << scheduler.tiles.size() << " tiles on the workers connecting on port "
+            << coordinator.port << '\n';
+    else
+        std::cerr << "Rendering " << scheduler.tiles.size() << " tiles on "
+            << scheduler.thread_count << " threads\n";
+
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
+    auto min_samples = static_cast<uint32_t>(adaptive_threshold > 0 ? min_samples_per_pixel : samples_per_pixel);
+
+    while ((active_count = accumulated.update_active(min_samples, samples_per_pixel, adaptive_threshold, active)) > 0) {
+        if (coordinator.listening())
+            coordinator.run(scheduler.tiles, accumulated, active, show_progress);
+        else
+            scheduler.run(render, show_progress);
+        pass++;
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (!checkpoint_file.empty() and std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval) {
+            accumulated.save(checkpoint_file, settings);
+            last_checkpoint = now;
+        }
+    }
+
+    if (!checkpoint_file.empty())
+        accumulated.save(checkpoint_file, settings);
+
     std::cerr << "\nRendereing Done!\n";
 
-    for(int row = 0; row < image.size(); row++) 
-        for (int col = 0; col < image[row].size(); col++) 
-            std::cout << image[row][col] << '\n';
+    // Stores the rendered image, top row first
+    framebuffer image(im_width, im_height);
+    accumulated.resolve(image);
+
+    if (!image.write(output_file))
+        return 1;
+
+    if (!heatmap_file.empty()) {
+        uint64_t total_samples = 0;
+        for (auto count : accumulated.samples)
+            total_samples += count;
+
+        std::cerr << "Average samples per pixel: " 
+            << static_cast<double>(total_samples) / accumulated.samples.size() << '\n';
+
+        accumulated.sample_heatmap(image, samples_per_pixel);
+
+        if (!image.write(heatmap_file))
+            return 1;
+    }
 
     std::cerr << "Done!\n";
 
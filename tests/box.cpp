@@ -0,0 +1,141 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/aarect.h"
+#include "../include/box.h"
+#include "../include/rect_set.h"
+#include "../include/material.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+// Traces random rays at object and at a reference holding the same surfaces, and counts
+// the hit records that differ. Half of the rays start inside bounds.
+bool check_hits(const char *name, const hittable &object, const hittable &reference, int ray_count) {
+    aabb bounds;
+    reference.bounding_box(0, 1, bounds);
+    auto center = bounds.centroid();
+    auto radius = (bounds.max() - bounds.min()).length();
+
+    int mismatches = 0, hits = 0;
+    double object_ms = 0, reference_ms = 0;
+
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = (i % 2) ? center + radius * random_unit_vector() : bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+        auto target = bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+        ray r(origin, target - origin, 0);
+
+        hit_record expected, rec;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        bool expected_hit = reference.hit(r, 0.001, infinity, expected);
+        auto middle = std::chrono::high_resolution_clock::now();
+        bool hit = object.hit(r, 0.001, infinity, rec);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        reference_ms += std::chrono::duration<double, std::milli>(middle - start).count();
+        object_ms += std::chrono::duration<double, std::milli>(end - middle).count();
+
+        hits += hit;
+
+        if (hit != expected_hit) {
+            mismatches++;
+        } else if (hit) {
+            bool same = fabs(rec.t - expected.t) <= 1e-9 * expected.t and rec.mat_ptr == expected.mat_ptr
+                and (rec.p - expected.p).length() < 1e-6 * radius
+                and (rec.normal - expected.normal).length() < 1e-6 and rec.front_face == expected.front_face
+                and fabs(rec.u - expected.u) < 1e-6 and fabs(rec.v - expected.v) < 1e-6;
+
+            mismatches += !same;
+        }
+    }
+
+    std::cout << "  rects: " << std::setw(8) << reference_ms << " ms"
+        << ", " << name << ": " << std::setw(8) << object_ms << " ms"
+        << "  hits: " << hits << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0 and hits > 0;
+}
+
+// The six rects the box used to be made of, with the faces on the low side of each axis
+// flipped so their outward normal points away from the box too
+hittable_list box_sides(const point3 &p0, const point3 &p1, shared_ptr<material> m) {
+    hittable_list sides;
+
+    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), m));
+    sides.add(make_shared<flip_face>(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), m)));
+    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), m));
+    sides.add(make_shared<flip_face>(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), m)));
+    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), m));
+    sides.add(make_shared<flip_face>(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), m)));
+
+    return sides;
+}
+
+int main() {
+    bool ok = true;
+
+    std::vector<shared_ptr<material>> materials = {
+        make_shared<lambertian>(color(.65, .05, .05)),
+        make_shared<lambertian>(color(.73, .73, .73)),
+        make_shared<lambertian>(color(.12, .45, .15))
+    };
+
+    std::cout << "Boxes\n";
+
+    // Like the ground of the final scene, and thin ones
+    for (auto extent : {vec3(100, 50, 100), vec3(1, 1, 1), vec3(165, 330, 165), vec3(10, 0.01, 10)}) {
+        auto p0 = vec3::random(-100, 100);
+        auto p1 = p0 + extent;
+
+        ok = check_hits("box", box(p0, p1, materials[0]), box_sides(p0, p1, materials[0]), 20000) and ok;
+    }
+
+    // The walls of the Cornell box, then enough random rects to leave partial groups
+    rect_set walls;
+    hittable_list reference;
+
+    auto add = [&](shared_ptr<hittable> rect) {
+        reference.add(rect);
+
+        if (auto xy = std::dynamic_pointer_cast<xy_rect>(rect))
+            walls.add(*xy);
+        else if (auto xz = std::dynamic_pointer_cast<xz_rect>(rect))
+            walls.add(*xz);
+        else
+            walls.add(*std::dynamic_pointer_cast<yz_rect>(rect));
+    };
+
+    add(make_shared<yz_rect>(0, 555, 0, 555, 555, materials[2]));
+    add(make_shared<yz_rect>(0, 555, 0, 555, 0, materials[0]));
+    add(make_shared<xz_rect>(0, 555, 0, 555, 555, materials[1]));
+    add(make_shared<xz_rect>(0, 555, 0, 555, 0, materials[1]));
+    add(make_shared<xy_rect>(0, 555, 0, 555, 555, materials[1]));
+
+    std::cout << "Cornell box walls\n";
+    ok = check_hits("rect_set", walls, reference, 20000) and ok;
+
+    for (int i = 0; i < 13; i++) {
+        auto a = vec3::random(0, 400);
+        auto b = a + vec3::random(10, 150);
+        auto m = materials[i % 3];
+
+        switch (i % 3) {
+            case 0: add(make_shared<xy_rect>(a.x(), b.x(), a.y(), b.y(), a.z(), m)); break;
+            case 1: add(make_shared<xz_rect>(a.x(), b.x(), a.z(), b.z(), a.y(), m)); break;
+            default: add(make_shared<yz_rect>(a.y(), b.y(), a.z(), b.z(), a.x(), m)); break;
+        }
+    }
+
+    std::cout << "18 rects\n";
+    ok = check_hits("rect_set", walls, reference, 20000) and ok;
+
+    // Nothing to hit in an empty set
+    rect_set empty;
+    aabb empty_bounds;
+    hit_record rec;
+
+    ok = !empty.bounding_box(0, 1, empty_bounds) and !empty.hit(ray(point3(0, 0, 0), vec3(1, 1, 1), 0), 0, infinity, rec) and ok;
+
+    return ok ? 0 : 1;
+}
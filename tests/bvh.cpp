@@ -0,0 +1,519 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/sphere.h"
+#include "../include/box.h"
+#include "../include/bvh.h"
+#include "../include/linear_bvh.h"
+#include "../include/wide_bvh.h"
+#include "../include/lbvh.h"
+#include "../include/instance.h"
+#include "../include/motion_bvh.h"
+#include "../include/moving_sphere.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+// Expected cost of a ray traversing the tree, relative to one primitive intersection
+double sah_cost(const shared_ptr<hittable> &node, double root_area) {
+    auto bvh = std::dynamic_pointer_cast<bvh_node>(node);
+
+    if (!bvh) {
+        aabb box;
+        node->bounding_box(0, 1, box);
+
+        return box.surface_area() / root_area;
+    }
+
+    auto cost = bvh_traversal_cost * bvh->box.surface_area() / root_area;
+    cost += sah_cost(bvh->left, root_area);
+
+    if (bvh->right != bvh->left)
+        cost += sah_cost(bvh->right, root_area);
+
+    return cost;
+}
+
+hittable_list sphere_cluster() {
+    hittable_list spheres;
+
+    for (int j = 0; j < 1000; j++)
+        spheres.add(make_shared<sphere>(point3::random(0, 165), 10, shared_ptr<material>()));
+
+    return spheres;
+}
+
+hittable_list ground_boxes() {
+    hittable_list boxes;
+
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            auto x0 = -1000.0 + i * 100.0;
+            auto z0 = -1000.0 + j * 100.0;
+
+            boxes.add(make_shared<box>(
+                point3(x0, 0, z0),
+                point3(x0 + 100, random_double(1, 101), z0 + 100),
+                shared_ptr<material>()
+            ));
+        }
+    }
+
+    return boxes;
+}
+
+// Traces the rays through a hierarchy and counts the results that differ from the expected ones
+bool trace(
+    const char *name, const hittable &world, const std::vector<ray> &rays,
+    const std::vector<bool> &expected_hit, const std::vector<hit_record> &expected
+) {
+    auto start = std::chrono::high_resolution_clock::now();
+    int mismatches = 0;
+
+    for (size_t i = 0; i < rays.size(); i++) {
+        hit_record rec;
+        bool hit = world.hit(rays[i], 0.001, infinity, rec);
+
+        if (hit != expected_hit[i] or (hit and fabs(expected[i].t - rec.t) > 1e-9))
+            mismatches++;
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration<double, std::milli>(end - start);
+
+    std::cout << "    " << std::setw(12) << std::left << name << std::right
+        << "  trace time: " << std::setw(8) << elapsed.count() << " ms"
+        << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0;
+}
+
+// Traces random rays aimed at the scene, and checks that every hierarchy agrees with
+// the brute force list
+bool check_scene(const char *name, const hittable_list &list) {
+    const char *quality_names[] = {"fast", "medium", "high"};
+    const bvh_quality qualities[] = {bvh_quality::fast, bvh_quality::medium, bvh_quality::high};
+    const int ray_count = 20000;
+
+    aabb bounds;
+    list.bounding_box(0, 1, bounds);
+    auto center = bounds.centroid();
+    auto radius = (bounds.max() - bounds.min()).length();
+
+    std::vector<ray> rays;
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = center + radius * random_unit_vector();
+        auto target = bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+
+        rays.push_back(ray(origin, target - origin, 0));
+    }
+
+    std::vector<hit_record> expected(ray_count);
+    std::vector<bool> expected_hit(ray_count);
+    for (int i = 0; i < ray_count; i++)
+        expected_hit[i] = list.hit(rays[i], 0.001, infinity, expected[i]);
+
+    bool ok = true;
+    std::cout << name << " (" << list.objects.size() << " objects)\n";
+
+    double costs[3];
+
+    for (int q = 0; q < 3; q++) {
+        auto root = make_shared<bvh_node>(list, 0, 1, qualities[q]);
+        auto cost = costs[q] = sah_cost(root, root->box.surface_area());
+
+        std::cout << "  " << std::setw(6) << quality_names[q] << "  SAH cost: " << cost << '\n';
+
+        ok = trace(" bvh_node", *root, rays, expected_hit, expected) and ok;
+        ok = trace(" linear_bvh", linear_bvh(list, 0, 1, qualities[q]), rays, expected_hit, expected) and ok;
+        ok = trace(" bvh4", bvh4(list, 0, 1, qualities[q]), rays, expected_hit, expected) and ok;
+        ok = trace(" bvh8", bvh8(list, 0, 1, qualities[q]), rays, expected_hit, expected) and ok;
+    }
+
+    // The SAH builds have to give cheaper trees than the median split, and evaluating
+    // more candidates can't do noticeably worse
+    ok = costs[1] < costs[0] and costs[2] <= 1.001 * costs[1] and ok;
+
+    const char *lbvh_names[] = {"30 bit", "63 bit", "30 bit + treelets"};
+    const morton_precision precisions[] = {
+        morton_precision::bits_30, morton_precision::bits_63, morton_precision::bits_30
+    };
+
+    std::cout << "  linear_bvh SAH cost: " << linear_bvh(list, 0, 1).sah_cost() << '\n';
+
+    for (int i = 0; i < 3; i++) {
+        lbvh tree(list, 0, 1, precisions[i], (i == 2) ? 2 : 0);
+
+        std::cout << "  lbvh " << lbvh_names[i] << "  SAH cost: " << tree.sah_cost() << '\n';
+        ok = trace(" lbvh", tree, rays, expected_hit, expected) and ok;
+    }
+
+    return ok;
+}
+
+// Fires rays grazing the spheres of a cluster placed scale units from the world origin.
+// The wide hierarchies test their boxes in single precision from a rounded origin, so
+// this is where rounding would cull a box whose sphere the list still hits.
+bool check_grazing(double scale) {
+    const int sphere_count = 200, ray_count = 200000;
+    hittable_list list;
+
+    for (int i = 0; i < sphere_count; i++)
+        list.add(make_shared<sphere>(point3(scale, scale, scale) + vec3::random(0, scale), 10, shared_ptr<material>()));
+
+    std::vector<ray> rays;
+    for (int i = 0; i < ray_count; i++) {
+        const auto &target = static_cast<const sphere &>(*list.objects[random_int(0, sphere_count - 1)]);
+        // Touching the sphere near one of its poles, where the ray also grazes the box
+        vec3 pole;
+        pole[random_int(0, 2)] = random_int(0, 1) ? 1 : -1;
+        auto normal = unit_vector(pole + random_double(0, 1e-3) * random_unit_vector());
+        auto direction = unit_vector(cross(normal, random_unit_vector()));
+        auto touch = target.center + target.radius * normal;
+
+        rays.push_back(ray(touch - random_double(1, scale) * direction, direction, 0));
+    }
+
+    std::vector<hit_record> expected(ray_count);
+    std::vector<bool> expected_hit(ray_count);
+    for (int i = 0; i < ray_count; i++)
+        expected_hit[i] = list.hit(rays[i], 0.001, infinity, expected[i]);
+
+    std::cout << "Grazing rays at scale " << scale << '\n';
+
+    bool ok = trace(" bvh4", bvh4(list, 0, 1), rays, expected_hit, expected);
+    ok = trace(" bvh8", bvh8(list, 0, 1), rays, expected_hit, expected) and ok;
+
+    return ok;
+}
+
+// Moves the spheres of a cluster, refits the hierarchies and checks them against the list
+bool check_refit() {
+    std::vector<shared_ptr<sphere>> spheres;
+    hittable_list list;
+
+    for (int j = 0; j < 1000; j++) {
+        spheres.push_back(make_shared<sphere>(point3::random(0, 165), 10, shared_ptr<material>()));
+        list.add(spheres.back());
+    }
+
+    linear_bvh linear(list, 0, 1);
+    lbvh morton(list, 0, 1);
+    bvh8 wide(list, 0, 1);
+
+    bool ok = true;
+    std::cout << "Refit\n";
+
+    for (int frame = 1; frame <= 3; frame++) {
+        // Scatter a fifth of the spheres inside the same bounds, so the topology gets worse
+        for (size_t i = 0; i < spheres.size(); i += 5)
+            spheres[i]->center = point3::random(0, 165);
+
+        auto linear_degradation = linear.refit(0, 1);
+        auto morton_degradation = morton.refit(0, 1);
+        auto wide_degradation = wide.refit(0, 1);
+
+        std::cout << "  frame " << frame << "  SAH degradation:"
+            << "  linear_bvh " << linear_degradation
+            << "  lbvh " << morton_degradation
+            << "  bvh8 " << wide_degradation << '\n';
+
+        std::vector<ray> rays;
+        std::vector<hit_record> expected(5000);
+        std::vector<bool> expected_hit(5000);
+
+        for (int i = 0; i < 5000; i++) {
+            auto origin = point3(82, 82, 82) + 400 * random_unit_vector();
+            rays.push_back(ray(origin, vec3::random(0, 165) - origin, 0));
+            expected_hit[i] = list.hit(rays[i], 0.001, infinity, expected[i]);
+        }
+
+        ok = trace(" linear_bvh", linear, rays, expected_hit, expected) and ok;
+        ok = trace(" lbvh", morton, rays, expected_hit, expected) and ok;
+        ok = trace(" bvh8", wide, rays, expected_hit, expected) and ok;
+    }
+
+    return ok;
+}
+
+// Traces the rays in packets of packet_size and counts the results that differ from the
+// expected ones
+bool trace_packets(
+    const char *name, const hittable &world, const std::vector<ray> &rays, int packet_size,
+    const std::vector<bool> &expected_hit, const std::vector<hit_record> &expected
+) {
+    auto start = std::chrono::high_resolution_clock::now();
+    int mismatches = 0;
+
+    for (size_t first = 0; first < rays.size(); first += packet_size) {
+        ray_packet packet;
+        for (size_t i = first; i < rays.size() and packet.size < packet_size; i++)
+            packet.add(rays[i]);
+
+        hit_record recs[ray_packet::max_size];
+        bool hits[ray_packet::max_size];
+        world.hit_packet(packet, 0.001, infinity, recs, hits);
+
+        for (int i = 0; i < packet.size; i++) {
+            if (hits[i] != expected_hit[first + i]
+                or (hits[i] and fabs(expected[first + i].t - recs[i].t) > 1e-9))
+                mismatches++;
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration<double, std::milli>(end - start);
+
+    std::cout << "    " << std::setw(12) << std::left << name << std::right
+        << "  packet " << std::setw(2) << packet_size
+        << "  trace time: " << std::setw(8) << elapsed.count() << " ms"
+        << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0;
+}
+
+// Traces camera-like coherent packets, and random incoherent ones that diverge at once,
+// through the packet paths and checks them against the brute force list
+bool check_packets(const char *name, const hittable_list &list) {
+    aabb bounds;
+    list.bounding_box(0, 1, bounds);
+    auto center = bounds.centroid();
+    auto radius = (bounds.max() - bounds.min()).length();
+
+    // Pixels of a 200x200 image of the scene, 16 jittered samples per pixel in a row
+    const int width = 200;
+    point3 eye = center + radius * vec3(0.3, 0.5, 1.0);
+    auto forward = unit_vector(center - eye);
+    auto right = unit_vector(cross(forward, vec3(0, 1, 0)));
+    auto up = cross(right, forward);
+
+    std::vector<ray> coherent, incoherent;
+
+    for (int j = 0; j < width; j++) {
+        for (int i = 0; i < width; i++) {
+            for (int s = 0; s < 16; s++) {
+                auto u = (i + random_double()) / width - 0.5;
+                auto v = (j + random_double()) / width - 0.5;
+
+                coherent.push_back(ray(eye, forward + u * right + v * up, 0));
+            }
+        }
+    }
+
+    for (size_t i = 0; i < coherent.size() / 4; i++) {
+        auto origin = center + radius * random_unit_vector();
+        auto target = bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+
+        incoherent.push_back(ray(origin, target - origin, 0));
+    }
+
+    bool ok = true;
+    std::cout << name << " packets\n";
+
+    linear_bvh linear(list, 0, 1);
+    bvh8 wide(list, 0, 1);
+
+    const char *ray_set_names[] = {"coherent", "incoherent"};
+    const std::vector<ray> *ray_sets[] = {&coherent, &incoherent};
+
+    for (int r = 0; r < 2; r++) {
+        const auto &rays = *ray_sets[r];
+        std::vector<hit_record> expected(rays.size());
+        std::vector<bool> expected_hit(rays.size());
+
+        for (size_t i = 0; i < rays.size(); i++)
+            expected_hit[i] = linear.hit(rays[i], 0.001, infinity, expected[i]);
+
+        std::cout << "  " << ray_set_names[r] << " (" << rays.size() << " rays)\n";
+
+        ok = trace(" linear_bvh", linear, rays, expected_hit, expected) and ok;
+        ok = trace(" bvh8", wide, rays, expected_hit, expected) and ok;
+
+        for (int size = 4; size <= 16; size *= 2) {
+            ok = trace_packets(" linear_bvh", linear, rays, size, expected_hit, expected) and ok;
+            ok = trace_packets(" bvh8", wide, rays, size, expected_hit, expected) and ok;
+        }
+    }
+
+    return ok;
+}
+
+// Traces rays at random shutter times through hierarchies over fast moving spheres, the
+// swept boxes of a linear_bvh overlap a lot while the motion_bvh keyframes do not
+bool check_motion() {
+    hittable_list list;
+
+    for (int j = 0; j < 2000; j++) {
+        auto center = point3::random(0, 165);
+        list.add(make_shared<moving_sphere>(
+            center, center + vec3::random(-40, 40), 0, 1, 3, shared_ptr<material>()
+        ));
+    }
+
+    const int ray_count = 20000;
+    std::vector<ray> rays;
+    std::vector<hit_record> expected(ray_count);
+    std::vector<bool> expected_hit(ray_count);
+
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = point3(82, 82, 82) + 400 * random_unit_vector();
+        rays.push_back(ray(origin, vec3::random(0, 165) - origin, random_double()));
+        expected_hit[i] = list.hit(rays[i], 0.001, infinity, expected[i]);
+    }
+
+    bool ok = true;
+    std::cout << "Motion blur (" << list.objects.size() << " moving spheres)\n";
+
+    ok = trace(" linear_bvh", linear_bvh(list, 0, 1), rays, expected_hit, expected) and ok;
+    ok = trace(" motion 2x1", motion_bvh(list, 0, 1, 2, 1), rays, expected_hit, expected) and ok;
+    ok = trace(" motion 3x1", motion_bvh(list, 0, 1, 3, 1), rays, expected_hit, expected) and ok;
+    ok = trace(" motion 2x4", motion_bvh(list, 0, 1, 2, 4), rays, expected_hit, expected) and ok;
+    ok = trace_packets(" motion 2x4", motion_bvh(list, 0, 1, 2, 4), rays, 16, expected_hit, expected) and ok;
+
+    return ok;
+}
+
+// Number of levels of a flattened hierarchy, the root included
+uint32_t tree_depth(const linear_bvh &tree) {
+    std::vector<uint32_t> depths(tree.nodes.size(), 1);
+    uint32_t depth = 0;
+
+    // Parents precede their children in depth-first order
+    for (size_t i = 0; i < tree.nodes.size(); i++) {
+        depth = std::max(depth, depths[i]);
+
+        if (tree.nodes[i].count == 0)
+            depths[i + 1] = depths[tree.nodes[i].offset] = depths[i] + 1;
+    }
+
+    return depth;
+}
+
+// Spheres growing geometrically along a line, where the SAH peels a sphere off at almost
+// every level: uncapped, it builds a tree 141 levels deep. The hierarchies have to stay
+// within their traversal stacks and still find every hit. The wide hierarchies store
+// their boxes in single precision, which doesn't reach that far. The rays start among
+// the smallest spheres, below the whole chain, and stay small enough that the squared
+// terms of the largest sphere, below 1e304, stay finite whatever the compiler contracts.
+bool check_deep() {
+    hittable_list list;
+
+    for (int i = 0; i < 1000; i++) {
+        auto size = pow(1.41, i);
+        list.add(make_shared<sphere>(point3(size, 0, 0), 0.1 * size, shared_ptr<material>()));
+    }
+
+    std::vector<ray> rays;
+    std::vector<hit_record> expected(20000);
+    std::vector<bool> expected_hit(20000);
+
+    for (int i = 0; i < 20000; i++) {
+        auto x = pow(1.41, random_double(0, 16));
+        auto origin = point3(x, x, x);
+
+        rays.push_back(ray(origin, point3(x * random_double(0.5, 2), 0, 0) - origin, 0));
+        expected_hit[i] = list.hit(rays[i], 0.001, infinity, expected[i]);
+    }
+
+    linear_bvh linear(list, 0, 1, bvh_quality::high);
+    lbvh morton(list, 0, 1, morton_precision::bits_63, 3);
+    motion_bvh motion(list, 0, 1);
+
+    std::cout << "Deep trees\n  depth  linear_bvh " << tree_depth(linear)
+        << "  lbvh with treelets " << tree_depth(morton)
+        << "  motion_bvh " << tree_depth(motion.segments[0]) << '\n';
+
+    bool ok = tree_depth(linear) <= linear_bvh::max_depth and tree_depth(morton) <= linear_bvh::max_depth
+        and tree_depth(motion.segments[0]) <= linear_bvh::max_depth;
+
+    ok = trace(" linear_bvh", linear, rays, expected_hit, expected) and ok;
+    ok = trace(" lbvh", morton, rays, expected_hit, expected) and ok;
+    ok = trace(" motion_bvh", motion, rays, expected_hit, expected) and ok;
+
+    return ok;
+}
+
+// Builds every hierarchy over a large random sphere field and reports the build statistics
+bool check_large_build(int sphere_count) {
+    hittable_list spheres;
+
+    for (int i = 0; i < sphere_count; i++)
+        spheres.add(make_shared<sphere>(point3::random(-1000, 1000), 1, shared_ptr<material>()));
+
+    bvh_build_stats node_stats, linear_stats, wide_stats, morton_stats, treelet_stats;
+    bvh_node node(spheres, 0, 1, bvh_quality::medium, &node_stats);
+    linear_bvh linear(spheres, 0, 1, bvh_quality::medium, 4, &linear_stats);
+    bvh8 wide(spheres, 0, 1, bvh_quality::medium, 4, &wide_stats);
+    lbvh morton(spheres, 0, 1, morton_precision::bits_30, 0, &morton_stats);
+    lbvh treelet(spheres, 0, 1, morton_precision::bits_30, 1, &treelet_stats);
+
+    std::cout << "Large build\n"
+        << "  bvh_node:        " << node_stats << '\n'
+        << "  linear_bvh:      " << linear_stats << '\n'
+        << "  bvh8:            " << wide_stats << '\n'
+        << "  lbvh:            " << morton_stats << '\n'
+        << "  lbvh + treelets: " << treelet_stats << '\n';
+
+    // Every interior bvh_node has two children, and each leaf holds one sphere
+    return node_stats.node_count == static_cast<size_t>(sphere_count - 1)
+        and linear_stats.primitive_count == static_cast<size_t>(sphere_count)
+        and wide_stats.primitive_count == static_cast<size_t>(sphere_count);
+}
+
+// An instance of a shared hierarchy must hit exactly like the same list wrapped in the
+// rotate_y and translate hittables
+bool check_instances() {
+    auto cluster = make_shared<hittable_list>(sphere_cluster());
+    auto shared_bvh = make_shared<bvh8>(*cluster, 0, 1);
+
+    auto wrapped = make_shared<translate>(make_shared<rotate_y>(cluster, 15), vec3(-100, 270, 395));
+    instance inst(shared_bvh, transform::translation(vec3(-100, 270, 395)) * transform::rotation_y(15));
+
+    int mismatches = 0;
+    for (int i = 0; i < 20000; i++) {
+        auto origin = point3(0, 300, 400) + 600 * random_unit_vector();
+        auto target = point3(-100, 270, 395) + vec3::random(0, 165);
+        ray r(origin, target - origin, 0);
+
+        hit_record expected, rec;
+        bool hit_wrapped = wrapped->hit(r, 0.001, infinity, expected);
+        bool hit_instance = inst.hit(r, 0.001, infinity, rec);
+
+        if (hit_wrapped != hit_instance)
+            mismatches++;
+        else if (hit_wrapped and (fabs(expected.t - rec.t) > 1e-9 or (expected.p - rec.p).length() > 1e-6
+                                  or (expected.normal - rec.normal).length() > 1e-6))
+            mismatches++;
+    }
+
+    // The box of an instance of a moving object covers the interval it is asked for
+    auto shift = transform::translation(vec3(10, 0, 0));
+    instance moving(make_shared<moving_sphere>(point3(0, 0, 0), point3(100, 0, 0), 0, 1, 1, shared_ptr<material>()), shift);
+    aabb start_box, whole_box;
+    moving.bounding_box(0, 0, start_box);
+    moving.bounding_box(0, 1, whole_box);
+
+    std::cout << "Instances  mismatches: " << mismatches << ", moving box at time 0: "
+        << start_box.min().x() << " to " << start_box.max().x() << ", over [0, 1]: "
+        << whole_box.min().x() << " to " << whole_box.max().x() << '\n';
+
+    return mismatches == 0
+        and start_box.min().x() == 9 and start_box.max().x() == 11
+        and whole_box.min().x() == 9 and whole_box.max().x() == 111;
+}
+
+int main() {
+    bool ok = check_scene("Sphere cluster", sphere_cluster());
+    ok = check_scene("Ground boxes", ground_boxes()) and ok;
+    ok = check_instances() and ok;
+    ok = check_grazing(500) and ok;
+    ok = check_grazing(5000) and ok;
+    ok = check_packets("Sphere cluster", sphere_cluster()) and ok;
+    ok = check_packets("Ground boxes", ground_boxes()) and ok;
+    ok = check_refit() and ok;
+    ok = check_motion() and ok;
+    ok = check_deep() and ok;
+    ok = check_large_build(200000) and ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#include "../include/utility.h"
+#include "../include/camera.h"
+#include "../include/hittable_list.h"
+#include "../include/sphere.h"
+#include "../include/aarect.h"
+#include "../include/box.h"
+#include "../include/bvh.h"
+#include "../include/material.h"
+#include "../include/integrator.h"
+#include "../include/render_scheduler.h"
+#include "../include/accumulation_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Numbers drawn from the stream of every (pixel, sample) pair, count of each, drawn
+// one stream after the other or round robin across the streams in a shuffled order
+std::vector<double> draw_streams(int pixels, int samples, int count, bool interleaved) {
+    std::vector<random_stream> streams;
+    std::vector<double> numbers(static_cast<size_t>(pixels) * samples * count);
+
+    for (int p = 0; p < pixels; p++)
+        for (int k = 0; k < samples; k++)
+            streams.push_back(random_stream(p, k));
+
+    if (!interleaved) {
+        for (size_t s = 0; s < streams.size(); s++)
+            for (int d = 0; d < count; d++)
+                numbers[s * count + d] = streams[s].next();
+
+        return numbers;
+    }
+
+    std::vector<size_t> order(streams.size());
+    for (size_t s = 0; s < order.size(); s++)
+        order[s] = (s * 7919) % order.size();
+
+    for (int d = 0; d < count; d++)
+        for (auto s : order)
+            numbers[s * count + d] = streams[s].next();
+
+    return numbers;
+}
+
+// Sequences are fixed by (pixel, sample) alone, whatever was drawn from other streams
+// before, and the streams of different pairs don't repeat each other
+bool check_streams() {
+    auto first = draw_streams(64, 16, 32, false);
+    auto again = draw_streams(64, 16, 32, false);
+    auto interleaved = draw_streams(64, 16, 32, true);
+
+    // random_double() on a thread stream set to a pair continues like the pair's stream
+    auto &rng = thread_random_stream();
+    int thread_mismatches = 0;
+
+    for (int p = 63; p >= 0; p--) {
+        for (int k = 15; k >= 0; k--) {
+            rng = random_stream(p, k);
+
+            for (int d = 0; d < 32; d++)
+                thread_mismatches += random_double() != first[(static_cast<size_t>(p) * 16 + k) * 32 + d];
+        }
+    }
+
+    std::vector<double> leading;
+    for (size_t s = 0; s < first.size(); s += 32)
+        leading.push_back(first[s]);
+
+    std::sort(leading.begin(), leading.end());
+    auto repeated = std::unique(leading.begin(), leading.end()) - leading.begin() != static_cast<long>(leading.size());
+
+    bool reproducible = first == again;
+    bool order_free = first == interleaved;
+
+    std::cout << "Streams  reproducible: " << reproducible << ", independent of draw order: " << order_free
+        << ", thread stream mismatches: " << thread_mismatches << ", repeated first numbers: " << repeated << '\n';
+
+    return reproducible and order_free and thread_mismatches == 0 and !repeated;
+}
+
+hittable_list test_scene() {
+    hittable_list objects;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    objects.add(make_shared<box>(point3(265, 0, 295), point3(430, 330, 460), make_shared<metal>(color(.8, .85, .88), 0.3)));
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+
+    return objects;
+}
+
+// Renders the scene on thread_count scheduler threads, every sample drawing from the
+// stream of its pixel and index like the render loop of main
+accumulation_buffer render(const hittable &world, const shared_ptr<hittable> &lights, int thread_count) {
+    const int width = 48, height = 48, samples_per_pixel = 8, max_depth = 20;
+
+    camera cam(point3(278, 278, -800), point3(278, 278, 0), vec3(0, 1, 0), 40, 1, 0, 10);
+    cam.set_image_height(height);
+
+    accumulation_buffer accumulated(width, height);
+    render_scheduler scheduler(width, height, 8, thread_count);
+
+    scheduler.run([&](const render_tile &tile) {
+        auto &rng = thread_random_stream();
+
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                auto pixel = static_cast<uint64_t>(j) * width + i;
+                color pixel_color(0, 0, 0);
+                double square_sum = 0;
+
+                for (int k = 0; k < samples_per_pixel; k++) {
+                    rng = random_stream(pixel, k);
+
+                    auto u = double(i + random_double()) / (width - 1);
+                    auto v = double(j + random_double()) / (height - 1);
+
+                    ray current = cam.get_ray(u, v);
+                    color throughput(1, 1, 1), radiance(0, 0, 0);
+
+                    for (int depth = 0; depth < max_depth; depth++) {
+                        hit_record rec;
+
+                        if (!world.hit(current, 0, infinity, rec)
+                            or !scatter_path(current, rec, lights, throughput, radiance)
+                            or (depth >= roulette_bounces and !survive_roulette(throughput)))
+                            break;
+                    }
+
+                    auto l = luminance(radiance);
+                    if (l == l)
+                        square_sum += l * l;
+
+                    pixel_color += radiance;
+                }
+
+                accumulated.set(pixel, pixel_color, square_sum, samples_per_pixel);
+            }
+        }
+    });
+
+    return accumulated;
+}
+
+// The image doesn't depend on how many threads render it or which one renders a tile
+bool check_threads() {
+    bvh_node world(test_scene(), 0, 1);
+
+    auto lights = make_shared<hittable_list>();
+    lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    lights->add(make_shared<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));
+
+    auto reference = render(world, lights, 1);
+    bool ok = true;
+
+    for (int threads : {2, 4, 7}) {
+        auto image = render(world, lights, threads);
+
+        bool identical = memcmp(image.sums.data(), reference.sums.data(), image.sums.size() * sizeof(double)) == 0
+            and memcmp(image.squares.data(), reference.squares.data(), image.squares.size() * sizeof(double)) == 0
+            and image.samples == reference.samples;
+
+        std::cout << "Render on " << threads << " threads identical to 1 thread: " << identical << '\n';
+
+        ok = identical and ok;
+    }
+
+    return ok;
+}
+
+int main() {
+    bool ok = check_streams();
+    ok = check_threads() and ok;
+
+    return ok ? 0 : 1;
+}
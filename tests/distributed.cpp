@@ -0,0 +1,171 @@
+#include "../include/distributed.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Fake render: adds 4 samples of value (i, j, 1) to the active pixels of the tile
+void render_fake(const render_tile &tile, accumulation_buffer &buffer, const std::vector<uint8_t> &active) {
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            auto pixel = static_cast<size_t>(j) * buffer.width + i;
+
+            if (active[pixel])
+                buffer.set(pixel, buffer.sum(pixel) + 4 * color(i, j, 1), buffer.squares[pixel] + 1, buffer.samples[pixel] + 4);
+        }
+    }
+}
+
+// Connects like a worker, takes a tile and disconnects, without answering or, when
+// answer_wrong, after answering with the pixels of the whole image under the index of the
+// tile. Sets hello_sent once the coordinator can accept it. Returns the number of tiles it
+// received.
+int lost_worker(uint16_t port, uint64_t settings, int width, int height, bool answer_wrong = false, std::atomic<bool> *hello_sent = nullptr) {
+    int connection = connect_to("127.0.0.1", port);
+
+    worker_hello hello;
+    memcpy(hello.magic, "RTW1", 4);
+    hello.width = width;
+    hello.height = height;
+    hello.threads = 2;
+    hello.settings = settings;
+
+    uint32_t accepted = 0;
+    uint32_t index;
+    render_tile tile;
+    std::vector<pixel_state> states;
+
+    bool greeted = connection >= 0 and send_all(connection, &hello, sizeof(hello));
+
+    if (hello_sent)
+        *hello_sent = true;
+
+    bool taken = greeted
+        and receive_all(connection, &accepted, sizeof(accepted)) and accepted
+        and receive_tile(connection, width, height, index, tile, states);
+
+    if (taken and answer_wrong) {
+        accumulation_buffer garbage(width, height);
+        std::vector<uint8_t> active(static_cast<size_t>(width) * height, 1);
+
+        for (size_t pixel = 0; pixel < active.size(); pixel++)
+            garbage.set(pixel, color(-1, -1, -1), 1000, 1000);
+
+        send_tile(connection, index, render_tile{0, 0, width, height}, garbage, active);
+    }
+
+    if (connection >= 0)
+        close(connection);
+
+    return taken;
+}
+
+// Renders two passes of an image on workers, one of which is refused, one of which
+// disappears with tiles in flight and one of which answers with the wrong bounds, and
+// checks every pixel was merged exactly once per pass
+bool check_distributed(int width, int height, int tile_size, int worker_count) {
+    const uint64_t settings = 42;
+
+    render_scheduler scheduler(width, height, tile_size, 1);
+    render_coordinator coordinator(width, height, settings);
+
+    if (!coordinator.listen(0))
+        return false;
+
+    accumulation_buffer accumulated(width, height);
+    std::vector<uint8_t> active(static_cast<size_t>(width) * height, 1);
+
+    std::atomic<bool> refused(false);
+    std::atomic<int> lost_tiles(0);
+    std::atomic<int> wrong_tiles(0);
+    std::vector<std::thread> workers;
+
+    std::thread launcher([&]() {
+        accumulation_buffer buffer(width, height);
+        std::vector<uint8_t> worker_active;
+
+        refused = !serve_render("127.0.0.1", coordinator.port, settings + 1, 1, buffer, worker_active, [](const render_tile &) {});
+
+        // The lost worker takes the first tiles, the others only connect once it's gone
+        lost_tiles = lost_worker(coordinator.port, settings, width, height);
+
+        for (int w = 0; w < worker_count; w++) {
+            workers.emplace_back([&]() {
+                accumulation_buffer buffer(width, height);
+                std::vector<uint8_t> worker_active;
+
+                serve_render("127.0.0.1", coordinator.port, settings, 2, buffer, worker_active, [&](const render_tile &tile) {
+                    render_fake(tile, buffer, worker_active);
+                });
+            });
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    coordinator.run(scheduler.tiles, accumulated, active);
+
+    // The wrong worker joins for the second pass, where pixels of the right half it
+    // answers for aren't rendered again and would keep its values
+    std::atomic<bool> wrong_connected(false);
+    std::thread wrong_worker([&]() {
+        wrong_tiles = lost_worker(coordinator.port, settings, width, height, true, &wrong_connected);
+    });
+
+    while (!wrong_connected)
+        std::this_thread::yield();
+
+    // Second pass on the left half of the image only
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++)
+            active[static_cast<size_t>(j) * width + i] = i < width / 2;
+    }
+
+    coordinator.run(scheduler.tiles, accumulated, active);
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // Closing the connections lets the workers return
+    auto workers_left = coordinator.workers.size();
+    for (auto &w : coordinator.workers)
+        close(w.socket);
+    coordinator.workers.clear();
+
+    launcher.join();
+    wrong_worker.join();
+    for (auto &w : workers)
+        w.join();
+
+    int wrong = 0;
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto pixel = static_cast<size_t>(j) * width + i;
+            uint32_t passes = (i < width / 2) ? 2 : 1;
+            auto expected = 4.0 * passes * color(i, j, 1);
+
+            wrong += accumulated.samples[pixel] != 4 * passes or accumulated.squares[pixel] != passes
+                or accumulated.sum(pixel)[0] != expected[0] or accumulated.sum(pixel)[1] != expected[1]
+                or accumulated.sum(pixel)[2] != expected[2];
+        }
+    }
+
+    std::cout << width << "x" << height << " tiles of " << tile_size << " on " << worker_count << " workers: "
+        << std::chrono::duration<double, std::milli>(end - start).count() << " ms"
+        << ", workers connected: " << workers_left
+        << ", refused: " << refused << ", tiles taken by the lost worker: " << lost_tiles
+        << ", by the wrong one: " << wrong_tiles
+        << ", pixels wrong: " << wrong << '\n';
+
+    return wrong == 0 and refused and lost_tiles > 0 and wrong_tiles > 0 and workers_left > 0;
+}
+
+int main() {
+    bool ok = check_distributed(200, 150, 16, 1);
+    ok = check_distributed(203, 97, 8, 3) and ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,158 @@
+#include "../include/utility.h"
+#include "../include/color.h"
+#include "../include/framebuffer.h"
+#include "../include/accumulation_buffer.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+// The vectorized quantization has to produce the same bytes as write_color, NaN and
+// values above one included
+bool check_quantize(int width, int height) {
+    framebuffer image(width, height);
+    std::stringstream expected;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            auto c = 2.0 * color::random();
+            if ((x + y) % 7 == 0)
+                c = color(nan(""), c.y(), c.z());
+
+            image.set(x, y, c);
+
+            // write_color is fed the float value, like the framebuffer stores it
+            auto *p = &image.pixels[3 * (y * width + x)];
+            write_color(expected, color(p[0], p[1], p[2]), 1);
+        }
+    }
+
+    auto rgb = image.to_rgb8();
+    int mismatches = 0;
+
+    for (size_t i = 0; i < rgb.size(); i++) {
+        int value;
+        expected >> value;
+        mismatches += (value != rgb[i]);
+    }
+
+    // write_color takes the square root of negative values, the framebuffer clamps them
+    image.set(0, 0, color(-1.0, -infinity, -0.0));
+    rgb = image.to_rgb8();
+    mismatches += (rgb[0] != 0) + (rgb[1] != 0) + (rgb[2] != 0);
+
+    std::cout << "  quantize " << width << "x" << height << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0;
+}
+
+// The header is followed by exactly one byte per component, and PFM keeps the floats
+// bottom row first
+bool check_files() {
+    framebuffer image(5, 3);
+    for (size_t i = 0; i < image.pixels.size(); i++)
+        image.pixels[i] = 0.1f * i;
+
+    bool ok = image.write("framebuffer_test.ppm") and image.write("framebuffer_test.pfm");
+
+    std::ifstream ppm("framebuffer_test.ppm", std::ios::binary);
+    std::string magic;
+    int width, height, max_value;
+    ppm >> magic >> width >> height >> max_value;
+    ppm.get();
+
+    std::vector<char> data((std::istreambuf_iterator<char>(ppm)), std::istreambuf_iterator<char>());
+    ok = ok and magic == "P6" and width == 5 and height == 3 and max_value == 255 and data.size() == 45;
+
+    std::ifstream pfm("framebuffer_test.pfm", std::ios::binary);
+    double scale;
+    pfm >> magic >> width >> height >> scale;
+    pfm.get();
+
+    std::vector<float> floats(image.pixels.size());
+    pfm.read(reinterpret_cast<char *>(floats.data()), floats.size() * sizeof(float));
+    ok = ok and pfm and magic == "PF" and scale < 0
+        and memcmp(&floats[0], &image.pixels[3 * 5 * 2], 3 * 5 * sizeof(float)) == 0;
+
+    std::cout << "  files  " << (ok ? "ok" : "failed") << '\n';
+
+    return ok;
+}
+
+// A checkpoint restores the exact sums and counts, and is refused for other settings or
+// when truncated
+bool check_checkpoint() {
+    accumulation_buffer saved(9, 4);
+    for (size_t p = 0; p < saved.samples.size(); p++)
+        saved.set(p, color::random() * 100, random_double(), static_cast<uint32_t>(p));
+
+    bool ok = saved.save("framebuffer_test.checkpoint", 42);
+
+    accumulation_buffer loaded(9, 4);
+    ok = ok and loaded.load("framebuffer_test.checkpoint", 42)
+        and loaded.sums == saved.sums and loaded.squares == saved.squares
+        and loaded.samples == saved.samples;
+
+    accumulation_buffer other_size(4, 9);
+    ok = ok and !loaded.load("framebuffer_test.checkpoint", 7)
+        and !other_size.load("framebuffer_test.checkpoint", 42)
+        and other_size.min_samples() == 0;
+
+    // Everything but the last sample count
+    FILE *file = fopen("framebuffer_test.checkpoint", "r+b");
+    fseek(file, 0, SEEK_END);
+    auto size = ftell(file);
+    fclose(file);
+    ok = ok and truncate("framebuffer_test.checkpoint", size - 4) == 0
+        and !accumulation_buffer(9, 4).load("framebuffer_test.checkpoint", 42);
+
+    framebuffer image(9, 4);
+    loaded.resolve(image);
+    ok = ok and image.pixels[3 * (3 * 9 + 1)] == static_cast<float>(saved.sums[3]);
+
+    std::cout << "  checkpoint  " << (ok ? "ok" : "failed") << '\n';
+
+    return ok;
+}
+
+// Flat pixels stop at the minimum, a noisy one keeps itself and its neighbours sampled
+bool check_adaptive() {
+    accumulation_buffer buffer(6, 5);
+    for (size_t p = 0; p < buffer.samples.size(); p++)
+        buffer.set(p, color(16, 16, 16) * 0.25, 16 * 0.25 * 0.25, 16);
+
+    // Half the samples at 0 and half at 2
+    auto noisy = static_cast<size_t>(2) * 6 + 3;
+    buffer.set(noisy, color(16, 16, 16), 8 * 4.0, 16);
+
+    std::vector<uint8_t> active;
+    bool ok = buffer.update_active(8, 64, 0.01, active) == 9 
+        and active[noisy] and active[noisy - 6 + 1] and !active[0];
+
+    ok = ok and buffer.update_active(32, 64, 0.01, active) == 30;
+    ok = ok and buffer.update_active(8, 64, 0.0, active) == 30;
+    ok = ok and buffer.update_active(8, 16, 0.0, active) == 0;
+    ok = ok and buffer.error(0) == 0 and buffer.error(noisy) > 0.1;
+
+    std::cout << "  adaptive  " << (ok ? "ok" : "failed") << '\n';
+
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+
+    // Sizes that do and don't fill whole vectors
+    ok = check_quantize(64, 32) and ok;
+    ok = check_quantize(7, 3) and ok;
+    ok = check_files() and ok;
+    ok = check_checkpoint() and ok;
+    ok = check_adaptive() and ok;
+
+    ok = !framebuffer(1, 1).write("missing_directory/image.png") and ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/triangle_mesh.h"
+#include "../include/mesh_loader.h"
+#include "../include/wide_bvh.h"
+#include "../include/instance.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+// Latitude/longitude sphere, every quad written as a polygon so the OBJ loader has to
+// split them into fans
+void write_sphere_obj(const char *file_name, int rings, int segments, bool with_normals) {
+    std::ofstream file(file_name);
+
+    for (int i = 0; i <= rings; i++) {
+        auto theta = pi * i / rings;
+
+        for (int j = 0; j < segments; j++) {
+            auto phi = 2 * pi * j / segments;
+            vec3 n(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+
+            file << "v " << 50 * n.x() << ' ' << 50 * n.y() << ' ' << 50 * n.z() << '\n';
+            if (with_normals)
+                file << "vn " << n.x() << ' ' << n.y() << ' ' << n.z() << '\n';
+        }
+    }
+
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            int a = i * segments + j + 1;
+            int b = i * segments + (j + 1) % segments + 1;
+            int c = a + segments, d = b + segments;
+
+            if (with_normals)
+                file << "f " << a << "//" << a << ' ' << b << "//" << b << ' ' << d << "//" << d << ' ' << c << "//" << c << '\n';
+            else
+                file << "f " << a << ' ' << b << ' ' << d << ' ' << c << '\n';
+        }
+    }
+}
+
+// Random triangles inside a 100 unit cube
+shared_ptr<mesh_buffers> triangle_soup(int triangle_count) {
+    auto buffers = make_shared<mesh_buffers>();
+
+    for (int i = 0; i < triangle_count; i++) {
+        auto center = point3::random(0, 100);
+
+        for (int k = 0; k < 3; k++) {
+            auto p = center + vec3::random(-3, 3);
+            for (int a = 0; a < 3; a++)
+                buffers->position_storage.push_back(static_cast<float>(p[a]));
+
+            buffers->index_storage.push_back(static_cast<uint32_t>(3 * i + k));
+        }
+    }
+
+    buffers->use_storage();
+
+    return buffers;
+}
+
+// Reference Möller–Trumbore test of every triangle of the buffers
+bool brute_force_hit(const mesh_buffers &buffers, const ray &r, double t_min, double t_max, double &t) {
+    bool hit_anything = false;
+    t = t_max;
+
+    for (size_t i = 0; i < buffers.triangle_count; i++) {
+        auto v0 = buffers.position(buffers.indices[3 * i]);
+        auto e1 = buffers.position(buffers.indices[3 * i + 1]) - v0;
+        auto e2 = buffers.position(buffers.indices[3 * i + 2]) - v0;
+
+        auto p = cross(r.direction(), e2);
+        auto det = dot(e1, p);
+        if (det == 0)
+            continue;
+
+        auto s = r.origin() - v0;
+        auto u = dot(s, p) / det;
+        auto q = cross(s, e1);
+        auto v = dot(r.direction(), q) / det;
+        auto hit_t = dot(e2, q) / det;
+
+        if (u >= 0 and v >= 0 and u + v <= 1 and hit_t > t_min and hit_t < t) {
+            hit_anything = true;
+            t = hit_t;
+        }
+    }
+
+    return hit_anything;
+}
+
+// Traces random rays at the mesh and counts the results that differ from the brute force
+// ones. A hit exactly on a shared edge may be found on either triangle, so distances
+// are compared with a small tolerance.
+bool check_mesh(const char *name, const hittable &world, const mesh_buffers &buffers, int ray_count) {
+    aabb bounds;
+    world.bounding_box(0, 1, bounds);
+    auto center = bounds.centroid();
+    auto radius = (bounds.max() - bounds.min()).length();
+
+    int mismatches = 0;
+    double elapsed_ms = 0;
+
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = center + radius * random_unit_vector();
+        auto target = bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+        ray r(origin, target - origin, 0);
+
+        double expected_t;
+        bool expected_hit = brute_force_hit(buffers, r, 0.001, infinity, expected_t);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        hit_record rec;
+        bool hit = world.hit(r, 0.001, infinity, rec);
+        auto end = std::chrono::high_resolution_clock::now();
+        elapsed_ms += std::chrono::duration<double, std::milli>(end - start).count();
+
+        if (hit != expected_hit or (hit and fabs(expected_t - rec.t) > 1e-9 * expected_t))
+            mismatches++;
+    }
+
+    std::cout << "  " << std::setw(22) << std::left << name << std::right
+        << "  trace time: " << std::setw(8) << elapsed_ms << " ms"
+        << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0;
+}
+
+int main() {
+    bool ok = true;
+
+    write_sphere_obj("mesh_test_sphere.obj", 64, 128, true);
+    auto sphere = load_obj("mesh_test_sphere.obj");
+
+    if (!sphere or sphere->triangle_count != 2 * 64 * 128 or !sphere->normals) {
+        std::cout << "OBJ loading failed\n";
+        return 1;
+    }
+
+    bvh_build_stats stats;
+    triangle_mesh sphere_mesh(sphere, shared_ptr<material>(), bvh_quality::medium, &stats);
+
+    std::cout << "Sphere mesh (" << sphere->vertex_count << " vertices), BVH: " << stats << '\n';
+    ok = check_mesh("OBJ", sphere_mesh, *sphere, 20000) and ok;
+
+    // Smooth normals point away from the center on the outside of the sphere
+    hit_record rec;
+    sphere_mesh.hit(ray(point3(0, 0, 200), vec3(0, 0, -1), 0), 0.001, infinity, rec);
+    ok = (rec.front_face and rec.normal.z() > 0.99) and ok;
+
+    // The binary file round trip keeps every buffer
+    save_mesh_binary("mesh_test_sphere.rtm", *sphere);
+    auto mapped = load_mesh_binary("mesh_test_sphere.rtm");
+
+    if (!mapped or mapped->triangle_count != sphere->triangle_count or !mapped->normals) {
+        std::cout << "Binary mesh loading failed\n";
+        return 1;
+    }
+
+    triangle_mesh mapped_mesh(mapped, shared_ptr<material>());
+    ok = check_mesh("binary", mapped_mesh, *mapped, 20000) and ok;
+
+    // Random triangles, placed in a top-level hierarchy through an instance
+    write_sphere_obj("mesh_test_flat.obj", 8, 16, false);
+    auto flat = load_obj("mesh_test_flat.obj");
+    ok = (flat and !flat->normals and flat->triangle_count == 2 * 8 * 16) and ok;
+
+    auto soup = triangle_soup(50000);
+    auto soup_mesh = make_shared<triangle_mesh>(soup, shared_ptr<material>(), bvh_quality::medium, &stats);
+
+    std::cout << "Triangle soup, BVH: " << stats << '\n';
+    ok = check_mesh("mesh", *soup_mesh, *soup, 2000) and ok;
+
+    hittable_list world;
+    world.add(make_shared<instance>(soup_mesh, transform()));
+    ok = check_mesh("instance in bvh8", bvh8(world, 0, 1), *soup, 2000) and ok;
+
+    ok = load_obj("missing.obj") == nullptr and ok;
+    ok = load_mesh_binary("mesh_test_flat.obj") == nullptr and ok;
+
+    return ok ? 0 : 1;
+}
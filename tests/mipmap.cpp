@@ -0,0 +1,152 @@
+#include "../include/utility.h"
+#include "../include/mipmap.h"
+#include "../include/camera.h"
+#include "../include/sphere.h"
+#include "../include/instance.h"
+#include "../include/material.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+// Random RGB image, top row first
+std::vector<unsigned char> random_image(int width, int height) {
+    std::vector<unsigned char> pixels(3 * static_cast<size_t>(width) * height);
+
+    for (auto &c : pixels)
+        c = static_cast<unsigned char>(random_int(0, 255));
+
+    return pixels;
+}
+
+// Level 0 holds the image, and looking it up at the center of a texel gives that texel
+bool check_texels(int width, int height) {
+    auto pixels = random_image(width, height);
+    mipmap image(pixels.data(), width, height);
+    int mismatches = 0;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const auto *pixel = &pixels[3 * (static_cast<size_t>(y) * width + x)];
+            const auto *t = image.texel(0, x, y);
+            auto c = image.bilinear(0, (x + 0.5) / width, (y + 0.5) / height);
+
+            for (int i = 0; i < 3; i++)
+                mismatches += t[i] != pixel[i] or fabs(c[i] - pixel[i] / 255.0) > 1e-6;
+        }
+    }
+
+    const auto &last = image.levels.back();
+
+    std::cout << "  " << width << " x " << height << ": " << image.levels.size() << " levels, last "
+        << last.width << " x " << last.height << ", mismatches: " << mismatches << '\n';
+
+    return mismatches == 0 and last.width == 1 and last.height == 1;
+}
+
+// Mean and variance of lookups at random points with footprint
+void lookup_stats(const mipmap &image, real footprint, int count, double &mean, double &variance) {
+    double sum = 0, sum_squares = 0;
+
+    for (int i = 0; i < count; i++) {
+        auto value = image.lookup(random_double(), random_double(), footprint).x();
+        sum += value;
+        sum_squares += value * value;
+    }
+
+    mean = sum / count;
+    variance = sum_squares / count - mean * mean;
+}
+
+// Width of the footprint a camera ray gets on the object at the center of the image
+real center_footprint(const camera &cam, const hittable &object) {
+    hit_record rec;
+
+    if (!object.hit(cam.get_ray(0.5, 0.5), 0, infinity, rec))
+        return -1;
+
+    return rec.footprint;
+}
+
+int main() {
+    bool ok = true;
+
+    std::cout << "Texels\n";
+    for (auto size : {std::make_pair(1, 1), std::make_pair(4, 4), std::make_pair(37, 23), std::make_pair(256, 128)})
+        ok = check_texels(size.first, size.second) and ok;
+
+    // A checkerboard of single texels aliases when looked up at the finest level and
+    // averages to grey on the levels matching a wide footprint
+    const int checks = 256;
+    std::vector<unsigned char> board(3 * checks * checks);
+
+    for (int y = 0; y < checks; y++)
+        for (int x = 0; x < checks; x++)
+            for (int c = 0; c < 3; c++)
+                board[3 * (y * checks + x) + c] = ((x + y) % 2) ? 255 : 0;
+
+    mipmap checker(board.data(), checks, checks);
+
+    std::cout << "Checkerboard\n";
+
+    for (auto texels : {0, 4, 16, 64}) {
+        double mean, variance;
+        lookup_stats(checker, static_cast<real>(texels) / checks, 100000, mean, variance);
+
+        std::cout << "  footprint " << std::setw(2) << texels << " texels: mean " << std::setw(8) << mean
+            << ", variance " << variance << '\n';
+
+        if (texels >= 4)
+            ok = fabs(mean - 0.5) < 0.01 and variance < 0.005 and ok;
+    }
+
+    // Minified lookups scattered over a large image, like a distant textured sphere: the
+    // coarse levels stay in cache where the full image in rows doesn't
+    const int width = 4096, height = 2048, lookups = 2000000;
+    auto pixels = random_image(width, height);
+    mipmap large(pixels.data(), width, height);
+
+    std::cout << "Minified lookups\n";
+
+    for (int method = 0; method < 3; method++) {
+        const char *names[] = {"nearest, rows", "bilinear, full image", "trilinear, footprint"};
+        double sum = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int i = 0; i < lookups; i++) {
+            auto u = random_double(), v = random_double();
+
+            if (method == 0) {
+                auto x = static_cast<int>(u * width), y = static_cast<int>(v * height);
+                sum += pixels[3 * (static_cast<size_t>(y) * width + x)] / 255.0;
+            } else {
+                sum += large.lookup(u, v, method == 1 ? 0 : static_cast<real>(64.0 / width)).x();
+            }
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        std::cout << "  " << std::setw(20) << std::left << names[method] << std::right << ": " << std::setw(8)
+            << std::chrono::duration<double, std::milli>(end - start).count() << " ms, mean " << sum / lookups << '\n';
+    }
+
+    // Camera rays carry the width of a pixel, which a sphere turns into a footprint that
+    // grows with distance, and an instance scaling a sphere gives the same one as a sphere
+    // of that size
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    camera cam(point3(0, 0, 10), point3(0, 0, 0), vec3(0, 1, 0), 40, 2, 0, 10);
+    cam.set_image_height(400);
+
+    auto near = center_footprint(cam, sphere(point3(0, 0, 0), 2, white));
+    auto far = center_footprint(cam, sphere(point3(0, 0, -10), 2, white));
+    auto scaled = center_footprint(
+        cam, instance(make_shared<sphere>(point3(0, 0, 0), 1, white), transform::scaling(vec3(2, 2, 2)))
+    );
+
+    std::cout << "Footprints\n  near sphere " << near << ", far sphere " << far << ", scaled instance " << scaled << '\n';
+
+    ok = near > 0 and far > 1.9 * near and fabs(scaled - near) < 1e-6 * near and ok;
+
+    return ok ? 0 : 1;
+}
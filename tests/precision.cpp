@@ -0,0 +1,159 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/sphere.h"
+#include "../include/sphere_set.h"
+#include "../include/aarect.h"
+#include "../include/triangle_mesh.h"
+#include "../include/instance.h"
+#include "../include/material.h"
+
+#include <iostream>
+#include <iomanip>
+
+// Latitude/longitude sphere of flat triangles, a closed convex mesh
+shared_ptr<mesh_buffers> mesh_sphere(int rings, int segments) {
+    auto buffers = make_shared<mesh_buffers>();
+
+    for (int i = 0; i <= rings; i++) {
+        auto theta = pi * i / rings;
+
+        for (int j = 0; j < segments; j++) {
+            auto phi = 2 * pi * j / segments;
+
+            buffers->position_storage.push_back(static_cast<float>(sin(theta) * cos(phi)));
+            buffers->position_storage.push_back(static_cast<float>(cos(theta)));
+            buffers->position_storage.push_back(static_cast<float>(sin(theta) * sin(phi)));
+        }
+    }
+
+    for (uint32_t i = 0; i < static_cast<uint32_t>(rings); i++) {
+        for (uint32_t j = 0; j < static_cast<uint32_t>(segments); j++) {
+            uint32_t a = i * segments + j;
+            uint32_t b = i * segments + (j + 1) % segments;
+            uint32_t c = a + segments, d = b + segments;
+
+            for (auto index : {a, b, d, a, d, c})
+                buffers->index_storage.push_back(index);
+        }
+    }
+
+    buffers->use_storage();
+
+    return buffers;
+}
+
+// Shoots rays from distance away from the center of targets at points inside it, and
+// follows each hit on the outside of the object with the two rays a material would spawn
+// there: the mirror reflection and the ray going on through the surface. On a convex
+// object the reflection can't hit anything, and the ray going through has to hit a closed
+// object from the inside and nothing at all on an open surface. Returns the spawned rays
+// that don't, either with spawn_ray traced from t = 0 or, for comparison, started on the
+// surface and traced from a fixed t = 0.001.
+int spawn_failures(
+    const hittable &object, bool closed, bool use_offsets, const aabb &targets, real distance, int ray_count
+) {
+    int failures = 0;
+
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = targets.centroid() + distance * random_unit_vector();
+        auto target = targets.min() + vec3::random() * (targets.max() - targets.min());
+        ray r(origin, target - origin, 0);
+
+        // A ray slipping through a crack between two triangles sees a closed object from
+        // the inside, which isn't what is tested here
+        hit_record rec;
+        if (!object.hit(r, 0, infinity, rec) or (closed and !rec.front_face))
+            continue;
+
+        auto reflected = reflect(unit_vector(r.direction()), rec.normal);
+        ray spawned[2] = {
+            use_offsets ? rec.spawn_ray(reflected, 0) : ray(rec.p, reflected, 0),
+            use_offsets ? rec.spawn_ray(r.direction(), 0) : ray(rec.p, r.direction(), 0)
+        };
+
+        for (int k = 0; k < 2; k++) {
+            hit_record next;
+            if (!object.hit(spawned[k], use_offsets ? 0 : static_cast<real>(0.001), infinity, next)) {
+                // The ray going into a closed object has to leave it again
+                failures += (k == 1 and closed);
+                continue;
+            }
+
+            failures += (k == 0 or !closed or next.front_face);
+        }
+    }
+
+    return failures;
+}
+
+int main() {
+    bool ok = true;
+
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto triangles = make_shared<triangle_mesh>(mesh_sphere(32, 64), white);
+
+    std::cout << "Precision: " << (sizeof(real) == sizeof(float) ? "float" : "double") << '\n';
+
+    // Objects of a size placed at a distance from the world origin and seen from a distance,
+    // as small as a particle and as far as the final scene
+    real scales[][3] = {
+        {1, 0, 0}, {555, 0, 0}, {1, 300, 0}, {100, 2000, 0}, {0.01f, 0, 0}, {0.01f, 5, 0},
+        {10, 20000, 0}, {1, 0, 1000}, {0.01f, 0, 100}
+    };
+
+    for (auto &scale : scales) {
+        auto size = scale[0];
+        auto position = point3(scale[1], scale[1] / 2, -scale[1]);
+        auto distance = scale[2];
+
+        sphere_buffers spheres;
+        spheres.add(position, size / 2, 0);
+
+        struct test_object {
+            const char *name;
+            shared_ptr<hittable> object;
+            bool closed;
+        } objects[] = {
+            {"sphere", make_shared<sphere>(position, size / 2, white), true},
+            {"sphere_set", make_shared<sphere_set>(spheres, std::vector<shared_ptr<material>>{white}), true},
+            {"rect", make_shared<xz_rect>(
+                position.x(), position.x() + size, position.z(), position.z() + size, position.y(), white
+            ), false},
+            {"mesh instance", make_shared<instance>(
+                triangles, transform::translation(position) * transform::rotation_y(30) * transform::scaling(vec3(size, size, size) / 2)
+            ), true}
+        };
+
+        std::cout << "size " << size << " at " << position << ", seen from " << distance << '\n';
+
+        for (auto &o : objects) {
+            aabb bounds;
+            o.object->bounding_box(0, 1, bounds);
+            auto seen_from = std::max(distance, (bounds.max() - bounds.min()).length());
+
+            auto fixed = spawn_failures(*o.object, o.closed, false, bounds, seen_from, 20000);
+            auto offset = spawn_failures(*o.object, o.closed, true, bounds, seen_from, 20000);
+
+            std::cout << "  " << std::setw(14) << std::left << o.name << std::right
+                << "  failures, fixed t_min: " << std::setw(6) << fixed
+                << ", offset origins: " << offset << '\n';
+
+            ok = offset == 0 and ok;
+        }
+    }
+
+    // The ground of the random scenes, hit next to the world origin, far from its center
+    sphere ground(point3(0, -1000, 0), 1000, white);
+    aabb targets(point3(-5, -0.1, -5), point3(5, 0.1, 5));
+
+    auto fixed = spawn_failures(ground, true, false, targets, 10, 20000);
+    auto offset = spawn_failures(ground, true, true, targets, 10, 20000);
+
+    std::cout << "ground sphere\n  " << std::setw(14) << std::left << "sphere" << std::right
+        << "  failures, fixed t_min: " << std::setw(6) << fixed
+        << ", offset origins: " << offset << '\n';
+
+    ok = offset == 0 and ok;
+
+    return ok ? 0 : 1;
+}
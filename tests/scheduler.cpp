@@ -0,0 +1,64 @@
+#include "../include/render_scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Renders a fake image whose cost varies a lot between rows, and checks that every
+// pixel was rendered exactly once
+bool check_schedule(int width, int height, int tile_size, int thread_count) {
+    render_scheduler scheduler(width, height, tile_size, thread_count);
+
+    std::vector<std::atomic<int>> visits(width * height);
+    for (auto &v : visits)
+        v = 0;
+
+    std::vector<int> tiles_per_thread(scheduler.thread_count, 0);
+    size_t last_progress = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    scheduler.run([&](const render_tile &tile) {
+        volatile double work = 0;
+
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                visits[j * width + i]++;
+
+                // The bottom rows are much more expensive, like the floor of a scene
+                for (int k = 0; k < ((j > height / 2) ? 2000 : 10); k++)
+                    work = work + k;
+            }
+        }
+
+        tiles_per_thread[omp_get_thread_num()]++;
+    }, [&](size_t done, size_t) {
+        last_progress = done;
+    });
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    int wrong = 0;
+    for (auto &v : visits)
+        wrong += (v != 1);
+
+    std::cout << width << "x" << height << " tiles of " << tile_size << " on "
+        << scheduler.thread_count << " threads: "
+        << std::chrono::duration<double, std::milli>(end - start).count() << " ms, tiles per thread:";
+    for (auto count : tiles_per_thread)
+        std::cout << ' ' << count;
+    std::cout << ", pixels not rendered once: " << wrong << '\n';
+
+    return wrong == 0 and last_progress <= scheduler.tiles.size();
+}
+
+int main() {
+    bool ok = check_schedule(200, 150, 16, 0);
+    ok = check_schedule(200, 150, 16, 1) and ok;
+    ok = check_schedule(203, 97, 8, 4) and ok;
+    ok = check_schedule(64, 64, 64, 8) and ok;
+    ok = check_schedule(400, 300, 16, 16) and ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/sphere.h"
+#include "../include/sphere_set.h"
+#include "../include/material.h"
+#include "../include/wide_bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+// Random spheres inside a 165 unit cube, like the clusters of the final scene
+sphere_buffers random_spheres(int sphere_count, int material_count) {
+    sphere_buffers spheres;
+
+    for (int i = 0; i < sphere_count; i++)
+        spheres.add(point3::random(0, 165), random_double(2, 12), static_cast<uint32_t>(i % material_count));
+
+    return spheres;
+}
+
+// Traces random rays at the set and at a hierarchy of sphere objects holding the same
+// spheres, and counts the hit records that differ
+bool check_set(
+    const char *name, const sphere_set &set, const sphere_buffers &spheres,
+    const std::vector<shared_ptr<material>> &materials, int ray_count
+) {
+    hittable_list list;
+    for (size_t i = 0; i < spheres.size(); i++)
+        list.add(make_shared<sphere>(spheres.sphere_center(i), spheres.radius[i], materials[spheres.material[i]]));
+
+    bvh8 reference(list, 0, 1);
+
+    aabb bounds;
+    set.bounding_box(0, 1, bounds);
+    auto center = bounds.centroid();
+    auto radius = (bounds.max() - bounds.min()).length();
+
+    int mismatches = 0, hits = 0;
+    double set_ms = 0, reference_ms = 0;
+
+    for (int i = 0; i < ray_count; i++) {
+        // Half of the rays start inside the cube, so some start inside a sphere
+        auto origin = (i % 2) ? center + radius * random_unit_vector() : bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+        auto target = bounds.min() + vec3::random() * (bounds.max() - bounds.min());
+        ray r(origin, target - origin, 0);
+
+        hit_record expected, rec;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        bool expected_hit = reference.hit(r, 0.001, infinity, expected);
+        auto middle = std::chrono::high_resolution_clock::now();
+        bool hit = set.hit(r, 0.001, infinity, rec);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        reference_ms += std::chrono::duration<double, std::milli>(middle - start).count();
+        set_ms += std::chrono::duration<double, std::milli>(end - middle).count();
+
+        hits += hit;
+
+        if (hit != expected_hit) {
+            mismatches++;
+        } else if (hit) {
+            bool same = fabs(rec.t - expected.t) <= 1e-9 * expected.t and rec.mat_ptr == expected.mat_ptr
+                and (rec.normal - expected.normal).length() < 1e-6 and rec.front_face == expected.front_face
+                and fabs(rec.u - expected.u) < 1e-6 and fabs(rec.v - expected.v) < 1e-6;
+
+            mismatches += !same;
+        }
+    }
+
+    std::cout << "  " << std::setw(16) << std::left << name << std::right
+        << "  spheres: " << std::setw(8) << reference_ms << " ms"
+        << ", sphere_set: " << std::setw(8) << set_ms << " ms"
+        << "  hits: " << hits << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0 and hits > 0;
+}
+
+int main() {
+    bool ok = true;
+
+    std::vector<shared_ptr<material>> materials = {
+        make_shared<lambertian>(color(.73, .73, .73)),
+        make_shared<metal>(color(.8, .85, .88), 0.2),
+        make_shared<dielectric>(1.5)
+    };
+
+    // Sizes that leave partial packs
+    for (int count : {1, 5, 8, 13, 1000, 20000}) {
+        auto spheres = random_spheres(count, 3);
+
+        bvh_build_stats stats;
+        sphere_set set(spheres, materials, bvh_quality::medium, &stats);
+
+        std::cout << count << " spheres, BVH: " << stats << '\n';
+        ok = check_set("set", set, spheres, materials, 20000) and ok;
+    }
+
+    // The binary file round trip keeps the spheres, at float precision
+    auto spheres = random_spheres(1000, 3);
+    for (int a = 0; a < 3; a++) {
+        for (auto &c : spheres.center[a])
+            c = static_cast<float>(c);
+    }
+    for (auto &r : spheres.radius)
+        r = static_cast<float>(r);
+
+    save_spheres_binary("sphere_set_test.rts", spheres);
+    auto loaded = load_spheres_binary("sphere_set_test.rts");
+
+    if (!loaded or loaded->size() != spheres.size() or loaded->material != spheres.material
+        or loaded->radius != spheres.radius or loaded->center[0] != spheres.center[0]) {
+        std::cout << "Binary sphere loading failed\n";
+        return 1;
+    }
+
+    ok = check_set("binary", sphere_set(*loaded, materials), *loaded, materials, 20000) and ok;
+
+    // Other files and materials that don't exist are refused
+    std::vector<shared_ptr<material>> too_few = {materials[0]};
+    sphere_set refused(spheres, too_few);
+
+    ok = load_spheres_binary("sphere_set_test.missing") == nullptr and ok;
+    ok = refused.nodes.empty() and ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+#include "../include/utility.h"
+#include "../include/hittable_list.h"
+#include "../include/sphere.h"
+#include "../include/aarect.h"
+#include "../include/box.h"
+#include "../include/material.h"
+#include "../include/wide_bvh.h"
+#include "../include/wavefront.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+// Cornell box with the lambertian, metal, dielectric and diffuse_light materials
+hittable_list test_scene() {
+    hittable_list objects;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+    objects.add(make_shared<sphere>(point3(400, 90, 150), 80, make_shared<metal>(color(0.8, 0.85, 0.88), 0.2)));
+    objects.add(make_shared<box>(point3(300, 0, 300), point3(465, 200, 465), white));
+
+    return objects;
+}
+
+// The estimate of one path traced depth-first, as the iterative integrator does
+color reference_path(ray r, const hittable &world, const shared_ptr<hittable> &lights, int max_depth) {
+    color radiance(0, 0, 0), throughput(1, 1, 1);
+    hit_record rec;
+
+    for (int bounce = 0; ; bounce++) {
+        if (!world.hit(r, 0.001, infinity, rec))
+            return radiance;
+
+        if (!scatter_path(r, rec, lights, throughput, radiance) or bounce + 1 >= max_depth)
+            return radiance;
+
+        if (bounce >= roulette_bounces and !survive_roulette(throughput))
+            return radiance;
+    }
+}
+
+// Paths traced through the wavefront must give exactly the depth-first results, whatever
+// order its stages process them in
+bool check_wavefront(const hittable &world, const shared_ptr<hittable> &lights, int path_count) {
+    wavefront_integrator wavefront(world, lights, color(0, 0, 0), 50);
+    std::vector<color> expected;
+
+    auto &rng = thread_random_stream();
+    double reference_ms = 0;
+
+    for (int p = 0; p < path_count; p++) {
+        rng = random_stream(p / 16, p % 16);
+
+        // Groups of 16 rays through the same point of the back wall, like pixel samples
+        auto target = point3(555 * random_double(), 555 * random_double(), 555);
+        ray r(point3(278, 278, -800), target - point3(278, 278, -800) + vec3::random(-1, 1), 0);
+
+        wavefront.add_path(r, rng);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        expected.push_back(reference_path(r, world, lights, 50));
+        auto end = std::chrono::high_resolution_clock::now();
+        reference_ms += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    wavefront.trace();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    int mismatches = 0;
+    for (int p = 0; p < path_count; p++) {
+        auto c = wavefront.result(p);
+        bool same = true;
+
+        for (int a = 0; a < 3; a++)
+            same = same and (c[a] == expected[p][a] or (c[a] != c[a] and expected[p][a] != expected[p][a]));
+
+        mismatches += !same;
+    }
+
+    std::cout << "  " << path_count << " paths, depth-first: " << std::setw(8) << reference_ms << " ms"
+        << ", wavefront: " << std::setw(8) << std::chrono::duration<double, std::milli>(end - start).count() << " ms"
+        << "  mismatches: " << mismatches << '\n';
+
+    return mismatches == 0;
+}
+
+int main() {
+    bool ok = true;
+
+    bvh8 world(test_scene(), 0, 1);
+
+    auto lights = make_shared<hittable_list>();
+    lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    lights->add(make_shared<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));
+
+    ok = check_wavefront(world, lights, 1) and ok;
+    ok = check_wavefront(world, lights, 4096) and ok;
+
+    return ok ? 0 : 1;
+}